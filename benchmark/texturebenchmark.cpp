@@ -0,0 +1,119 @@
+#include "common/benchmark.h"
+#include "common/common.h"
+#include "common/texture.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Microbenchmark for the texel layouts and formats of Texture. The same
+// lookups are run once with scanline and once with tiled storage, either in
+// random order or in the order of a tiled render loop walking over a rotated
+// terrain mapping. Then the tiled texture is converted to each storage format
+// to compare memory, decode cost and the error against the 8-bit texels.
+//
+// Usage: texturebenchmark [image file]
+// Without a file a procedural 4096x4096 texture is used.
+
+// Scale of the coherent mapping in texels per screen pixel
+static float const texelsPerPixel = 1.0f;
+// Size of the screen and of its tiles in pixels
+static int const screenSize = 1024;
+static int const tileSize = 8;
+
+Texture proceduralTexture(int size) {
+  Texture texture(size, size);
+  for (int y = 0; y < size; ++y)
+    for (int x = 0; x < size; ++x)
+      texture.setPixelAt(x, y, Color((x ^ y) & 0xff, (x*y) & 0xff, (x+y) & 0xff)/255.0f);
+  return texture;
+}
+
+std::vector<Vector2d> randomLookups(int count) {
+  std::mt19937 generator(42);
+  std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+  std::vector<Vector2d> lookups;
+  lookups.reserve(count);
+  for (int i = 0; i < count; ++i)
+    lookups.push_back(Vector2d(distribution(generator), distribution(generator)));
+  return lookups;
+}
+
+std::vector<Vector2d> coherentLookups(int textureSize) {
+  // A rotation of 30 degrees makes sure screen rows do not run along texel rows
+  float const scale = texelsPerPixel / textureSize;
+  float const cosine = std::cos(PI/6) * scale;
+  float const sine = std::sin(PI/6) * scale;
+
+  std::vector<Vector2d> lookups;
+  lookups.reserve(screenSize*screenSize);
+  for (int ty = 0; ty < screenSize; ty += tileSize)
+    for (int tx = 0; tx < screenSize; tx += tileSize)
+      for (int y = ty; y < ty+tileSize; ++y)
+        for (int x = tx; x < tx+tileSize; ++x)
+          lookups.push_back(Vector2d(0.5f + cosine*x - sine*y, 0.25f + sine*x + cosine*y));
+  return lookups;
+}
+
+void run(char const* name, Texture const& texture, std::vector<Vector2d> const& lookups) {
+  // Warm up once, then measure
+  Color sum;
+  for (int pass = 0; pass < 2; ++pass) {
+    sum = Color();
+    Timer timer;
+    timer.start();
+    for (unsigned int i = 0; i < lookups.size(); ++i)
+      sum += texture.color(lookups[i]);
+    timer.end();
+
+    if (pass == 1) {
+      float const nanoseconds = timer.getMicroseconds().count() * 1000.0f / lookups.size();
+      printf("  %-10s %8.2f ns/lookup %8.2f Mlookups/s  (checksum %.1f)\n",
+             name, nanoseconds, 1000.0f/nanoseconds, sum.r+sum.g+sum.b);
+    }
+  }
+}
+
+int main(int argc, char ** argv) {
+  Texture texture = argc > 1 ? Texture(argv[1]) : proceduralTexture(4096);
+  if (texture.isNull())
+    return 1;
+  printf("(TextureBenchmark): %dx%d texels, %d lookups per pattern\n",
+         texture.width(), texture.height(), screenSize*screenSize);
+
+  std::vector<Vector2d> const random = randomLookups(screenSize*screenSize);
+  std::vector<Vector2d> const coherent = coherentLookups(texture.width());
+
+  Texture::Layout const layouts[] = { Texture::SCANLINE, Texture::TILED };
+  char const* layoutNames[] = { "scanline", "tiled" };
+  for (int i = 0; i < 2; ++i) {
+    texture.setLayout(layouts[i]);
+    printf("%s layout\n", layoutNames[i]);
+    run("random", texture, random);
+    run("coherent", texture, coherent);
+  }
+
+  Texture::Format const formats[] = { Texture::RGBA8, Texture::BC1, Texture::BC5, Texture::HALF };
+  char const* formatNames[] = { "rgba8", "bc1", "bc5", "half" };
+  for (int i = 0; i < 4; ++i) {
+    Texture converted = texture;
+    converted.setFormat(formats[i]);
+
+    // Mean absolute error per channel, BC5 only keeps red and green
+    double error = 0.0;
+    for (int y = 0; y < texture.height(); ++y)
+      for (int x = 0; x < texture.width(); ++x) {
+        Color const delta = converted.pixel(x,y) - texture.pixel(x,y);
+        error += std::fabs(delta.r) + std::fabs(delta.g) +
+                 (formats[i] == Texture::BC5 ? 0.0f : std::fabs(delta.b));
+      }
+    error /= (formats[i] == Texture::BC5 ? 2.0 : 3.0) * texture.width() * texture.height();
+
+    printf("%s format, %.1f MiB, mean error %.4f\n", formatNames[i],
+           converted.memoryUsage() / 1048576.0, error);
+    run("random", converted, random);
+    run("coherent", converted, coherent);
+  }
+  return 0;
+}
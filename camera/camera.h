@@ -2,6 +2,7 @@
 #define CAMERA_H
 
 #include "common/ray.h"
+#include "common/raypacket.h"
 
 class Camera {
 
@@ -13,6 +14,25 @@ public:
   // Camera functions
   virtual Ray castRay(float x, float y) const = 0;
 
+  // Cast a ray together with its differentials, where pixelWidth and
+  // pixelHeight are the steps in x and y to the neighboring pixels.
+  // Cameras without support for differentials return a plain ray.
+  virtual Ray castDifferentialRay(float x, float y,
+                                  float pixelWidth, float pixelHeight) const {
+    (void)pixelWidth; (void)pixelHeight; // unused in the default implementation
+    return this->castRay(x, y);
+  }
+
+  // Cast the differential rays through the points (x[i], y[i]) into a
+  // packet, the default implementation casts them one by one
+  virtual void castPacket(int count, float const* x, float const* y,
+                          float pixelWidth, float pixelHeight, RayPacket * packet) const {
+    packet->count = count;
+    for (int i = 0; i < count; ++i)
+      packet->rays[i] = this->castDifferentialRay(x[i], y[i], pixelWidth, pixelHeight);
+    packet->update();
+  }
+
 };
 
 #endif
@@ -2,21 +2,102 @@
 #include <iostream>
 
 PerspectiveCamera::PerspectiveCamera()
-  : forwardDirection_(0,0,-1), upDirection_(0,1,0), fovAngle_(70) {}
+  : forwardDirection_(0,0,-1), upDirection_(0,1,0), fovAngle_(70) {
+  this->updateBasis();
+}
 
-Ray PerspectiveCamera::castRay(float x, float y) const {
+void PerspectiveCamera::updateBasis() {
   // Set up the coordinate system
-  Vector3d const zAxis = normalized(this->forwardDirection_);
-  Vector3d const xAxis = normalized(crossProduct(zAxis, this->upDirection_));
-  Vector3d const yAxis = normalized(crossProduct(xAxis, zAxis));
+  this->zAxis_ = normalized(this->forwardDirection_);
+  this->xAxis_ = normalized(crossProduct(this->zAxis_, this->upDirection_));
+  this->yAxis_ = normalized(crossProduct(this->xAxis_, this->zAxis_));
 
   // Calculate the focus
-  float const focus = 1.0 / std::tan((this->fovAngle_*PI/180) / 2);
+  this->focus_ = 1.0 / std::tan((this->fovAngle_*PI/180) / 2);
+}
 
+Ray PerspectiveCamera::castRay(float x, float y) const {
   // Create a ray
   Ray ray;
   ray.origin = this->position_;
-  ray.direction = x*xAxis + y*yAxis + focus*zAxis;
+  ray.direction = x*this->xAxis_ + y*this->yAxis_ + this->focus_*this->zAxis_;
   normalize(&ray.direction);
   return ray;
 }
+
+Ray PerspectiveCamera::castDifferentialRay(float x, float y,
+                                           float pixelWidth, float pixelHeight) const {
+  // Create a ray
+  Ray ray;
+  ray.origin = this->position_;
+  Vector3d const direction = x*this->xAxis_ + y*this->yAxis_ + this->focus_*this->zAxis_;
+  float const directionLength = length(direction);
+  ray.direction = direction / directionLength;
+
+  // Derivatives of the normalized direction, all rays share the same origin
+  float const cubedLength = directionLength*directionLength*directionLength;
+  ray.hasDifferentials = true;
+  ray.directionDx = (dotProduct(direction,direction)*this->xAxis_ - dotProduct(direction,this->xAxis_)*direction)
+      * (pixelWidth/cubedLength);
+  ray.directionDy = (dotProduct(direction,direction)*this->yAxis_ - dotProduct(direction,this->yAxis_)*direction)
+      * (pixelHeight/cubedLength);
+  return ray;
+}
+
+void PerspectiveCamera::castPacket(int count, float const* x, float const* y,
+                                   float pixelWidth, float pixelHeight, RayPacket * packet) const {
+  // Same rays as castDifferentialRay, set up for four of them at a time
+  Vector3d const& X = this->xAxis_;
+  Vector3d const& Y = this->yAxis_;
+  Vector3d const Z = this->focus_*this->zAxis_;
+  packet->count = count;
+  for (int i = 0; i < RayPacket::size; i += 4) {
+    // Unused slots repeat the first point
+    alignas(16) float xs[4], ys[4];
+    for (int k = 0; k < 4; ++k) {
+      xs[k] = x[i+k < count ? i+k : 0];
+      ys[k] = y[i+k < count ? i+k : 0];
+    }
+    __m128 const px = _mm_load_ps(xs);
+    __m128 const py = _mm_load_ps(ys);
+
+    // Unnormalized directions and their lengths
+    __m128 const dx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(X.x)), _mm_mul_ps(py, _mm_set1_ps(Y.x))), _mm_set1_ps(Z.x));
+    __m128 const dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(X.y)), _mm_mul_ps(py, _mm_set1_ps(Y.y))), _mm_set1_ps(Z.y));
+    __m128 const dz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(X.z)), _mm_mul_ps(py, _mm_set1_ps(Y.z))), _mm_set1_ps(Z.z));
+    __m128 const squaredLength = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 const directionLength = _mm_sqrt_ps(squaredLength);
+    _mm_store_ps(packet->directionX + i, _mm_div_ps(dx, directionLength));
+    _mm_store_ps(packet->directionY + i, _mm_div_ps(dy, directionLength));
+    _mm_store_ps(packet->directionZ + i, _mm_div_ps(dz, directionLength));
+
+    // Projections onto the image plane axes for the differentials
+    __m128 const dotX = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(X.x)), _mm_mul_ps(dy, _mm_set1_ps(X.y))), _mm_mul_ps(dz, _mm_set1_ps(X.z)));
+    __m128 const dotY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(Y.x)), _mm_mul_ps(dy, _mm_set1_ps(Y.y))), _mm_mul_ps(dz, _mm_set1_ps(Y.z)));
+    __m128 const cubedLength = _mm_mul_ps(squaredLength, directionLength);
+    alignas(16) float dxs[4], dys[4], dzs[4], squared[4], dotXs[4], dotYs[4], cubed[4];
+    _mm_store_ps(dxs, dx);
+    _mm_store_ps(dys, dy);
+    _mm_store_ps(dzs, dz);
+    _mm_store_ps(squared, squaredLength);
+    _mm_store_ps(dotXs, dotX);
+    _mm_store_ps(dotYs, dotY);
+    _mm_store_ps(cubed, cubedLength);
+
+    for (int k = 0; k < 4; ++k) {
+      int const index = i + k;
+      Ray & ray = packet->rays[index];
+      ray = Ray();
+      ray.origin = this->position_;
+      ray.direction = Vector3d(packet->directionX[index], packet->directionY[index], packet->directionZ[index]);
+      Vector3d const direction(dxs[k], dys[k], dzs[k]);
+      ray.hasDifferentials = true;
+      ray.directionDx = (squared[k]*X - dotXs[k]*direction) * (pixelWidth/cubed[k]);
+      ray.directionDy = (squared[k]*Y - dotYs[k]*direction) * (pixelHeight/cubed[k]);
+      packet->originX[index] = this->position_.x;
+      packet->originY[index] = this->position_.y;
+      packet->originZ[index] = this->position_.z;
+      packet->length[index] = index < count ? ray.length : 0.0f;
+    }
+  }
+}
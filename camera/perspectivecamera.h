@@ -18,12 +18,25 @@ public:
 
   // Set
   void setPosition(Vector3d const& position) { this->position_ = position; }
-  void setForwardDirection(Vector3d const& forwardDirection) { this->forwardDirection_ = normalized(forwardDirection); }
-  void setUpDirection(Vector3d const& upDirection) { this->upDirection_ = normalized(upDirection); }
-  void setFovAngle(float fovAngle) { this->fovAngle_ = fovAngle; }
+  void setForwardDirection(Vector3d const& forwardDirection) {
+    this->forwardDirection_ = normalized(forwardDirection);
+    this->updateBasis();
+  }
+  void setUpDirection(Vector3d const& upDirection) {
+    this->upDirection_ = normalized(upDirection);
+    this->updateBasis();
+  }
+  void setFovAngle(float fovAngle) {
+    this->fovAngle_ = fovAngle;
+    this->updateBasis();
+  }
 
   // Camera functions
   virtual Ray castRay(float x, float y) const;
+  virtual Ray castDifferentialRay(float x, float y,
+                                  float pixelWidth, float pixelHeight) const;
+  virtual void castPacket(int count, float const* x, float const* y,
+                          float pixelWidth, float pixelHeight, RayPacket * packet) const;
 
 protected:
   Vector3d position_;
@@ -31,6 +44,14 @@ protected:
   Vector3d upDirection_;
   float fovAngle_;
 
+private:
+  // Set up the coordinate system and the focus, which only change with the
+  // setters, instead of for every ray
+  void updateBasis();
+
+  Vector3d xAxis_, yAxis_, zAxis_;
+  float focus_;
+
 };
 
 #endif
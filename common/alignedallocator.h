@@ -0,0 +1,37 @@
+#ifndef ALIGNEDALLOCATOR_H
+#define ALIGNEDALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <mm_malloc.h>
+
+// Allocator for std::vector that places the storage on an aligned address,
+// e.g. on a cache line boundary for texel and framebuffer data.
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  // Constructor
+  AlignedAllocator() {}
+  template <typename U>
+  AlignedAllocator(AlignedAllocator<U, Alignment> const&) {}
+
+  T * allocate(std::size_t count) {
+    void * pointer = _mm_malloc(count * sizeof(T), Alignment);
+    if (!pointer)
+      throw std::bad_alloc();
+    return static_cast<T*>(pointer);
+  }
+  void deallocate(T * pointer, std::size_t) { _mm_free(pointer); }
+};
+
+// Comparison operators ////////////////////////////////////////////////////////
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(AlignedAllocator<T, Alignment> const&, AlignedAllocator<U, Alignment> const&) { return true; }
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(AlignedAllocator<T, Alignment> const&, AlignedAllocator<U, Alignment> const&) { return false; }
+
+#endif // ALIGNEDALLOCATOR_H
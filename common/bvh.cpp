@@ -0,0 +1,365 @@
+#include "common/bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+static float surfaceArea(Vector3d const& minimum, Vector3d const& maximum) {
+  Vector3d const extent = maximum - minimum;
+  return 2.0f*(extent.x*extent.y + extent.y*extent.z + extent.z*extent.x);
+}
+
+static bool isBounded(BoundingBox const& box) {
+  Vector3d const extent = box.maximumCorner - box.minimumCorner;
+  return std::isfinite(extent.x) && std::isfinite(extent.y) && std::isfinite(extent.z);
+}
+
+Bvh::Bvh(std::vector<Primitive*> const& primitives, float rebuildThreshold)
+  : rebuildThreshold_(rebuildThreshold) {
+  for (unsigned int i = 0; i < primitives.size(); ++i) {
+    if (isBounded(primitives[i]->boundingBox()))
+      this->primitives_.push_back(primitives[i]);
+    else
+      this->unbounded_.push_back(primitives[i]);
+  }
+  this->tree_ = build(this->primitives_, this->primitiveBounds());
+  printf("(Bvh): %zu primitives organized into %zu nodes\n",
+         this->primitives_.size(), this->tree_->nodes.size());
+}
+
+Bvh::~Bvh() {
+  if (this->rebuild_.valid())
+    this->rebuild_.wait();
+}
+
+std::vector<BoundingBox> Bvh::primitiveBounds() const {
+  std::vector<BoundingBox> bounds(this->primitives_.size());
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < static_cast<int>(bounds.size()); ++i)
+    bounds[i] = this->primitives_[i]->boundingBox();
+  return bounds;
+}
+
+
+// Construction ////////////////////////////////////////////////////////////////
+
+std::unique_ptr<Bvh::Tree> Bvh::build(std::vector<Primitive*> const& primitives,
+                                      std::vector<BoundingBox> const& bounds) {
+  std::unique_ptr<Tree> tree(new Tree());
+  int const count = primitives.size();
+  if (count == 0) {
+    tree->cost = tree->builtCost = 0.0f;
+    return tree;
+  }
+
+  std::vector<Vector3d> centroids(count);
+  std::vector<int> indices(count);
+  for (int i = 0; i < count; ++i) {
+    centroids[i] = (bounds[i].minimumCorner + bounds[i].maximumCorner)*0.5f;
+    indices[i] = i;
+  }
+  tree->nodes.reserve(2*count);
+  buildNode(tree.get(), &indices, 0, count, bounds, centroids, 0);
+
+  // The leaves refer to the primitives in the order of the partitioned indices
+  tree->primitives.resize(count);
+  for (int i = 0; i < count; ++i)
+    tree->primitives[i] = primitives[indices[i]];
+  tree->cost = tree->builtCost = sahCost(*tree);
+  return tree;
+}
+
+int Bvh::buildNode(Tree * tree, std::vector<int> * indices, int begin, int end,
+                   std::vector<BoundingBox> const& bounds,
+                   std::vector<Vector3d> const& centroids, int depth) {
+  int const index = tree->nodes.size();
+  tree->nodes.push_back(Node());
+
+  // Bounds of the primitives and of their centroids
+  Node node;
+  node.minimum = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+  node.maximum = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+  Vector3d centroidMinimum = node.minimum, centroidMaximum = node.maximum;
+  for (int i = begin; i < end; ++i) {
+    int const primitive = (*indices)[i];
+    node.minimum = minimum(node.minimum, bounds[primitive].minimumCorner);
+    node.maximum = maximum(node.maximum, bounds[primitive].maximumCorner);
+    centroidMinimum = minimum(centroidMinimum, centroids[primitive]);
+    centroidMaximum = maximum(centroidMaximum, centroids[primitive]);
+  }
+  node.first = begin;
+  node.count = end - begin;
+  node.axis = 0;
+
+  // Find the cheapest split between bins of the centroids along each axis
+  int const count = end - begin;
+  float bestCost = INFINITY;
+  int bestAxis = -1, bestBin = 0;
+  if (count > maximumLeafSize && depth < maximumDepth) {
+    for (int axis = 0; axis < 3; ++axis) {
+      float const extent = centroidMaximum[axis] - centroidMinimum[axis];
+      if (!(extent > 0.0f))
+        continue;
+      float const scale = binCount/extent;
+      int binCounts[binCount] = {0};
+      Vector3d binMinimum[binCount], binMaximum[binCount];
+      for (int b = 0; b < binCount; ++b) {
+        binMinimum[b] = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+        binMaximum[b] = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+      }
+      for (int i = begin; i < end; ++i) {
+        int const primitive = (*indices)[i];
+        int const b = std::min(binCount-1, static_cast<int>((centroids[primitive][axis]-centroidMinimum[axis])*scale));
+        ++binCounts[b];
+        binMinimum[b] = minimum(binMinimum[b], bounds[primitive].minimumCorner);
+        binMaximum[b] = maximum(binMaximum[b], bounds[primitive].maximumCorner);
+      }
+
+      // Sweep from the right to get the cost of the right sides, then from
+      // the left to evaluate the splits
+      float rightCost[binCount];
+      Vector3d sweepMinimum(+INFINITY, +INFINITY, +INFINITY), sweepMaximum(-INFINITY, -INFINITY, -INFINITY);
+      int sweepCount = 0;
+      for (int b = binCount-1; b > 0; --b) {
+        sweepMinimum = minimum(sweepMinimum, binMinimum[b]);
+        sweepMaximum = maximum(sweepMaximum, binMaximum[b]);
+        sweepCount += binCounts[b];
+        rightCost[b] = sweepCount ? surfaceArea(sweepMinimum, sweepMaximum)*sweepCount : 0.0f;
+      }
+      sweepMinimum = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+      sweepMaximum = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+      sweepCount = 0;
+      for (int b = 0; b < binCount-1; ++b) {
+        sweepMinimum = minimum(sweepMinimum, binMinimum[b]);
+        sweepMaximum = maximum(sweepMaximum, binMaximum[b]);
+        sweepCount += binCounts[b];
+        if (sweepCount == 0 || sweepCount == count)
+          continue;
+        float const cost = surfaceArea(sweepMinimum, sweepMaximum)*sweepCount + rightCost[b+1];
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestBin = b;
+        }
+      }
+    }
+  }
+
+  // Make a leaf if no split is cheaper than testing all primitives, with a
+  // traversal as expensive as a primitive test
+  float const area = surfaceArea(node.minimum, node.maximum);
+  if (bestAxis < 0 || (count <= 4*maximumLeafSize && 1.0f + bestCost/area >= count)) {
+    tree->nodes[index] = node;
+    return index;
+  }
+
+  // Partition the primitives by the bin of their centroids
+  float const scale = binCount/(centroidMaximum[bestAxis] - centroidMinimum[bestAxis]);
+  int const middle = std::partition(indices->begin()+begin, indices->begin()+end, [&](int primitive) {
+    return std::min(binCount-1, static_cast<int>((centroids[primitive][bestAxis]-centroidMinimum[bestAxis])*scale)) <= bestBin;
+  }) - indices->begin();
+
+  buildNode(tree, indices, begin, middle, bounds, centroids, depth+1);
+  node.first = buildNode(tree, indices, middle, end, bounds, centroids, depth+1);
+  node.count = 0;
+  node.axis = bestAxis;
+  tree->nodes[index] = node;
+  return index;
+}
+
+float Bvh::sahCost(Tree const& tree) {
+  if (tree.nodes.empty())
+    return 0.0f;
+  float const rootArea = surfaceArea(tree.nodes[0].minimum, tree.nodes[0].maximum);
+  if (!(rootArea > 0.0f))
+    return 0.0f;
+  float cost = 0.0f;
+  for (unsigned int i = 0; i < tree.nodes.size(); ++i) {
+    Node const& node = tree.nodes[i];
+    cost += surfaceArea(node.minimum, node.maximum)*(node.count ? node.count : 1);
+  }
+  return cost/rootArea;
+}
+
+
+// Update functions ////////////////////////////////////////////////////////////
+
+void Bvh::refit() {
+  // Take over a finished rebuild, which is then refitted like the old tree
+  if (this->rebuild_.valid()
+      && this->rebuild_.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    this->tree_ = this->rebuild_.get();
+
+  // The leaves first, all at once...
+  Tree & tree = *this->tree_;
+  int const nodeCount = tree.nodes.size();
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < nodeCount; ++i) {
+    Node & node = tree.nodes[i];
+    if (!node.count)
+      continue;
+    BoundingBox box = tree.primitives[node.first]->boundingBox();
+    for (int p = node.first+1; p < node.first+node.count; ++p) {
+      BoundingBox const primitiveBox = tree.primitives[p]->boundingBox();
+      box.minimumCorner = minimum(box.minimumCorner, primitiveBox.minimumCorner);
+      box.maximumCorner = maximum(box.maximumCorner, primitiveBox.maximumCorner);
+    }
+    node.minimum = box.minimumCorner;
+    node.maximum = box.maximumCorner;
+  }
+
+  // ... then the inner nodes bottom up, their children come after them
+  for (int i = nodeCount-1; i >= 0; --i) {
+    Node & node = tree.nodes[i];
+    if (node.count)
+      continue;
+    node.minimum = minimum(tree.nodes[i+1].minimum, tree.nodes[node.first].minimum);
+    node.maximum = maximum(tree.nodes[i+1].maximum, tree.nodes[node.first].maximum);
+  }
+
+  // Build a new tree in the background once this one has degraded
+  tree.cost = sahCost(tree);
+  if (!this->rebuild_.valid() && tree.cost > tree.builtCost*this->rebuildThreshold_) {
+    printf("(Bvh): SAH cost grew from %.1f to %.1f, rebuilding\n", tree.builtCost, tree.cost);
+    std::vector<Primitive*> const primitives = this->primitives_;
+    std::vector<BoundingBox> const bounds = this->primitiveBounds();
+    this->rebuild_ = std::async(std::launch::async, [primitives, bounds]() {
+      return build(primitives, bounds);
+    });
+  }
+}
+
+void Bvh::rebuild() {
+  if (this->rebuild_.valid())
+    this->rebuild_.get();
+  this->tree_ = build(this->primitives_, this->primitiveBounds());
+}
+
+
+// Traversal functions /////////////////////////////////////////////////////////
+
+template <typename Visit>
+bool Bvh::traverse(Ray * ray, Visit const& visit) const {
+  Tree const& tree = *this->tree_;
+  if (tree.nodes.empty())
+    return false;
+  Vector3d const inverseDirection = componentQuotient(Vector3d(1,1,1), ray->direction);
+
+  int stack[maximumDepth+4];
+  int stackSize = 0;
+  int index = 0;
+  for (;;) {
+    // Slab test against the current length of the ray
+    Node const& node = tree.nodes[index];
+    Vector3d const t0 = componentProduct(node.minimum - ray->origin, inverseDirection);
+    Vector3d const t1 = componentProduct(node.maximum - ray->origin, inverseDirection);
+    Vector3d const near = minimum(t0, t1), far = maximum(t0, t1);
+    float const entry = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+    float const exit = std::min(std::min(far.x, far.y), std::min(far.z, ray->length));
+
+    if (entry <= exit) {
+      if (!node.count) {
+        // Nearer child first
+        bool const negative = ray->direction[node.axis] < 0;
+        stack[stackSize++] = negative ? index+1 : node.first;
+        index = negative ? node.first : index+1;
+        continue;
+      }
+      for (int p = node.first; p < node.first+node.count; ++p)
+        if (visit(tree.primitives[p]))
+          return true;
+    }
+    if (stackSize == 0)
+      return false;
+    index = stack[--stackSize];
+  }
+}
+
+bool Bvh::intersect(Ray * ray) const {
+  bool hit = false;
+  for (unsigned int i = 0; i < this->unbounded_.size(); ++i)
+    hit |= this->unbounded_[i]->intersect(ray);
+  this->traverse(ray, [&](Primitive const* primitive) {
+    hit |= primitive->intersect(ray);
+    return false;
+  });
+  return hit;
+}
+
+bool Bvh::intersectOpaque(Ray * ray) const {
+  for (unsigned int i = 0; i < this->unbounded_.size(); ++i)
+    if (this->unbounded_[i]->intersect(ray) && !this->unbounded_[i]->shader()->isTransparent())
+      return true;
+  return this->traverse(ray, [ray](Primitive const* primitive) {
+    return primitive->intersect(ray) && !primitive->shader()->isTransparent();
+  });
+}
+
+RayPacket::Mask Bvh::intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+  RayPacket::Mask hits = 0;
+  for (unsigned int i = 0; i < this->unbounded_.size(); ++i)
+    hits |= this->unbounded_[i]->intersectPacket(packet, active);
+  Tree const& tree = *this->tree_;
+  if (tree.nodes.empty() || !active)
+    return hits;
+
+  alignas(16) float inverseX[RayPacket::size], inverseY[RayPacket::size], inverseZ[RayPacket::size];
+  for (int i = 0; i < RayPacket::size; ++i) {
+    inverseX[i] = 1.0f/packet->directionX[i];
+    inverseY[i] = 1.0f/packet->directionY[i];
+    inverseZ[i] = 1.0f/packet->directionZ[i];
+  }
+
+  // Every node is tested against all of its rays, four at a time, and only
+  // the rays that pass on to the children
+  struct Entry {
+    int node;
+    RayPacket::Mask rays;
+  } stack[maximumDepth+4];
+  int stackSize = 0;
+  stack[stackSize++] = Entry{0, active};
+  while (stackSize > 0) {
+    Entry const entry = stack[--stackSize];
+    Node const& node = tree.nodes[entry.node];
+
+    RayPacket::Mask rays = 0;
+    for (int g = 0; g < RayPacket::size; g += 4) {
+      if (!(entry.rays >> g & 0xF))
+        continue;
+      __m128 const t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minimum.x), _mm_load_ps(&packet->originX[g])), _mm_load_ps(&inverseX[g]));
+      __m128 const t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maximum.x), _mm_load_ps(&packet->originX[g])), _mm_load_ps(&inverseX[g]));
+      __m128 const t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minimum.y), _mm_load_ps(&packet->originY[g])), _mm_load_ps(&inverseY[g]));
+      __m128 const t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maximum.y), _mm_load_ps(&packet->originY[g])), _mm_load_ps(&inverseY[g]));
+      __m128 const t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minimum.z), _mm_load_ps(&packet->originZ[g])), _mm_load_ps(&inverseZ[g]));
+      __m128 const t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maximum.z), _mm_load_ps(&packet->originZ[g])), _mm_load_ps(&inverseZ[g]));
+      __m128 const entryT = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                                       _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+      __m128 const exitT = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                                      _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_load_ps(&packet->length[g])));
+      rays |= RayPacket::Mask(_mm_movemask_ps(_mm_cmple_ps(entryT, exitT))) << g;
+    }
+    rays &= entry.rays;
+    if (!rays)
+      continue;
+
+    if (node.count) {
+      for (int p = node.first; p < node.first+node.count; ++p)
+        hits |= tree.primitives[p]->intersectPacket(packet, rays);
+      continue;
+    }
+
+    // The child most rays reach first goes on top of the stack
+    int negative = 0, total = 0;
+    for (int i = 0; i < RayPacket::size; ++i) {
+      if (rays >> i & 1) {
+        ++total;
+        negative += packet->direction(i, node.axis) < 0;
+      }
+    }
+    bool const reversed = 2*negative > total;
+    stack[stackSize++] = Entry{reversed ? entry.node+1 : node.first, rays};
+    stack[stackSize++] = Entry{reversed ? node.first : entry.node+1, rays};
+  }
+  return hits;
+}
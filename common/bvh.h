@@ -0,0 +1,91 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <future>
+#include <memory>
+#include <vector>
+#include "common/alignedallocator.h"
+#include "common/boundingbox.h"
+#include "common/raypacket.h"
+#include "primitive/primitive.h"
+
+// Bounding volume hierarchy for primitives that move or deform. Unlike the
+// KdTree, which has to be built again, the BVH keeps its topology and only
+// refits the node bounds to the new primitive bounds. Refitting degrades the
+// tree while objects move apart, so the SAH cost of the refitted tree is
+// compared with the cost it had when it was built, and once it has grown by
+// the rebuild threshold a new tree is built on a background thread. It
+// replaces the refitted one at a later refit().
+// Note: Primitives without finite bounds (e.g. an InfinitePlane) are kept
+// outside of the tree and tested against every ray.
+class Bvh {
+
+public:
+  // Constructor / Destructor
+  Bvh(std::vector<Primitive*> const& primitives, float rebuildThreshold = 1.5f);
+  ~Bvh();
+  Bvh(Bvh const&) = delete;
+  Bvh & operator=(Bvh const&) = delete;
+
+  // Get
+  // SAH cost of the tree after the last refit, and when it was built
+  float cost() const { return this->tree_->cost; }
+  float builtCost() const { return this->tree_->builtCost; }
+  bool isRebuilding() const { return this->rebuild_.valid(); }
+  float rebuildThreshold() const { return this->rebuildThreshold_; }
+
+  // Set
+  void setRebuildThreshold(float threshold) { this->rebuildThreshold_ = threshold; }
+
+  // Update functions, not to be called during traversal
+  // Fit the node bounds to the current primitive bounds
+  void refit();
+  // Build a new tree right away
+  void rebuild();
+
+  // Traversal functions
+  bool intersect(Ray * ray) const;
+  // Returns whether any opaque primitive is hit (see Scene::findOcclusion)
+  bool intersectOpaque(Ray * ray) const;
+  RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const;
+
+private:
+  static int const maximumDepth = 60;
+  static int const maximumLeafSize = 4;
+  static int const binCount = 16;
+
+  // Nodes are stored depth first, so the first child of an inner node is
+  // the next node and every child comes after its parent
+  struct Node {
+    Vector3d minimum, maximum;
+    int first; // first primitive of a leaf, or the second child
+    int count; // primitives of a leaf, 0 for inner nodes
+    int axis;  // split axis of an inner node
+  };
+  struct Tree {
+    std::vector<Node, AlignedAllocator<Node> > nodes;
+    std::vector<Primitive*> primitives;
+    float cost, builtCost;
+  };
+
+  static std::unique_ptr<Tree> build(std::vector<Primitive*> const& primitives,
+                                     std::vector<BoundingBox> const& bounds);
+  static int buildNode(Tree * tree, std::vector<int> * indices, int begin, int end,
+                       std::vector<BoundingBox> const& bounds,
+                       std::vector<Vector3d> const& centroids, int depth);
+  static float sahCost(Tree const& tree);
+  std::vector<BoundingBox> primitiveBounds() const;
+  // Visits the primitives of the leaves the ray passes through, until the
+  // visitor returns true
+  template <typename Visit>
+  bool traverse(Ray * ray, Visit const& visit) const;
+
+  std::vector<Primitive*> primitives_;
+  std::vector<Primitive*> unbounded_;
+  std::unique_ptr<Tree> tree_;
+  std::future<std::unique_ptr<Tree> > rebuild_;
+  float rebuildThreshold_;
+
+};
+
+#endif // BVH_H
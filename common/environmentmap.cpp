@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <cmath>
+#include "common/environmentmap.h"
+#include "common/fastmath.h"
+
+// Direction through the point (s,t) in [-1,1]^2 of a cube face
+static Vector3d cubeDirection(int face, float s, float t) {
+  switch (face) {
+  case 0: return Vector3d(1.0f, -t, -s);
+  case 1: return Vector3d(-1.0f, -t, s);
+  case 2: return Vector3d(s, 1.0f, t);
+  case 3: return Vector3d(s, -1.0f, -t);
+  case 4: return Vector3d(s, -t, 1.0f);
+  default: return Vector3d(-s, -t, -1.0f);
+  }
+}
+
+EnvironmentMap::EnvironmentMap(Texture const& map, Projection projection)
+  : projection_(projection), latLong_(map) {
+  if (map.isNull() || projection != CUBE)
+    return;
+
+  // Resample the faces once, with the exact mapping, at about the
+  // resolution of the image around the equator. HDR images keep their
+  // format, so both projections show the same colors.
+  int const size = std::max(map.width()/4, 1);
+  Texture::Format const format = map.format() == Texture::HALF ? Texture::HALF : Texture::RGBA8;
+  for (int face = 0; face < 6; ++face) {
+    Texture & texture = this->faces_[face];
+    texture = Texture(size, size, format);
+    texture.fill([&](int x, int y) {
+      Vector3d const direction = normalized(cubeDirection(face, 2.0f*(x+0.5f)/size - 1.0f,
+                                                                 2.0f*(y+0.5f)/size - 1.0f));
+      float const phi = std::acos(std::min(std::max(direction.y, -1.0f), 1.0f));
+      float const rho = std::atan2(direction.z, direction.x) + PI;
+      return map.color(rho/(2*PI), 1.0-phi/PI);
+    });
+    texture.setWrapMode(Texture::CLAMP);
+    texture.setLayout(Texture::TILED);
+  }
+}
+
+Color EnvironmentMap::color(Vector3d const& direction) const {
+  if (this->isNull())
+    return Color();
+  if (this->projection_ == CUBE)
+    return this->lookupCube(direction);
+  Color result;
+  this->lookupLatLong(1, &direction, &result);
+  return result;
+}
+
+void EnvironmentMap::colors(int count, Vector3d const* directions, Color * colors) const {
+  if (this->isNull()) {
+    std::fill(colors, colors+count, Color());
+  } else if (this->projection_ == CUBE) {
+    for (int i = 0; i < count; ++i)
+      colors[i] = this->lookupCube(directions[i]);
+  } else {
+    for (int i = 0; i < count; i += 4)
+      this->lookupLatLong(std::min(count-i, 4), directions+i, colors+i);
+  }
+}
+
+void EnvironmentMap::lookupLatLong(int count, Vector3d const* directions, Color * colors) const {
+  // Transpose up to four directions, unused lanes repeat the first one
+  __m128 x = directions[0].mmvalue;
+  __m128 y = count > 1 ? directions[1].mmvalue : x;
+  __m128 z = count > 2 ? directions[2].mmvalue : x;
+  __m128 w = count > 3 ? directions[3].mmvalue : x;
+  _MM_TRANSPOSE4_PS(x, y, z, w);
+
+  // u = (atan2(z,x) + pi) / 2pi, v = 1 - acos(y) / pi
+  float u[4], v[4];
+  _mm_storeu_ps(u, _mm_add_ps(_mm_mul_ps(fastAtan2(z, x), _mm_set1_ps(0.5f/PI)), _mm_set1_ps(0.5f)));
+  _mm_storeu_ps(v, _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(fastAcos(y), _mm_set1_ps(1.0f/PI))));
+  for (int i = 0; i < count; ++i)
+    colors[i] = this->latLong_.color(u[i], v[i]);
+}
+
+Color EnvironmentMap::lookupCube(Vector3d const& direction) const {
+  // The major axis selects the face, the other two coordinates are
+  // projected onto it
+  float const ax = std::fabs(direction.x);
+  float const ay = std::fabs(direction.y);
+  float const az = std::fabs(direction.z);
+  int face;
+  float s, t, major;
+  if (ax >= ay && ax >= az) {
+    face = direction.x >= 0.0f ? 0 : 1;
+    major = ax;
+    s = direction.x >= 0.0f ? -direction.z : direction.z;
+    t = -direction.y;
+  } else if (ay >= az) {
+    face = direction.y >= 0.0f ? 2 : 3;
+    major = ay;
+    s = direction.x;
+    t = direction.y >= 0.0f ? direction.z : -direction.z;
+  } else {
+    face = direction.z >= 0.0f ? 4 : 5;
+    major = az;
+    s = direction.z >= 0.0f ? direction.x : -direction.x;
+    t = -direction.y;
+  }
+  float const scale = 0.5f/major;
+  return this->faces_[face].color(s*scale + 0.5f, t*scale + 0.5f);
+}
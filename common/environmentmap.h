@@ -0,0 +1,44 @@
+#ifndef ENVIRONMENTMAP_H
+#define ENVIRONMENTMAP_H
+
+#include "common/color.h"
+#include "common/texture.h"
+#include "common/vector3d.h"
+
+// Lookup of the light coming from infinitely far away in a given direction.
+// The map is given as a latitude-longitude image. It is either sampled
+// directly, with a vectorized approximation of acos/atan2 for the texture
+// coordinates, or converted once into a cube map, which needs no
+// trigonometry at all.
+class EnvironmentMap {
+
+public:
+  enum Projection {
+    LATLONG, // the image as it is
+    CUBE     // six faces (+x, -x, +y, -y, +z, -z), a quarter of the image width each
+  };
+
+  // Constructor
+  EnvironmentMap() : projection_(LATLONG) {}
+  EnvironmentMap(Texture const& map, Projection projection = LATLONG);
+
+  // Get
+  bool isNull() const { return this->latLong_.isNull(); }
+  Projection projection() const { return this->projection_; }
+
+  // Color functions
+  Color color(Vector3d const& direction) const;
+  // Batched lookup, the directions are processed four at a time
+  void colors(int count, Vector3d const* directions, Color * colors) const;
+
+private:
+  void lookupLatLong(int count, Vector3d const* directions, Color * colors) const;
+  Color lookupCube(Vector3d const& direction) const;
+
+  Projection projection_;
+  Texture latLong_;
+  Texture faces_[6];
+
+};
+
+#endif // ENVIRONMENTMAP_H
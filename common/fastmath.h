@@ -0,0 +1,81 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <smmintrin.h>
+#include "common/common.h"
+
+// Polynomial approximations of the inverse trigonometric functions for four
+// values at once (Abramowitz & Stegun 4.4.46 and 4.4.49). They are meant for
+// mapping directions to texture coordinates, where the error is far below
+// the angle covered by a texel.
+
+// Absolute error below 5e-7, x in [-1,1]
+inline __m128 fastAcos(__m128 x) {
+  __m128 const sign = _mm_and_ps(x, _mm_set1_ps(-0.0f));
+  __m128 const a = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+  __m128 p = _mm_set1_ps(-0.0012624911f);
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(0.0066700901f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(-0.0170881256f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(0.0308918810f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(-0.0501743046f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(0.0889789874f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(-0.2145988016f));
+  p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(1.5707963050f));
+  __m128 const result = _mm_mul_ps(p, _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), a),
+                                                             _mm_setzero_ps())));
+  // acos(-x) = pi - acos(x)
+  return _mm_blendv_ps(result, _mm_sub_ps(_mm_set1_ps(PI), result), sign);
+}
+
+// Absolute error below 2e-5, result in [-pi,pi] like std::atan2
+inline __m128 fastAtan2(__m128 y, __m128 x) {
+  __m128 const signMask = _mm_set1_ps(-0.0f);
+  __m128 const ax = _mm_andnot_ps(signMask, x);
+  __m128 const ay = _mm_andnot_ps(signMask, y);
+
+  // atan on [0,1] of the smaller over the larger coordinate
+  __m128 const t = _mm_div_ps(_mm_min_ps(ax, ay),
+                              _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f)));
+  __m128 const t2 = _mm_mul_ps(t, t);
+  __m128 p = _mm_set1_ps(0.0208351f);
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.0851330f));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.1801410f));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.3302995f));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.9998660f));
+  __m128 angle = _mm_mul_ps(p, t);
+
+  // Back to the octant and the quadrant of (x,y)
+  angle = _mm_blendv_ps(angle, _mm_sub_ps(_mm_set1_ps(PI/2), angle), _mm_cmpgt_ps(ay, ax));
+  angle = _mm_blendv_ps(angle, _mm_sub_ps(_mm_set1_ps(PI), angle), x);
+  return _mm_or_ps(angle, _mm_and_ps(y, signMask));
+}
+
+// Exponential function (Cephes expf), relative error below 2e-7. Results
+// below the smallest normal float are flushed to 0, above FLT_MAX they are
+// clamped.
+inline __m128 fastExp(__m128 x) {
+  x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.33654f)), _mm_set1_ps(88.72283f));
+
+  // exp(x) = 2^n * exp(r) with r in [-ln(2)/2, ln(2)/2]
+  __m128 const n = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+  r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+  __m128 p = _mm_set1_ps(1.9875691500e-4f);
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+  p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+
+  // Scale by 2^n through the exponent bits, in two steps so that n = 128
+  // and n = -127 do not overflow the exponent field
+  __m128i const half = _mm_srai_epi32(_mm_cvtps_epi32(n), 1);
+  __m128i const rest = _mm_sub_epi32(_mm_cvtps_epi32(n), half);
+  __m128 const scale1 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(half, _mm_set1_epi32(127)), 23));
+  __m128 const scale2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(rest, _mm_set1_epi32(127)), 23));
+  return _mm_mul_ps(_mm_mul_ps(p, scale1), scale2);
+}
+
+#endif // FASTMATH_H
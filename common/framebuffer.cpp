@@ -0,0 +1,168 @@
+#include "common/framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+FrameBuffer::FrameBuffer(int width, int height, int channels)
+  : width_(std::max(width, 0)), height_(std::max(height, 0)),
+    tilesPerRow_((this->width_+tileSize-1)/tileSize), channels_(channels) {
+  // The channels are padded to full tiles
+  std::size_t const size = this->size();
+  if (this->hasChannel(COLOR))
+    this->color_.resize(size);
+  if (this->hasChannel(DEPTH))
+    this->depth_.resize(size, INFINITY);
+  if (this->hasChannel(NORMAL))
+    this->normal_.resize(size);
+  if (this->hasChannel(ALBEDO))
+    this->albedo_.resize(size);
+  if (this->hasChannel(PRIMITIVE_ID))
+    this->primitiveId_.resize(size, 0);
+  if (this->hasChannel(SAMPLE_COUNT))
+    this->sampleCount_.resize(size, 0.0f);
+  if (this->hasChannel(VARIANCE))
+    this->variance_.resize(size, 0.0f);
+}
+
+uint32_t FrameBuffer::primitiveIdOf(void const* primitive) {
+  if (!primitive)
+    return 0;
+  // Mix the bits of the address, 0 is reserved for misses
+  uint64_t value = reinterpret_cast<uintptr_t>(primitive);
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+  uint32_t const id = value & 0xFFFFFF;
+  return id ? id : 1;
+}
+
+void FrameBuffer::range(Channel channel, float * minimum, float * maximum) const {
+  assert((channel == DEPTH || channel == SAMPLE_COUNT || channel == VARIANCE) && this->hasChannel(channel));
+  float const* values = channel == DEPTH ? this->depth_.data()
+      : channel == SAMPLE_COUNT ? this->sampleCount_.data() : this->variance_.data();
+  long const count = this->size();
+
+  // Parallel reduction, misses (INFINITY) and the padding are skipped
+  float minimumValue = INFINITY, maximumValue = -INFINITY;
+  #pragma omp parallel for reduction(min:minimumValue) reduction(max:maximumValue)
+  for (long i = 0; i < count; ++i) {
+    if (std::isfinite(values[i])) {
+      minimumValue = std::min(minimumValue, values[i]);
+      maximumValue = std::max(maximumValue, values[i]);
+    }
+  }
+  *minimum = minimumValue;
+  *maximum = maximumValue;
+}
+
+Texture FrameBuffer::toTexture(Channel channel) const {
+  if (this->isNull() || !this->hasChannel(channel))
+    return Texture();
+  Texture image(this->width_, this->height_);
+
+  // Range of the depths, sample counts and variances
+  float minimumValue = INFINITY, maximumValue = 0.0f;
+  if (channel == DEPTH || channel == SAMPLE_COUNT || channel == VARIANCE)
+    this->range(channel, &minimumValue, &maximumValue);
+
+  #pragma omp parallel for
+  for (int y = 0; y < this->height_; ++y) {
+    for (int x = 0; x < this->width_; ++x) {
+      int const i = this->index(x,y);
+      Color color;
+      switch (channel) {
+      case COLOR:
+        color = this->color_[i];
+        break;
+      case DEPTH:
+        if (std::isfinite(this->depth_[i]) && maximumValue > minimumValue)
+          color = Color(1,1,1)*(1.0f - (this->depth_[i]-minimumValue)/(maximumValue-minimumValue));
+        else if (std::isfinite(this->depth_[i]))
+          color = Color(1,1,1);
+        break;
+      case NORMAL:
+        color = Color(0.5f*(this->normal_[i].x+1), 0.5f*(this->normal_[i].y+1), 0.5f*(this->normal_[i].z+1));
+        break;
+      case ALBEDO:
+        color = this->albedo_[i];
+        break;
+      case PRIMITIVE_ID:
+        if (this->primitiveId_[i]) {
+          uint32_t const hash = this->primitiveId_[i]*2654435761u;
+          color = Color((hash >> 24)/255.0f, ((hash >> 16) & 0xff)/255.0f, ((hash >> 8) & 0xff)/255.0f);
+        }
+        break;
+      case SAMPLE_COUNT:
+        if (maximumValue > 0.0f)
+          color = Color(1,1,1)*(this->sampleCount_[i]/maximumValue);
+        break;
+      case VARIANCE:
+        if (maximumValue > 0.0f)
+          color = Color(1,1,1)*(std::isfinite(this->variance_[i]) ? this->variance_[i]/maximumValue : 1.0f);
+        break;
+      }
+      image.setPixelAt(x, y, clamped(color));
+    }
+  }
+  return image;
+}
+
+bool FrameBuffer::save(char const* fileName, Channel channel) const {
+  return this->toTexture(channel).save(fileName);
+}
+
+bool FrameBuffer::savePFM(char const* fileName, Channel channel) const {
+  if (this->isNull() || !this->hasChannel(channel))
+    return false;
+  FILE * file = std::fopen(fileName, "wb");
+  if (!file) {
+    printf("(FrameBuffer): Could not open file for writing: %s\n", fileName);
+    return false;
+  }
+
+  // Header with the magic number, the size and a negative scale for
+  // little-endian floats. The rows follow from bottom to top, like
+  // Texture::load expects them.
+  int const components = (channel == COLOR || channel == NORMAL || channel == ALBEDO) ? 3 : 1;
+  std::fprintf(file, "%s\n%d %d\n-1.0\n", components == 3 ? "PF" : "Pf", this->width_, this->height_);
+  std::vector<float> row(std::size_t(this->width_)*components);
+  bool success = true;
+  for (int y = this->height_-1; y >= 0 && success; --y) {
+    for (int x = 0; x < this->width_; ++x) {
+      int const i = this->index(x,y);
+      float * value = &row[std::size_t(x)*components];
+      switch (channel) {
+      case COLOR:
+      case ALBEDO: {
+        Color const& color = channel == COLOR ? this->color_[i] : this->albedo_[i];
+        value[0] = color.r; value[1] = color.g; value[2] = color.b;
+        break;
+      }
+      case NORMAL:
+        value[0] = this->normal_[i].x; value[1] = this->normal_[i].y; value[2] = this->normal_[i].z;
+        break;
+      case DEPTH:
+        value[0] = this->depth_[i];
+        break;
+      case PRIMITIVE_ID:
+        value[0] = static_cast<float>(this->primitiveId_[i]);
+        break;
+      case SAMPLE_COUNT:
+        value[0] = this->sampleCount_[i];
+        break;
+      case VARIANCE:
+        value[0] = this->variance_[i];
+        break;
+      }
+    }
+    success = std::fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+  }
+  success &= std::fclose(file) == 0;
+
+  if (success)
+    printf("Image file written to: \"%s\"\n", fileName);
+  else
+    printf("(FrameBuffer): Could not write file: %s\n", fileName);
+  return success;
+}
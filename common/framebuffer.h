@@ -0,0 +1,117 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "common/alignedallocator.h"
+#include "common/color.h"
+#include "common/texture.h"
+#include "common/vector3d.h"
+
+// Float image a renderer writes into, with optional extra channels (AOVs)
+// next to the color. The pixels are stored in 16x16 tiles, the tiles of the
+// TileScheduler, so threads writing different tiles never share a cache line.
+// Colors keep their full range until the image is saved.
+class FrameBuffer {
+
+public:
+  // Channels, as bit flags
+  enum Channel {
+    COLOR = 1 << 0,
+    DEPTH = 1 << 1,        // distance along the primary ray, INFINITY for misses
+    NORMAL = 1 << 2,       // surface normal facing the camera
+    ALBEDO = 1 << 3,       // surface color without lighting (see Shader::albedo)
+    PRIMITIVE_ID = 1 << 4, // 0 for misses
+    SAMPLE_COUNT = 1 << 5,
+    VARIANCE = 1 << 6      // of the mean luminance of the samples, the noise level
+  };
+  static int const tileSize = 16;
+
+  // Constructor
+  FrameBuffer(int width = 0, int height = 0, int channels = COLOR);
+
+  // Get
+  bool isNull() const { return this->width_ == 0; }
+  int width() const { return this->width_; }
+  int height() const { return this->height_; }
+  int channels() const { return this->channels_; }
+  bool hasChannel(Channel channel) const { return (this->channels_ & channel) != 0; }
+  Color color(int x, int y) const { return this->color_[this->index(x,y)]; }
+  float depth(int x, int y) const { return this->depth_[this->index(x,y)]; }
+  Vector3d normal(int x, int y) const { return this->normal_[this->index(x,y)]; }
+  Color albedo(int x, int y) const { return this->albedo_[this->index(x,y)]; }
+  uint32_t primitiveId(int x, int y) const { return this->primitiveId_[this->index(x,y)]; }
+  float sampleCount(int x, int y) const { return this->sampleCount_[this->index(x,y)]; }
+  float variance(int x, int y) const { return this->variance_[this->index(x,y)]; }
+  // Smallest and largest finite value of the depth, sample count or variance
+  // channel
+  void range(Channel channel, float * minimum, float * maximum) const;
+
+  // Raw channel storage for image passes: size() values in tile order,
+  // including the padding of the border tiles
+  std::size_t size() const { return std::size_t(this->tilesPerRow_)*((this->height_+tileSize-1)/tileSize)*tileSize*tileSize; }
+  Color * colorData() { return this->color_.data(); }
+  Color const* colorData() const { return this->color_.data(); }
+  float const* depthData() const { return this->depth_.data(); }
+
+  // Set
+  void setColor(int x, int y, Color const& color) {
+    assert(this->hasChannel(COLOR));
+    this->color_[this->index(x,y)] = color;
+  }
+  void setDepth(int x, int y, float depth) {
+    assert(this->hasChannel(DEPTH));
+    this->depth_[this->index(x,y)] = depth;
+  }
+  void setNormal(int x, int y, Vector3d const& normal) {
+    assert(this->hasChannel(NORMAL));
+    this->normal_[this->index(x,y)] = normal;
+  }
+  void setAlbedo(int x, int y, Color const& albedo) {
+    assert(this->hasChannel(ALBEDO));
+    this->albedo_[this->index(x,y)] = albedo;
+  }
+  void setPrimitiveId(int x, int y, uint32_t id) {
+    assert(this->hasChannel(PRIMITIVE_ID));
+    this->primitiveId_[this->index(x,y)] = id;
+  }
+  void setSampleCount(int x, int y, float count) {
+    assert(this->hasChannel(SAMPLE_COUNT));
+    this->sampleCount_[this->index(x,y)] = count;
+  }
+  void setVariance(int x, int y, float variance) {
+    assert(this->hasChannel(VARIANCE));
+    this->variance_[this->index(x,y)] = variance;
+  }
+
+  // Identifier of a primitive for the PRIMITIVE_ID channel, 0 for none. The
+  // identifiers have 24 bits, so they are exact in a float file.
+  static uint32_t primitiveIdOf(void const* primitive);
+
+  // Output functions
+  // An 8-bit image of a channel: colors are clamped, depths mapped from near
+  // (white) to far (black), normals from [-1,1] to [0,1], primitive IDs to
+  // arbitrary colors and sample counts and variances relative to the maximum
+  Texture toTexture(Channel channel = COLOR) const;
+  bool save(char const* fileName, Channel channel = COLOR) const;
+  // Lossless float output of a channel, with three (color, normal, albedo)
+  // or one component per pixel
+  bool savePFM(char const* fileName, Channel channel = COLOR) const;
+
+private:
+  int index(int x, int y) const {
+    return (((y >> 4)*this->tilesPerRow_ + (x >> 4)) << 8) + ((y & 15) << 4) + (x & 15);
+  }
+
+  int width_, height_;
+  int tilesPerRow_;
+  int channels_;
+  std::vector<Color, AlignedAllocator<Color> > color_, albedo_;
+  std::vector<Vector3d, AlignedAllocator<Vector3d> > normal_;
+  std::vector<float, AlignedAllocator<float> > depth_, sampleCount_, variance_;
+  std::vector<uint32_t, AlignedAllocator<uint32_t> > primitiveId_;
+
+};
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,121 @@
+#include "common/imagestream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+// Whether a file name ends with the given extension, ignoring the case
+static bool hasExtension(char const* fileName, char const* extension) {
+  std::size_t const length = std::strlen(fileName);
+  std::size_t const extensionLength = std::strlen(extension);
+  if (length < extensionLength)
+    return false;
+  for (std::size_t i = 0; i < extensionLength; ++i)
+    if (std::tolower(fileName[length-extensionLength+i]) != extension[i])
+      return false;
+  return true;
+}
+
+ImageStream::ImageStream(char const* fileName, int width, int height)
+  : file_(nullptr), width_(width), height_(height),
+    format_(hasExtension(fileName, ".pfm") ? PFM : PPM), headerSize_(0),
+    closing_(false), success_(true) {
+  this->file_ = std::fopen(fileName, "wb");
+  if (!this->file_) {
+    printf("(ImageStream): Could not open file for writing: %s\n", fileName);
+    return;
+  }
+
+  // PFM files have a negative scale for little-endian floats
+  if (this->format_ == PFM)
+    std::fprintf(this->file_, "PF\n%d %d\n-1.0\n", width, height);
+  else
+    std::fprintf(this->file_, "P6\n%d %d\n255\n", width, height);
+  this->headerSize_ = std::ftell(this->file_);
+
+  this->writer_ = std::thread(&ImageStream::run, this);
+}
+
+ImageStream::~ImageStream() {
+  this->close();
+}
+
+bool ImageStream::supports(char const* fileName) {
+  return hasExtension(fileName, ".ppm") || hasExtension(fileName, ".pfm");
+}
+
+void ImageStream::write(int y, FrameBuffer band) {
+  if (!this->isOpen())
+    return;
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  this->queueChanged_.wait(lock, [this]() {
+    return static_cast<int>(this->queue_.size()) < maximumQueuedBands;
+  });
+  this->queue_.push_back(std::make_pair(y, std::move(band)));
+  this->queueChanged_.notify_all();
+}
+
+bool ImageStream::close() {
+  if (!this->isOpen())
+    return false;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->closing_ = true;
+    this->queueChanged_.notify_all();
+  }
+  this->writer_.join();
+  this->success_ &= std::fclose(this->file_) == 0;
+  this->file_ = nullptr;
+  return this->success_;
+}
+
+void ImageStream::run() {
+  for (;;) {
+    std::pair<int, FrameBuffer> band;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      this->queueChanged_.wait(lock, [this]() { return !this->queue_.empty() || this->closing_; });
+      if (this->queue_.empty())
+        return;
+      band = std::move(this->queue_.front());
+      this->queue_.pop_front();
+      this->queueChanged_.notify_all();
+    }
+    // Write without holding the lock, the renderer can queue the next band
+    bool const success = this->writeBand(band.first, band.second);
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->success_ &= success;
+  }
+}
+
+bool ImageStream::writeBand(int y, FrameBuffer const& band) {
+  int const components = 3;
+  std::size_t const valueSize = this->format_ == PFM ? sizeof(float) : 1;
+  std::size_t const rowSize = std::size_t(this->width_)*components*valueSize;
+  std::vector<unsigned char> row(rowSize);
+
+  int const rowCount = std::min(band.height(), this->height_-y);
+  for (int by = 0; by < rowCount; ++by) {
+    // Convert the row...
+    for (int x = 0; x < this->width_; ++x) {
+      Color const color = band.color(x, by);
+      if (this->format_ == PFM) {
+        float const values[components] = {color.r, color.g, color.b};
+        std::memcpy(&row[x*components*valueSize], values, sizeof(values));
+      } else {
+        uint32_t const texel = Texture::packTexel(clamped(color).mmvalue);
+        row[x*components+0] = texel & 0xff;
+        row[x*components+1] = (texel >> 8) & 0xff;
+        row[x*components+2] = (texel >> 16) & 0xff;
+      }
+    }
+
+    // ... and put it in its place, PFM rows go from bottom to top
+    int const fileRow = this->format_ == PFM ? this->height_-1-(y+by) : y+by;
+    if (std::fseek(this->file_, this->headerSize_ + long(fileRow)*long(rowSize), SEEK_SET) != 0
+        || std::fwrite(row.data(), 1, rowSize, this->file_) != rowSize)
+      return false;
+  }
+  return true;
+}
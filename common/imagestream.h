@@ -0,0 +1,66 @@
+#ifndef IMAGESTREAM_H
+#define IMAGESTREAM_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include "common/framebuffer.h"
+
+// Writes an image band by band while it is being rendered, so the image never
+// has to be resident as a whole. Bands are handed over as FrameBuffers and
+// written by a background thread, the renderer only waits when more than a
+// few bands are queued. Rows have a fixed size in the supported formats, so
+// bands can arrive in any order.
+// Note: Like Texture::load expects it, the row y = 0 is the top of the image.
+class ImageStream {
+
+public:
+  enum Format {
+    PPM, // binary 8-bit RGB, colors are clamped
+    PFM  // 32-bit float RGB
+  };
+
+  // Constructor / Destructor
+  // The format is chosen by the extension of the file name (.pfm or else .ppm)
+  ImageStream(char const* fileName, int width, int height);
+  ~ImageStream();
+  ImageStream(ImageStream const&) = delete;
+  ImageStream & operator=(ImageStream const&) = delete;
+
+  // Get
+  bool isOpen() const { return this->file_ != nullptr; }
+  int width() const { return this->width_; }
+  int height() const { return this->height_; }
+  Format format() const { return this->format_; }
+  static bool supports(char const* fileName);
+
+  // Queue the color channel of a band of rows starting at row y
+  void write(int y, FrameBuffer band);
+  // Write the remaining bands and close the file, returns whether all
+  // writes succeeded
+  bool close();
+
+private:
+  void run();
+  bool writeBand(int y, FrameBuffer const& band);
+
+  FILE * file_;
+  int width_, height_;
+  Format format_;
+  long headerSize_;
+
+  // Bands waiting for the writer thread
+  static int const maximumQueuedBands = 2;
+  std::mutex mutex_;
+  std::condition_variable queueChanged_;
+  std::deque<std::pair<int, FrameBuffer> > queue_;
+  bool closing_;
+  bool success_;
+  std::thread writer_;
+
+};
+
+#endif // IMAGESTREAM_H
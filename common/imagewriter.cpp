@@ -0,0 +1,273 @@
+#include "common/imagewriter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <zlib.h>
+
+// Independently compressed part of the zlib stream of a PNG file
+struct Band {
+  std::vector<unsigned char> data;
+  uLong adler, length; // checksum and size of the uncompressed data
+};
+
+struct ImageWriter::Job {
+  Texture image;
+  std::string fileName;
+  int bandRows;
+  std::vector<Band> bands;
+  std::atomic<int> remainingBands;
+  std::atomic<bool> success;
+};
+
+// Rows per band, about 256 KB of uncompressed data. Smaller bands spread
+// better over the threads but compress slightly worse, since every band
+// starts without the history of the previous one.
+static int bandRowsOf(Texture const& image) {
+  return std::max(1, (1 << 18)/(4*image.width()+1));
+}
+
+static bool isPNG(std::string const& fileName) {
+  if (fileName.size() < 4)
+    return false;
+  std::string extension = fileName.substr(fileName.size()-4);
+  for (char & c : extension)
+    c = std::tolower(c);
+  return extension == ".png";
+}
+
+static unsigned char paeth(int left, int up, int upLeft) {
+  int const estimate = left + up - upLeft;
+  int const distanceLeft = std::abs(estimate - left);
+  int const distanceUp = std::abs(estimate - up);
+  int const distanceUpLeft = std::abs(estimate - upLeft);
+  if (distanceLeft <= distanceUp && distanceLeft <= distanceUpLeft)
+    return left;
+  return distanceUp <= distanceUpLeft ? up : upLeft;
+}
+
+// Filter and compress the rows of a band. The filter of the first row reads
+// the row above from the image, so the bands do not depend on each other.
+static bool compressBand(Texture const& image, int y0, int y1, bool last, Band * band) {
+  int const width = image.width();
+  std::size_t const rowSize = 4*std::size_t(width);
+  std::vector<unsigned char> rows(2*rowSize);
+  std::vector<unsigned char> raw((rowSize+1)*(y1-y0));
+  unsigned char * filtered = raw.data();
+  for (int y = y0; y < y1; ++y) {
+    unsigned char * row = &rows[(y & 1)*rowSize];
+    unsigned char * previousRow = &rows[((y+1) & 1)*rowSize];
+    for (int x = 0; x < width; ++x) {
+      uint32_t const texel = image.texel(x,y);
+      row[4*x+0] = texel & 0xff;
+      row[4*x+1] = (texel >> 8) & 0xff;
+      row[4*x+2] = (texel >> 16) & 0xff;
+      row[4*x+3] = texel >> 24;
+    }
+    if (y == y0) {
+      for (int x = 0; x < width && y > 0; ++x) {
+        uint32_t const texel = image.texel(x,y-1);
+        previousRow[4*x+0] = texel & 0xff;
+        previousRow[4*x+1] = (texel >> 8) & 0xff;
+        previousRow[4*x+2] = (texel >> 16) & 0xff;
+        previousRow[4*x+3] = texel >> 24;
+      }
+      if (y == 0)
+        std::fill(previousRow, previousRow+rowSize, 0);
+    }
+
+    // Paeth filter, which suits the smooth gradients of rendered images
+    *filtered++ = 4;
+    for (std::size_t i = 0; i < rowSize; ++i) {
+      int const left = i >= 4 ? row[i-4] : 0;
+      int const upLeft = i >= 4 ? previousRow[i-4] : 0;
+      *filtered++ = row[i] - paeth(left, previousRow[i], upLeft);
+    }
+  }
+
+  // Raw deflate data, every band but the last ends on a byte boundary
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  band->data.resize(deflateBound(&stream, raw.size()) + 16);
+  stream.next_in = raw.data();
+  stream.avail_in = raw.size();
+  stream.next_out = band->data.data();
+  stream.avail_out = band->data.size();
+  int const result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  bool const success = (last ? result == Z_STREAM_END : result == Z_OK) && stream.avail_in == 0;
+  band->data.resize(band->data.size() - stream.avail_out);
+  deflateEnd(&stream);
+
+  band->adler = adler32(adler32(0L, Z_NULL, 0), raw.data(), raw.size());
+  band->length = raw.size();
+  return success;
+}
+
+static void appendBigEndian(std::vector<unsigned char> * data, uint32_t value) {
+  data->push_back(value >> 24);
+  data->push_back((value >> 16) & 0xff);
+  data->push_back((value >> 8) & 0xff);
+  data->push_back(value & 0xff);
+}
+
+static bool writeChunk(FILE * file, char const* type,
+                       unsigned char const* data, std::size_t size) {
+  std::vector<unsigned char> header;
+  appendBigEndian(&header, size);
+  header.insert(header.end(), type, type+4);
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), header.data()+4, 4);
+  if (size > 0)
+    crc = crc32(crc, data, size); // a null buffer would reset the checksum
+  std::vector<unsigned char> footer;
+  appendBigEndian(&footer, crc);
+  return std::fwrite(header.data(), 1, header.size(), file) == header.size()
+      && std::fwrite(data, 1, size, file) == size
+      && std::fwrite(footer.data(), 1, footer.size(), file) == footer.size();
+}
+
+// Put the bands together into one zlib stream, one IDAT chunk per band
+static bool writePNG(char const* fileName, int width, int height,
+                     std::vector<Band> const& bands) {
+  FILE * file = std::fopen(fileName, "wb");
+  if (!file)
+    return false;
+
+  unsigned char const signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  bool success = std::fwrite(signature, 1, sizeof(signature), file) == sizeof(signature);
+
+  // 8-bit RGBA, not interlaced
+  std::vector<unsigned char> header;
+  appendBigEndian(&header, width);
+  appendBigEndian(&header, height);
+  unsigned char const format[5] = {8, 6, 0, 0, 0};
+  header.insert(header.end(), format, format+5);
+  success = success && writeChunk(file, "IHDR", header.data(), header.size());
+
+  uLong adler = adler32(0L, Z_NULL, 0);
+  for (unsigned int b = 0; b < bands.size() && success; ++b) {
+    std::vector<unsigned char> data;
+    if (b == 0) {
+      data.push_back(0x78); // deflate with a 32 KB window...
+      data.push_back(0x9c); // ... and the default level
+    }
+    data.insert(data.end(), bands[b].data.begin(), bands[b].data.end());
+    adler = adler32_combine(adler, bands[b].adler, bands[b].length);
+    if (b+1 == bands.size())
+      appendBigEndian(&data, adler);
+    success = writeChunk(file, "IDAT", data.data(), data.size());
+  }
+  success = success && writeChunk(file, "IEND", nullptr, 0);
+  success &= std::fclose(file) == 0;
+  return success;
+}
+
+ImageWriter::ImageWriter(int threadCount)
+  : queuedImages_(0), closing_(false), success_(true) {
+  for (int t = 0; t < std::max(threadCount, 1); ++t)
+    this->threads_.push_back(std::thread(&ImageWriter::run, this));
+}
+
+ImageWriter::~ImageWriter() {
+  this->wait();
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->closing_ = true;
+    this->tasksChanged_.notify_all();
+  }
+  for (std::thread & thread : this->threads_)
+    thread.join();
+}
+
+void ImageWriter::save(Texture const& image, std::string const& fileName) {
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->image = image;
+  job->fileName = fileName;
+  job->bandRows = bandRowsOf(image);
+  job->success = true;
+  bool const png = isPNG(fileName) && !image.isNull();
+  int const bandCount = png ? (image.height()+job->bandRows-1)/job->bandRows : 0;
+  job->bands.resize(bandCount);
+  job->remainingBands = bandCount;
+
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  this->imagesChanged_.wait(lock, [this]() {
+    return this->queuedImages_ < maximumQueuedImages;
+  });
+  ++this->queuedImages_;
+  if (png) {
+    for (int b = 0; b < bandCount; ++b)
+      this->tasks_.push_back(Task{job, b});
+  } else {
+    this->tasks_.push_back(Task{job, -1});
+  }
+  this->tasksChanged_.notify_all();
+}
+
+bool ImageWriter::wait() {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  this->imagesChanged_.wait(lock, [this]() { return this->queuedImages_ == 0; });
+  bool const success = this->success_;
+  this->success_ = true;
+  return success;
+}
+
+bool ImageWriter::savePNG(Texture const& image, char const* fileName) {
+  if (image.isNull())
+    return false;
+  int const bandRows = bandRowsOf(image);
+  int const bandCount = (image.height()+bandRows-1)/bandRows;
+  std::vector<Band> bands(bandCount);
+  for (int b = 0; b < bandCount; ++b) {
+    if (!compressBand(image, b*bandRows, std::min((b+1)*bandRows, image.height()),
+                      b+1 == bandCount, &bands[b]))
+      return false;
+  }
+  return writePNG(fileName, image.width(), image.height(), bands);
+}
+
+void ImageWriter::run() {
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      this->tasksChanged_.wait(lock, [this]() { return !this->tasks_.empty() || this->closing_; });
+      if (this->tasks_.empty())
+        return;
+      task = this->tasks_.front();
+      this->tasks_.pop_front();
+    }
+
+    Job & job = *task.job;
+    if (task.band < 0) {
+      this->finish(job, job.image.save(job.fileName.c_str()));
+      continue;
+    }
+
+    // Compress a band, the thread finishing the last one writes the file
+    int const bandCount = job.bands.size();
+    int const y0 = task.band*job.bandRows;
+    int const y1 = std::min(y0+job.bandRows, job.image.height());
+    if (!compressBand(job.image, y0, y1, task.band+1 == bandCount, &job.bands[task.band]))
+      job.success = false;
+    if (--job.remainingBands == 0)
+      this->finish(job, job.success && writePNG(job.fileName.c_str(), job.image.width(),
+                                                job.image.height(), job.bands));
+  }
+}
+
+void ImageWriter::finish(Job const& job, bool success) {
+  if (success)
+    printf("Image file written to: \"%s\"\n", job.fileName.c_str());
+  else
+    printf("(ImageWriter): Could not write file: %s\n", job.fileName.c_str());
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->success_ &= success;
+  --this->queuedImages_;
+  this->imagesChanged_.notify_all();
+}
@@ -0,0 +1,61 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/texture.h"
+
+// Encodes and writes images on a pool of threads, so the renderer can go on
+// with the next frame while the last one is being saved. PNG files are split
+// into bands of rows which are compressed independently on all threads of the
+// pool; other formats are saved with Texture::save on a single thread.
+// Note: The images are kept until they are written. Their texels are not
+// copied unless the caller changes its texture meanwhile (copy on write, see
+// Texture), and save() only waits when too many images are queued.
+class ImageWriter {
+
+public:
+  // Constructor / Destructor
+  ImageWriter(int threadCount = 2);
+  // Writes all queued images before returning
+  ~ImageWriter();
+  ImageWriter(ImageWriter const&) = delete;
+  ImageWriter & operator=(ImageWriter const&) = delete;
+
+  // Queue an image
+  void save(Texture const& image, std::string const& fileName);
+  // Block until all queued images are written, returns whether all writes
+  // since the last call succeeded
+  bool wait();
+
+  // Encode a PNG file on the calling thread
+  static bool savePNG(Texture const& image, char const* fileName);
+
+private:
+  struct Job;
+  struct Task {
+    std::shared_ptr<Job> job;
+    int band; // band to compress, or -1 to save the image as a whole
+  };
+
+  void run();
+  void finish(Job const& job, bool success);
+
+  static int const maximumQueuedImages = 4;
+  std::mutex mutex_;
+  std::condition_variable tasksChanged_;
+  std::condition_variable imagesChanged_;
+  std::deque<Task> tasks_;
+  int queuedImages_;
+  bool closing_;
+  bool success_;
+  std::vector<std::thread> threads_;
+
+};
+
+#endif // IMAGEWRITER_H
@@ -3,6 +3,27 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <mutex>
+
+// A subtree that is built by the first ray reaching it
+struct LazySubtree {
+  std::once_flag once;
+  std::function<Node*()> build;
+  Node * node;
+
+  LazySubtree(std::function<Node*()> const& build) : build(build), node(nullptr) {}
+  ~LazySubtree();
+
+  Node const* get() {
+    // Other threads wait here until the subtree is complete
+    std::call_once(this->once, [this]() {
+      this->node = this->build();
+      this->build = nullptr; // releases the primitive list
+    });
+    return this->node;
+  }
+};
 
 // Definition of a node
 struct Node {
@@ -12,15 +33,19 @@ struct Node {
     child[0] = nullptr;
     child[1] = nullptr;
     primitives = nullptr;
+    lazy = nullptr;
   }
   virtual ~Node() {
     delete child[0];
     delete child[1];
     delete primitives;
+    delete lazy;
   }
 
-  // Traversal function
+  // Traversal functions
   bool traverse(Ray * ray, float t0, float t1) const;
+  RayPacket::Mask traversePacket(RayPacket * packet, RayPacket::Mask active,
+                                 float const* t0, float const* t1) const;
 
   // Branch split
   Node * child[2];
@@ -30,11 +55,21 @@ struct Node {
   // Leaf primitives
   std::vector<Primitive*> * primitives;
 
+  // Placeholder for a subtree that is not built yet
+  LazySubtree * lazy;
+
 };
 
+LazySubtree::~LazySubtree() {
+  delete this->node;
+}
+
 
 bool Node::traverse(Ray * ray, float t0, float t1) const {
 
+  if (this->lazy)
+    return this->lazy->get()->traverse(ray, t0, t1);
+
   // If this is a leaf node, we intersect with all the primitives...
   if (primitives) {
 
@@ -68,11 +103,73 @@ bool Node::traverse(Ray * ray, float t0, float t1) const {
 
 }
 
+RayPacket::Mask Node::traversePacket(RayPacket * packet, RayPacket::Mask active,
+                                     float const* t0, float const* t1) const {
+  // Every node is fetched once for all active rays, each ray follows the
+  // same decisions as in traverse() within its own t0..t1 range
+  if (!active)
+    return 0;
+  if (this->lazy)
+    return this->lazy->get()->traversePacket(packet, active, t0, t1);
+
+  // If this is a leaf node, we intersect the whole packet with all the primitives...
+  if (primitives) {
+
+    RayPacket::Mask hits = 0;
+    for (unsigned int i = 0; i < this->primitives->size(); ++i)
+      hits |= (*this->primitives)[i]->intersectPacket(packet, active);
+    return hits;
+
+  }
+
+  // ... otherwise we continue through the branches. Rays that travel in
+  // opposite directions along the split dimension visit the children in a
+  // different order, so the packet is split when they diverge.
+  RayPacket::Mask negative = 0;
+  for (int i = 0; i < RayPacket::size; ++i)
+    if ((active >> i & 1) && packet->direction(i, this->dimension) < 0)
+      negative |= RayPacket::Mask(1) << i;
+  if (negative && negative != active)
+    return this->traversePacket(packet, negative, t0, t1)
+        | this->traversePacket(packet, active & ~negative, t0, t1);
+  int const front = negative ? 1 : 0;
+  int const back = 1 - front;
+
+  // Determine which rays need the front and the back node, and the ranges
+  // within them
+  RayPacket::Mask frontRays = 0, backRays = 0;
+  float frontT1[RayPacket::size], backT0[RayPacket::size];
+  for (int i = 0; i < RayPacket::size; ++i) {
+    if (!(active >> i & 1))
+      continue;
+    float const d = (this->split - packet->origin(i, this->dimension))
+        / packet->direction(i, this->dimension);
+    frontT1[i] = t1[i];
+    backT0[i] = t0[i];
+    if (!(d <= t0[i])) {
+      frontRays |= RayPacket::Mask(1) << i;
+      if (!(d >= t1[i]))
+        frontT1[i] = d;
+    }
+    if (!(d >= t1[i])) {
+      backRays |= RayPacket::Mask(1) << i;
+      if (!(d <= t0[i]))
+        backT0[i] = d;
+    }
+  }
+
+  // Front node first, rays that hit there are done
+  RayPacket::Mask const frontHits = this->child[front]->traversePacket(packet, frontRays, t0, frontT1);
+  return frontHits | this->child[back]->traversePacket(packet, backRays & ~frontHits, backT0, t1);
+}
+
 KdTree::KdTree(std::vector<Primitive*> const& primitives,
                int maximumDepth,
-               int minimumNumberOfPrimitives)
+               int minimumNumberOfPrimitives,
+               int lazyDepth)
   : maximumDepth(maximumDepth),
     minimumNumberOfPrimitives(minimumNumberOfPrimitives),
+    lazyDepth(lazyDepth),
     bounds(Vector3d(1,1,1)*INFINITY, Vector3d(1,1,1)*-INFINITY) {
 
   // Adjust the bounding box of the entire kD-Tree
@@ -93,8 +190,8 @@ KdTree::KdTree(std::vector<Primitive*> const& primitives,
 
   }
 
-  // Recursively build the kD-Tree
-  root = this->build(this->bounds, primitives, 0);
+  // Recursively build the kD-Tree, or its top levels
+  root = this->build(this->bounds, primitives, 0, this->lazyDepth > 0 ? this->lazyDepth : -1);
   printf("(kDTree): %zu primitives organized into tree\n", primitives.size());
 }
 
@@ -104,7 +201,17 @@ KdTree::~KdTree() {
 }
 
 Node * KdTree::build(BoundingBox const& boundingBox,
-                     std::vector<Primitive*> const& primitives, int depth) {
+                     std::vector<Primitive*> const& primitives, int depth, int lazyFrom) {
+
+  // Leave the subtree to the first ray that reaches it, which builds the
+  // next few levels of it
+  if (lazyFrom >= 0 && depth >= lazyFrom) {
+    Node * lazyNode = new Node();
+    lazyNode->lazy = new LazySubtree([this, boundingBox, primitives, depth]() {
+      return this->build(boundingBox, primitives, depth, depth + this->lazyDepth);
+    });
+    return lazyNode;
+  }
 
   // Determine the diameter of the bounding box
   Vector3d const diameter = boundingBox.maximumCorner-boundingBox.minimumCorner;
@@ -159,8 +266,8 @@ Node * KdTree::build(BoundingBox const& boundingBox,
   //printf("(kDTree): Split %zu -> %zu | %zu\n", primitives.size(), leftPrimitives.size(), rightPrimitives.size());
 
   // Recursively build the tree
-  node->child[0] = this->build(leftBox, leftPrimitives, ++depth);
-  node->child[1] = this->build(rightBox, rightPrimitives, ++depth);
+  node->child[0] = this->build(leftBox, leftPrimitives, ++depth, lazyFrom);
+  node->child[1] = this->build(rightBox, rightPrimitives, ++depth, lazyFrom);
   return node;
 }
 
@@ -181,3 +288,27 @@ bool KdTree::intersect(Ray * ray) const {
   else
     return false;
 }
+
+RayPacket::Mask KdTree::intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+  // Determine the intersection ranges of all rays
+  float tMin[RayPacket::size], tMax[RayPacket::size];
+  for (int i = 0; i < RayPacket::size; ++i) {
+    if (!(active >> i & 1))
+      continue;
+    Vector3d const origin(packet->originX[i], packet->originY[i], packet->originZ[i]);
+    Vector3d const direction(packet->directionX[i], packet->directionY[i], packet->directionZ[i]);
+    Vector3d const minTemp = componentQuotient(this->bounds.minimumCorner - origin, direction);
+    Vector3d const maxTemp = componentQuotient(this->bounds.maximumCorner - origin, direction);
+    tMin[i] = std::max(std::max(std::min(minTemp.x, maxTemp.x),
+                                std::min(minTemp.y, maxTemp.y)),
+                       std::min(minTemp.z, maxTemp.z));
+    tMax[i] = std::min(std::min(std::max(minTemp.x, maxTemp.x),
+                                std::max(minTemp.y, maxTemp.y)),
+                       std::max(minTemp.z, maxTemp.z));
+    if (!(tMax[i]-tMin[i] > EPSILON))
+      active &= ~(RayPacket::Mask(1) << i);
+  }
+
+  // Traverse the tree recursively with all rays that enter it
+  return this->root->traversePacket(packet, active, tMin, tMax);
+}
@@ -2,6 +2,7 @@
 #define KDTREE_H
 
 #include <vector>
+#include "common/raypacket.h"
 #include "primitive/primitive.h"
 
 // Forward declaration
@@ -11,21 +12,32 @@ class KdTree {
 
 public:
   // Constructor / Destructor
+  // Only the top lazyDepth levels are built right away, the subtrees below
+  // are built by the first ray that reaches them, again lazyDepth levels at
+  // a time. Geometry that no ray reaches (e.g. off-screen or occluded) is
+  // never sorted into the tree. A lazyDepth of 0 builds the whole tree.
   KdTree(std::vector<Primitive *> const& primitives,
          int maximumDepth = 16,
-         int minimumNumberOfPrimitives = 4);
+         int minimumNumberOfPrimitives = 4,
+         int lazyDepth = 4);
   virtual ~KdTree();
 
   bool intersect(Ray * ray) const;
+  // Traverses the active rays of a packet together and returns the ones that
+  // hit, see Node::traversePacket
+  RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const;
 
 protected:
+  // Subtrees from the depth lazyFrom on are left to the rays, unless it
+  // is negative
   Node * build(BoundingBox const& boundingBox,
-               std::vector<Primitive*> const& primitives, int depth);
+               std::vector<Primitive*> const& primitives, int depth, int lazyFrom = -1);
 
 private:
   Node * root;
   int maximumDepth;
   int minimumNumberOfPrimitives;
+  int lazyDepth;
   BoundingBox bounds;
 
 };
@@ -0,0 +1,39 @@
+#ifndef PIXELESTIMATE_H
+#define PIXELESTIMATE_H
+
+#include <algorithm>
+#include <cmath>
+#include "common/color.h"
+
+// Running estimate of a pixel from its samples
+struct PixelEstimate {
+  Color sum;
+  float luminanceSum, luminanceSquares;
+  int count;
+
+  PixelEstimate() : luminanceSum(0), luminanceSquares(0), count(0) {}
+
+  void add(Color const& color) {
+    // The error is measured on what ends up in the image
+    Color const display = clamped(color);
+    float const luminance = 0.2126f*display.r + 0.7152f*display.g + 0.0722f*display.b;
+    this->sum += color;
+    this->luminanceSum += luminance;
+    this->luminanceSquares += luminance*luminance;
+    ++this->count;
+  }
+  Color color() const { return this->count ? this->sum/this->count : Color(); }
+  float luminance() const { return this->luminanceSum/this->count; }
+  // Standard error of the mean luminance, its square is the VARIANCE
+  // channel of a FrameBuffer
+  float error() const {
+    if (this->count < 2)
+      return INFINITY;
+    float const mean = this->luminance();
+    float const variance = std::max(this->luminanceSquares/this->count - mean*mean, 0.0f)
+        * this->count/(this->count-1);
+    return std::sqrt(variance/this->count);
+  }
+};
+
+#endif // PIXELESTIMATE_H
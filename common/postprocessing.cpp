@@ -0,0 +1,242 @@
+#include "common/postprocessing.h"
+#include "common/fastmath.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+void applyHaze(FrameBuffer * frame, Color const& hazeColor, float falloff) {
+  assert(frame->hasChannel(FrameBuffer::COLOR) && frame->hasChannel(FrameBuffer::DEPTH));
+  Color * colors = frame->colorData();
+  float const* depths = frame->depthData();
+  long const count = frame->size();
+
+  // Four pixels at a time, the channels are padded to full tiles
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < count; i += 4) {
+    __m128 const haze = fastExp(_mm_mul_ps(_mm_load_ps(depths + i), _mm_set1_ps(-falloff)));
+    __m128 const weights[4] = {
+      _mm_shuffle_ps(haze, haze, _MM_SHUFFLE(0,0,0,0)),
+      _mm_shuffle_ps(haze, haze, _MM_SHUFFLE(1,1,1,1)),
+      _mm_shuffle_ps(haze, haze, _MM_SHUFFLE(2,2,2,2)),
+      _mm_shuffle_ps(haze, haze, _MM_SHUFFLE(3,3,3,3))
+    };
+    for (int k = 0; k < 4; ++k) {
+      // color*haze + hazeColor*(1-haze)
+      __m128 const color = colors[i+k].mmvalue;
+      colors[i+k] = Color(_mm_add_ps(hazeColor.mmvalue,
+                                     _mm_mul_ps(weights[k], _mm_sub_ps(color, hazeColor.mmvalue))));
+    }
+  }
+}
+
+void applyDesaturation(FrameBuffer * frame, float intensity) {
+  assert(frame->hasChannel(FrameBuffer::COLOR));
+  Color * colors = frame->colorData();
+  long const count = frame->size();
+  __m128 const third = _mm_set_ps(0.0f, 1.0f/3, 1.0f/3, 1.0f/3);
+  __m128 const weight = _mm_set1_ps(intensity);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < count; ++i) {
+    // color + intensity*(gray - color), the alpha lane stays 0
+    __m128 const color = colors[i].mmvalue;
+    __m128 const gray = _mm_dp_ps(color, third, 0x77);
+    colors[i] = Color(_mm_add_ps(color, _mm_mul_ps(weight, _mm_sub_ps(gray, color))));
+  }
+}
+
+void applyDenoising(FrameBuffer * frame, FrameBuffer const& guides,
+                    int iterations, float colorSigma, float albedoSigma,
+                    float normalPower, float depthSigma) {
+  assert(frame->hasChannel(FrameBuffer::COLOR));
+  assert(guides.width() == frame->width() && guides.height() == frame->height());
+  int const width = frame->width(), height = frame->height();
+  bool const hasVariances = frame->hasChannel(FrameBuffer::VARIANCE);
+  bool const hasNormals = guides.hasChannel(FrameBuffer::NORMAL);
+  bool const hasDepths = guides.hasChannel(FrameBuffer::DEPTH);
+  bool const hasAlbedos = guides.hasChannel(FrameBuffer::ALBEDO);
+  std::size_t const count = std::size_t(width)*height;
+
+  // Row major copies of the color, its variance and the guides. Unknown
+  // variances (single samples) are clamped to the largest possible one.
+  std::vector<Color, AlignedAllocator<Color> > colors(count), filteredColors(count), albedos(count);
+  std::vector<Vector3d, AlignedAllocator<Vector3d> > normals(count);
+  std::vector<float> variances(count, 0.0f), filteredVariances(count), blurredVariances(count);
+  std::vector<float> depths(count, 0.0f), gradients(count, 0.0f);
+  std::vector<unsigned char> hits(count, 1);
+  #pragma omp parallel for
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      std::size_t const i = std::size_t(y)*width + x;
+      colors[i] = frame->color(x, y);
+      if (hasVariances)
+        variances[i] = std::min(frame->variance(x, y), 1.0f);
+      if (hasAlbedos)
+        albedos[i] = guides.albedo(x, y);
+      // Averaged normals (e.g. of a DepthOfFieldRenderer) are shorter than
+      // 1, only their directions are compared
+      if (hasNormals && length(guides.normal(x, y)) > 0.0f)
+        normals[i] = normalized(guides.normal(x, y));
+      if (hasDepths) {
+        depths[i] = guides.depth(x, y);
+        hits[i] = std::isfinite(depths[i]);
+      } else if (hasNormals) {
+        hits[i] = length(normals[i]) > 0.0f;
+      }
+    }
+  }
+
+  // Without a variance channel the noise is estimated from the luminances
+  // of the 3x3 neighbourhood
+  if (!hasVariances) {
+    __m128 const luminanceWeights = _mm_set_ps(0.0f, 0.0722f, 0.7152f, 0.2126f);
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        float sum = 0.0f, squares = 0.0f;
+        int n = 0;
+        for (int qy = std::max(y-1, 0); qy <= std::min(y+1, height-1); ++qy) {
+          for (int qx = std::max(x-1, 0); qx <= std::min(x+1, width-1); ++qx) {
+            float const l = _mm_cvtss_f32(_mm_dp_ps(clamped(colors[std::size_t(qy)*width + qx]).mmvalue,
+                                                    luminanceWeights, 0x71));
+            sum += l;
+            squares += l*l;
+            ++n;
+          }
+        }
+        variances[std::size_t(y)*width + x] = std::max(squares/n - (sum/n)*(sum/n), 0.0f);
+      }
+    }
+  }
+
+  // Largest depth change to a horizontal or vertical neighbour, so slanted
+  // surfaces tolerate larger depth differences
+  if (hasDepths) {
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        std::size_t const i = std::size_t(y)*width + x;
+        if (!hits[i])
+          continue;
+        float gradient = 0.0f;
+        int const neighbours[4][2] = {{x-1,y}, {x+1,y}, {x,y-1}, {x,y+1}};
+        for (int k = 0; k < 4; ++k) {
+          int const nx = neighbours[k][0], ny = neighbours[k][1];
+          if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+            continue;
+          std::size_t const j = std::size_t(ny)*width + nx;
+          if (hits[j])
+            gradient = std::max(gradient, std::fabs(depths[j] - depths[i]));
+        }
+        gradients[i] = gradient;
+      }
+    }
+  }
+
+  // B3 spline kernel, its taps are spread apart by 2^iteration pixels
+  float const kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+  float const albedoFactor = 1.0f/(albedoSigma*albedoSigma);
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    int const step = 1 << iteration;
+
+    // The color difference allowed between two pixels depends on the noise
+    // around them
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        float sum = 0.0f, weightSum = 0.0f;
+        for (int qy = std::max(y-1, 0); qy <= std::min(y+1, height-1); ++qy) {
+          for (int qx = std::max(x-1, 0); qx <= std::min(x+1, width-1); ++qx) {
+            float const weight = (qx == x ? 0.5f : 0.25f)*(qy == y ? 0.5f : 0.25f);
+            sum += weight*variances[std::size_t(qy)*width + qx];
+            weightSum += weight;
+          }
+        }
+        blurredVariances[std::size_t(y)*width + x] = sum/weightSum;
+      }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (int y = 0; y < height; ++y) {
+      // Exponents and kernel weights of the 25 taps, padded for four at a time
+      alignas(16) float exponents[28];
+      alignas(16) float weights[28];
+      int taps[28];
+      for (int x = 0; x < width; ++x) {
+        std::size_t const i = std::size_t(y)*width + x;
+        __m128 const center = clamped(colors[i]).mmvalue;
+        float const colorFactor = 1.0f/(colorSigma*std::sqrt(blurredVariances[i]) + 1e-4f);
+        int tapCount = 0;
+        for (int dy = -2; dy <= 2; ++dy) {
+          int const qy = y + dy*step;
+          if (qy < 0 || qy >= height)
+            continue;
+          for (int dx = -2; dx <= 2; ++dx) {
+            int const qx = x + dx*step;
+            if (qx < 0 || qx >= width)
+              continue;
+            std::size_t const j = std::size_t(qy)*width + qx;
+            __m128 const delta = _mm_sub_ps(clamped(colors[j]).mmvalue, center);
+            float exponent = -_mm_cvtss_f32(_mm_sqrt_ss(_mm_dp_ps(delta, delta, 0x71)))*colorFactor;
+            // The guides only describe pixels that hit something
+            if (hits[i] && hits[j]) {
+              if (hasAlbedos) {
+                __m128 const delta = _mm_sub_ps(albedos[j].mmvalue, albedos[i].mmvalue);
+                exponent -= _mm_cvtss_f32(_mm_dp_ps(delta, delta, 0x71))*albedoFactor;
+              }
+              // exp(-p*(1-cos)) falls off like cos^p for similar normals
+              if (hasNormals)
+                exponent -= normalPower*(1.0f - dotProduct(normals[i], normals[j]));
+              if (hasDepths) {
+                float const distance = step*std::sqrt(float(dx*dx + dy*dy));
+                exponent -= std::fabs(depths[j] - depths[i])
+                    /(depthSigma*gradients[i]*distance + 1e-3f*depths[i]);
+              }
+            }
+            exponents[tapCount] = exponent;
+            weights[tapCount] = kernel[dx+2]*kernel[dy+2];
+            taps[tapCount] = static_cast<int>(j);
+            ++tapCount;
+          }
+        }
+        int const paddedCount = (tapCount + 3) & ~3;
+        for (int k = tapCount; k < paddedCount; ++k) {
+          exponents[k] = 0.0f;
+          weights[k] = 0.0f;
+          taps[k] = static_cast<int>(i);
+        }
+
+        // Weighted mean of the colors, and the variance of that mean. The
+        // center tap always has the full kernel weight, so the weight sum
+        // is never 0.
+        __m128 colorSum = _mm_setzero_ps(), weightSum = _mm_setzero_ps(), varianceSum = _mm_setzero_ps();
+        for (int k = 0; k < paddedCount; k += 4) {
+          __m128 const weight = _mm_mul_ps(fastExp(_mm_load_ps(exponents + k)), _mm_load_ps(weights + k));
+          __m128 const variance = _mm_set_ps(variances[taps[k+3]], variances[taps[k+2]],
+                                             variances[taps[k+1]], variances[taps[k]]);
+          weightSum = _mm_add_ps(weightSum, weight);
+          varianceSum = _mm_add_ps(varianceSum, _mm_mul_ps(_mm_mul_ps(weight, weight), variance));
+          colorSum = _mm_add_ps(colorSum, _mm_mul_ps(_mm_shuffle_ps(weight, weight, _MM_SHUFFLE(0,0,0,0)), colors[taps[k]].mmvalue));
+          colorSum = _mm_add_ps(colorSum, _mm_mul_ps(_mm_shuffle_ps(weight, weight, _MM_SHUFFLE(1,1,1,1)), colors[taps[k+1]].mmvalue));
+          colorSum = _mm_add_ps(colorSum, _mm_mul_ps(_mm_shuffle_ps(weight, weight, _MM_SHUFFLE(2,2,2,2)), colors[taps[k+2]].mmvalue));
+          colorSum = _mm_add_ps(colorSum, _mm_mul_ps(_mm_shuffle_ps(weight, weight, _MM_SHUFFLE(3,3,3,3)), colors[taps[k+3]].mmvalue));
+        }
+        weightSum = _mm_hadd_ps(weightSum, weightSum);
+        weightSum = _mm_hadd_ps(weightSum, weightSum);
+        varianceSum = _mm_hadd_ps(varianceSum, varianceSum);
+        varianceSum = _mm_hadd_ps(varianceSum, varianceSum);
+        filteredColors[i] = Color(_mm_div_ps(colorSum, weightSum));
+        filteredVariances[i] = _mm_cvtss_f32(_mm_div_ss(varianceSum, _mm_mul_ss(weightSum, weightSum)));
+      }
+    }
+    colors.swap(filteredColors);
+    variances.swap(filteredVariances);
+  }
+
+  #pragma omp parallel for
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      frame->setColor(x, y, colors[std::size_t(y)*width + x]);
+}
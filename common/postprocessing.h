@@ -0,0 +1,33 @@
+#ifndef POSTPROCESSING_H
+#define POSTPROCESSING_H
+
+#include "common/color.h"
+#include "common/framebuffer.h"
+
+// Image effects on a rendered FrameBuffer. They only need the channels of
+// a single trace, so any number of effect images cost one rendering, e.g.
+//   FrameBuffer const frame = renderer.renderFrame(..., COLOR | DEPTH);
+//   FrameBuffer hazy = frame;
+//   applyHaze(&hazy, hazeColor, falloff);
+// Depth images are normalized by FrameBuffer::toTexture(DEPTH).
+
+// Fades the color towards the haze color with exp(-depth*falloff), needs
+// the color and the depth channel
+void applyHaze(FrameBuffer * frame, Color const& hazeColor, float falloff);
+
+// Mixes the color with its gray value, an intensity of 1 gives a gray image
+void applyDesaturation(FrameBuffer * frame, float intensity);
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, with the
+// variance guidance of SVGF) that removes sampling noise from the color.
+// Pixels only blend with neighbours whose color differs by less than
+// colorSigma standard deviations of the noise (the VARIANCE channel, or the
+// local variance without it), and whose albedo, normal and depth in the
+// guides frame are similar. Each iteration doubles the filter footprint.
+// normalPower is the exponent of the cosine between two normals, depthSigma
+// scales the depth difference allowed relative to the local depth gradient.
+void applyDenoising(FrameBuffer * frame, FrameBuffer const& guides,
+                    int iterations, float colorSigma, float albedoSigma,
+                    float normalPower, float depthSigma);
+
+#endif // POSTPROCESSING_H
@@ -14,12 +14,19 @@ struct Ray {
   Vector3d direction; // d
   float length; // t
   Primitive const* primitive;
+  Primitive const* instancedPrimitive; // hit inside an Instance, which is the primitive then
   Vector2d surfacePosition;
   int remainingBounces; // how often the ray is allowed to bounce
 
+  // Ray differentials for one pixel step in x and y (Igehy 1999)
+  bool hasDifferentials;
+  Vector3d originDx, originDy;
+  Vector3d directionDx, directionDy;
+
   // Constructor
   Ray()
-    : length(INFINITY), primitive(nullptr), remainingBounces(4) {}
+    : length(INFINITY), primitive(nullptr), instancedPrimitive(nullptr), remainingBounces(4),
+      hasDifferentials(false) {}
 };
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef RAYDIFFERENTIALS_H
+#define RAYDIFFERENTIALS_H
+
+#include "common/ray.h"
+
+// Transfer the differentials of a ray to its hit point, which gives the
+// footprint of one pixel on the surface with the given normal
+inline void transferDifferentials(Ray const& ray, Vector3d const& normal,
+                                  Vector3d * positionDx, Vector3d * positionDy) {
+  if (!ray.hasDifferentials) {
+    *positionDx = Vector3d();
+    *positionDy = Vector3d();
+    return;
+  }
+
+  float const cosine = dotProduct(ray.direction, normal);
+  if (std::fabs(cosine) < EPSILON) {
+    *positionDx = Vector3d();
+    *positionDy = Vector3d();
+    return;
+  }
+
+  // Offsets of the neighboring rays at the distance of the hit...
+  Vector3d const dx = ray.originDx + ray.length*ray.directionDx;
+  Vector3d const dy = ray.originDy + ray.length*ray.directionDy;
+
+  // ... projected along the ray onto the tangent plane
+  *positionDx = dx - (dotProduct(dx, normal)/cosine)*ray.direction;
+  *positionDy = dy - (dotProduct(dy, normal)/cosine)*ray.direction;
+}
+
+// Update the differentials of a ray that is mirrored at a surface point.
+// Note: We assume a locally flat surface, i.e. the normal derivatives vanish.
+inline void reflectDifferentials(Ray * ray, Vector3d const& normal,
+                                 Vector3d const& positionDx, Vector3d const& positionDy) {
+  if (!ray->hasDifferentials)
+    return;
+  ray->originDx = positionDx;
+  ray->originDy = positionDy;
+  ray->directionDx = ray->directionDx - 2*dotProduct(ray->directionDx, normal)*normal;
+  ray->directionDy = ray->directionDy - 2*dotProduct(ray->directionDy, normal)*normal;
+}
+
+#endif // RAYDIFFERENTIALS_H
@@ -0,0 +1,52 @@
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include <cstdint>
+#include "common/ray.h"
+
+// A bundle of up to 16 coherent rays (e.g. the primary rays of a 4x4 pixel
+// block) that is traversed through the scene together. Besides the full rays,
+// which are used for shading, the packet keeps the traversal data as
+// structure of arrays, so four rays fit into one SSE register each.
+struct RayPacket {
+  static int const size = 16;
+  typedef uint32_t Mask; // one bit per ray
+
+  // Components
+  int count;
+  Ray rays[size];
+  alignas(16) float originX[size], originY[size], originZ[size];
+  alignas(16) float directionX[size], directionY[size], directionZ[size];
+  alignas(16) float length[size];
+
+  // Constructor
+  RayPacket() : count(0) {}
+
+  // Get
+  Mask activeMask() const { return (Mask(1) << this->count) - 1; }
+  float origin(int index, int dimension) const {
+    return (dimension == Vector3d::X ? this->originX
+            : dimension == Vector3d::Y ? this->originY : this->originZ)[index];
+  }
+  float direction(int index, int dimension) const {
+    return (dimension == Vector3d::X ? this->directionX
+            : dimension == Vector3d::Y ? this->directionY : this->directionZ)[index];
+  }
+
+  // Copy the origins, directions and lengths of the rays into the traversal
+  // arrays, unused slots are padded with rays that never hit anything
+  void update() {
+    for (int i = 0; i < size; ++i) {
+      Ray const& ray = this->rays[i < this->count ? i : 0];
+      this->originX[i] = ray.origin.x;
+      this->originY[i] = ray.origin.y;
+      this->originZ[i] = ray.origin.z;
+      this->directionX[i] = ray.direction.x;
+      this->directionY[i] = ray.direction.y;
+      this->directionZ[i] = ray.direction.z;
+      this->length[i] = i < this->count ? ray.length : 0.0f;
+    }
+  }
+};
+
+#endif // RAYPACKET_H
@@ -0,0 +1,205 @@
+#include "common/sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Integer hash with good avalanche behaviour (lowbias32 by C. Wellons)
+static inline uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// Hash based Owen scrambling (Burley 2020, "Practical Hash-based Owen
+// Scrambling"), every bit is flipped depending on all higher bits
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
+}
+
+// The first two dimensions of the Sobol sequence
+static inline uint32_t sobol0(uint32_t index) {
+  return reverseBits(index);
+}
+static inline uint32_t sobol1(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    if (index & 1)
+      result ^= v;
+  return result;
+}
+
+// Random permutation of [0,count) selected by seed (Kensler 2013,
+// "Correlated Multi-Jittered Sampling")
+static uint32_t permute(uint32_t i, uint32_t count, uint32_t seed) {
+  uint32_t w = count-1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= seed;
+    i *= 0xe170893du;
+    i ^= seed >> 16;
+    i ^= (i & w) >> 4;
+    i ^= seed >> 8;
+    i *= 0x0929eb3fu;
+    i ^= seed >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | seed >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= count);
+  return (i + seed) % count;
+}
+
+static inline float toUnitFloat(uint32_t x) {
+  return (x >> 8) * (1.0f/16777216.0f);
+}
+
+// Blue noise mask ////////////////////////////////////////////////////////////
+
+static int const maskSize = 64;
+
+// Ranks the pixels of a tileable mask by farthest point insertion: each
+// pixel is the one farthest away from all pixels before it, which spreads
+// every prefix of the ranking evenly. The rank becomes the value.
+static std::vector<float> blueNoiseMask(uint32_t seed) {
+  int const count = maskSize*maskSize;
+  std::vector<float> distance(count, INFINITY);
+  std::vector<float> mask(count, -1.0f);
+
+  // Tiny hashed offsets break the ties between equally distant pixels
+  std::vector<float> tieBreak(count);
+  for (int i = 0; i < count; ++i)
+    tieBreak[i] = toUnitFloat(hash(i ^ seed)) * 1e-3f;
+
+  int next = hash(seed) % count;
+  for (int rank = 0; rank < count; ++rank) {
+    mask[next] = (rank + 0.5f)/count;
+    int const px = next % maskSize;
+    int const py = next / maskSize;
+    int farthest = -1;
+    float farthestDistance = -1.0f;
+    for (int i = 0; i < count; ++i) {
+      // Toroidal distance to the new pixel
+      int dx = std::abs(i % maskSize - px);
+      int dy = std::abs(i / maskSize - py);
+      dx = std::min(dx, maskSize-dx);
+      dy = std::min(dy, maskSize-dy);
+      distance[i] = std::min(distance[i], static_cast<float>(dx*dx + dy*dy));
+      if (mask[i] < 0.0f && distance[i] + tieBreak[i] > farthestDistance) {
+        farthestDistance = distance[i] + tieBreak[i];
+        farthest = i;
+      }
+    }
+    next = farthest;
+  }
+  return mask;
+}
+
+// Two independent masks, built on first use
+static Vector2d blueNoise(int x, int y) {
+  static std::vector<float> const maskU = blueNoiseMask(0x9e3779b9u);
+  static std::vector<float> const maskV = blueNoiseMask(0x85ebca6bu);
+  int const i = (y & (maskSize-1))*maskSize + (x & (maskSize-1));
+  return Vector2d(maskU[i], maskV[i]);
+}
+
+// Pcg32 ///////////////////////////////////////////////////////////////////////
+
+void Pcg32::advance(uint64_t count) {
+  // Compose the affine steps by repeated squaring
+  uint64_t stepMultiplier = multiplier, stepIncrement = this->increment_;
+  uint64_t totalMultiplier = 1, totalIncrement = 0;
+  while (count) {
+    if (count & 1) {
+      totalMultiplier *= stepMultiplier;
+      totalIncrement = totalIncrement*stepMultiplier + stepIncrement;
+    }
+    stepIncrement = (stepMultiplier+1)*stepIncrement;
+    stepMultiplier *= stepMultiplier;
+    count >>= 1;
+  }
+  this->state_ = totalMultiplier*this->state_ + totalIncrement;
+}
+
+// Sampler /////////////////////////////////////////////////////////////////////
+
+uint32_t Sampler::pixelSeed(int x, int y, int dimension) const {
+  return hash(this->seed_ ^ hash(static_cast<uint32_t>(x) + hash(static_cast<uint32_t>(y) + hash(dimension))));
+}
+
+Pcg32 Sampler::random(int x, int y, int dimension) const {
+  return Pcg32(this->pixelSeed(x, y, dimension), dimension);
+}
+
+Vector2d Sampler::sample(int x, int y, int index, int count, int dimension) const {
+  switch (this->pattern_) {
+  case RANDOM: {
+    Pcg32 random = this->random(x, y, dimension);
+    random.advance(2*static_cast<uint64_t>(index));
+    float const u = random.uniform();
+    return Vector2d(u, random.uniform());
+  }
+  case STRATIFIED: {
+    // The cells are visited in a random order per dimension, so that the
+    // cells of different dimensions are not correlated
+    int const size = std::max(static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count)))), 1);
+    uint32_t const seed = this->pixelSeed(x, y, dimension);
+    Pcg32 random(seed, dimension);
+    random.advance(2*static_cast<uint64_t>(index));
+    float const u = random.uniform();
+    float const v = random.uniform();
+    if (index >= size*size)
+      return Vector2d(u, v);
+    int const cell = permute(index, size*size, seed);
+    return Vector2d((cell % size + u)/size, (cell / size + v)/size);
+  }
+  case SOBOL: {
+    uint32_t const seed = this->pixelSeed(x, y, dimension);
+    uint32_t const shuffled = nestedUniformScramble(index, seed);
+    return Vector2d(toUnitFloat(nestedUniformScramble(sobol0(shuffled), hash(seed ^ 1))),
+                    toUnitFloat(nestedUniformScramble(sobol1(shuffled), hash(seed ^ 2))));
+  }
+  case BLUE_NOISE: {
+    // The same sequence for every pixel, each dimension looks at another
+    // part of the mask
+    uint32_t const seed = hash(this->seed_ ^ hash(dimension));
+    uint32_t const shuffled = nestedUniformScramble(index, seed);
+    Vector2d const point(toUnitFloat(nestedUniformScramble(sobol0(shuffled), hash(seed ^ 1))),
+                         toUnitFloat(nestedUniformScramble(sobol1(shuffled), hash(seed ^ 2))));
+    Vector2d const offset = blueNoise(x + (seed & 63), y + ((seed >> 6) & 63));
+    float const u = point.u + offset.u;
+    float const v = point.v + offset.v;
+    return Vector2d(u < 1.0f ? u : u - 1.0f, v < 1.0f ? v : v - 1.0f);
+  }
+  }
+  return Vector2d();
+}
@@ -0,0 +1,80 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include "common/vector2d.h"
+
+// PCG32 random number generator (O'Neill, pcg-random.org), small and fast,
+// with independent streams and jumping ahead in O(log n)
+class Pcg32 {
+
+public:
+  // Constructor
+  Pcg32(uint64_t seed, uint64_t stream = 0)
+    : state_(0), increment_((stream << 1) | 1u) {
+    this->next();
+    this->state_ += seed;
+    this->next();
+  }
+
+  uint32_t next() {
+    uint64_t const state = this->state_;
+    this->state_ = state*multiplier + this->increment_;
+    uint32_t const shifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+    uint32_t const rotation = static_cast<uint32_t>(state >> 59);
+    return (shifted >> rotation) | (shifted << ((32-rotation) & 31));
+  }
+  // Uniform in [0,1)
+  float uniform() { return (this->next() >> 8) * (1.0f/16777216.0f); }
+  // Skip the next count numbers
+  void advance(uint64_t count);
+
+private:
+  static uint64_t const multiplier = 6364136223846793005ull;
+  uint64_t state_;
+  uint64_t increment_;
+
+};
+
+// Sample points for a pixel. The points only depend on the pixel, the
+// sample and the seed, never on the thread or the order in which pixels
+// are rendered, so images are identical for any number of threads.
+class Sampler {
+
+public:
+  enum Pattern {
+    RANDOM,     // independent uniform points, one PCG stream per pixel
+    STRATIFIED, // one jittered point per cell of a square grid
+    SOBOL,      // Owen scrambled Sobol (0,2)-sequence, scrambled per pixel
+    BLUE_NOISE  // one Sobol sequence for all pixels, shifted per pixel by a
+                // blue noise mask, so the error of neighbors is uncorrelated
+  };
+
+  // Constructor
+  Sampler(Pattern pattern = STRATIFIED, uint32_t seed = 0)
+    : pattern_(pattern), seed_(seed) {}
+
+  // Get
+  Pattern pattern() const { return this->pattern_; }
+  uint32_t seed() const { return this->seed_; }
+
+  // Set
+  void setPattern(Pattern pattern) { this->pattern_ = pattern; }
+  void setSeed(uint32_t seed) { this->seed_ = seed; }
+
+  // Point number index of count points in [0,1)^2 for the pixel (x,y).
+  // Every independent use of random numbers in a pixel (e.g. the position
+  // in the pixel and on the lens) takes its own dimension.
+  Vector2d sample(int x, int y, int index, int count, int dimension = 0) const;
+  // A random stream of its own for a pixel and dimension
+  Pcg32 random(int x, int y, int dimension = 0) const;
+
+private:
+  uint32_t pixelSeed(int x, int y, int dimension) const;
+
+  Pattern pattern_;
+  uint32_t seed_;
+
+};
+
+#endif // SAMPLER_H
@@ -1,46 +1,735 @@
-#include <fstream>
+#include <algorithm>
+#include <cstdio>
 #include <cmath>
+#include <cstring>
+#include <immintrin.h>
+#include <QImage>
 #include "common/texture.h"
+#include "common/texturecache.h"
+
+// Wrap an integer texel coordinate into [0,size)
+static inline int wrapCoordinate(int x, int size, Texture::WrapMode wrapMode) {
+  if (0 <= x && x < size)
+    return x;
+  if (wrapMode == Texture::CLAMP)
+    return x < 0 ? 0 : size-1;
+  x %= size;
+  return x < 0 ? x+size : x;
+}
+
+// Half float conversion ///////////////////////////////////////////////////////
+
+#ifndef __F16C__
+static float halfToFloat(uint16_t half) {
+  uint32_t const sign = uint32_t(half & 0x8000u) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000u | (mantissa << 13); // infinity or NaN
+  } else if (exponent > 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Denormalized halfs are normal floats
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint16_t const sign = (bits >> 16) & 0x8000u;
+  uint32_t const mantissa = bits & 0x7fffffu;
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00u | (mantissa ? 0x200u : 0u); // infinity or NaN
+  int const exponent = int((bits >> 23) & 0xff) - 112;
+  if (exponent >= 0x1f)
+    return sign | 0x7c00u;
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+    // Denormalized half, rounded to nearest
+    int const shift = 14 - exponent;
+    return sign | uint16_t(((mantissa | 0x800000u) + (1u << (shift-1))) >> shift);
+  }
+  // Rounded to nearest, a carry into the exponent is fine
+  return sign | uint16_t(((uint32_t(exponent) << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+#endif
+
+// Four halfs in a 64-bit word <-> float RGBA
+static inline __m128 unpackHalf(uint64_t halfs) {
+#ifdef __F16C__
+  return _mm_cvtph_ps(_mm_cvtsi64_si128(halfs));
+#else
+  return _mm_set_ps(halfToFloat(uint16_t(halfs >> 48)), halfToFloat(uint16_t(halfs >> 32)),
+                    halfToFloat(uint16_t(halfs >> 16)), halfToFloat(uint16_t(halfs)));
+#endif
+}
+
+static inline uint64_t packHalf(__m128 rgba) {
+#ifdef __F16C__
+  return _mm_cvtsi128_si64(_mm_cvtps_ph(rgba, 0));
+#else
+  float values[4];
+  _mm_storeu_ps(values, rgba);
+  return uint64_t(floatToHalf(values[0])) | uint64_t(floatToHalf(values[1])) << 16 |
+         uint64_t(floatToHalf(values[2])) << 32 | uint64_t(floatToHalf(values[3])) << 48;
+#endif
+}
+
+// Block compression ///////////////////////////////////////////////////////////
+// Both formats follow the layout of their BCn counterparts, but they are
+// only ever decoded by the sampler below.
+//
+// BC1: two RGB565 endpoints (c0 in the low half of the first word) and
+// sixteen 2-bit indices in the second word. With c0 > c1 the palette is
+// c0, c1, 2/3 c0 + 1/3 c1 and 1/3 c0 + 2/3 c1.
+//
+// BC4 (two of them make a BC5 block): two 8-bit endpoints followed by
+// sixteen 3-bit indices, 64 bits in total. With r0 > r1 the palette
+// interpolates six values between r0 and r1.
+
+static inline __m128 unpack565(uint32_t color) {
+  __m128i const channels = _mm_set_epi32(0, color & 0x1f, (color >> 5) & 0x3f, color >> 11);
+  return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(channels), _mm_set_ps(0.0f, 1.0f/31.0f, 1.0f/63.0f, 1.0f/31.0f)),
+                    _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f));
+}
+
+static inline uint32_t pack565(float const rgb[3]) {
+  return uint32_t(std::lround(std::min(std::max(rgb[0], 0.0f), 1.0f)*31.0f)) << 11 |
+         uint32_t(std::lround(std::min(std::max(rgb[1], 0.0f), 1.0f)*63.0f)) << 5 |
+         uint32_t(std::lround(std::min(std::max(rgb[2], 0.0f), 1.0f)*31.0f));
+}
+
+// Weights of c0 and c1 for each index, in four and three color mode. The
+// last entry of the three color mode is black (alpha stays 1 from c0).
+static float const weightsBC1[2][4][2] = {
+  { { 1.0f, 0.0f }, { 0.0f, 1.0f }, { 2.0f/3.0f, 1.0f/3.0f }, { 1.0f/3.0f, 2.0f/3.0f } },
+  { { 1.0f, 0.0f }, { 0.0f, 1.0f }, { 0.5f, 0.5f }, { 0.0f, 0.0f } }
+};
+
+static inline __m128 decodeBC1(uint32_t const* block, int texel) {
+  uint32_t const c0 = block[0] & 0xffff;
+  uint32_t const c1 = block[0] >> 16;
+  float const* weights = weightsBC1[c0 <= c1][(block[1] >> (2*texel)) & 3];
+  __m128 const color = _mm_add_ps(_mm_mul_ps(unpack565(c0), _mm_set1_ps(weights[0])),
+                                  _mm_mul_ps(unpack565(c1), _mm_set1_ps(weights[1])));
+  return _mm_blend_ps(color, _mm_set1_ps(1.0f), 0x8);
+}
+
+// The four colors a BC1 block can represent
+static inline void paletteBC1(uint32_t endpoints, __m128 palette[4]) {
+  uint32_t const block[2] = { endpoints, 0xe4u }; // indices 0, 1, 2, 3
+  for (int p = 0; p < 4; ++p)
+    palette[p] = decodeBC1(block, p);
+}
+
+static void encodeBC1(__m128 const texels[16], uint32_t * block) {
+  // Bounding box and mean of the colors
+  __m128 minimum = texels[0];
+  __m128 maximum = texels[0];
+  __m128 mean = _mm_setzero_ps();
+  for (int i = 0; i < 16; ++i) {
+    minimum = _mm_min_ps(minimum, texels[i]);
+    maximum = _mm_max_ps(maximum, texels[i]);
+    mean = _mm_add_ps(mean, texels[i]);
+  }
+  mean = _mm_mul_ps(mean, _mm_set1_ps(1.0f/16.0f));
+
+  // The endpoints lie on the diagonal of the box that follows the
+  // correlation of red and blue with green
+  __m128 covariance = _mm_setzero_ps();
+  for (int i = 0; i < 16; ++i) {
+    __m128 const delta = _mm_sub_ps(texels[i], mean);
+    covariance = _mm_add_ps(covariance, _mm_mul_ps(delta, _mm_shuffle_ps(delta, delta, _MM_SHUFFLE(1,1,1,1))));
+  }
+  float low[4], high[4], correlation[4];
+  _mm_storeu_ps(low, minimum);
+  _mm_storeu_ps(high, maximum);
+  _mm_storeu_ps(correlation, covariance);
+  if (correlation[0] < 0.0f)
+    std::swap(low[0], high[0]);
+  if (correlation[2] < 0.0f)
+    std::swap(low[2], high[2]);
+
+  // Inset the box a little, the outliers get a bit more error but all the
+  // other colors are closer to the palette
+  for (int c = 0; c < 3; ++c) {
+    float const inset = (high[c] - low[c])/16.0f;
+    high[c] -= inset;
+    low[c] += inset;
+  }
+  uint32_t c0 = pack565(high);
+  uint32_t c1 = pack565(low);
+  if (c0 == c1) {
+    block[0] = c0 | c1 << 16;
+    block[1] = 0;
+    return;
+  }
+  // Four color mode needs c0 > c1
+  if (c0 < c1)
+    std::swap(c0, c1);
+  block[0] = c0 | c1 << 16;
+
+  // Pick the closest palette entry for every texel
+  __m128 palette[4];
+  paletteBC1(block[0], palette);
+  uint32_t indices = 0;
+  for (int i = 0; i < 16; ++i) {
+    int best = 0;
+    float bestDistance = INFINITY;
+    for (int p = 0; p < 4; ++p) {
+      __m128 const delta = _mm_sub_ps(texels[i], palette[p]);
+      float const distance = _mm_cvtss_f32(_mm_dp_ps(delta, delta, 0x71));
+      if (distance < bestDistance) {
+        bestDistance = distance;
+        best = p;
+      }
+    }
+    indices |= uint32_t(best) << (2*i);
+  }
+  block[1] = indices;
+}
+
+// Weights of r0 and r1 and a constant for each index, in eight and six
+// value mode (the last two values of the latter are 0 and 1)
+static float const weightsBC4[2][8][3] = {
+  { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 6/7.0f, 1/7.0f, 0.0f }, { 5/7.0f, 2/7.0f, 0.0f },
+    { 4/7.0f, 3/7.0f, 0.0f }, { 3/7.0f, 4/7.0f, 0.0f }, { 2/7.0f, 5/7.0f, 0.0f }, { 1/7.0f, 6/7.0f, 0.0f } },
+  { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 4/5.0f, 1/5.0f, 0.0f }, { 3/5.0f, 2/5.0f, 0.0f },
+    { 2/5.0f, 3/5.0f, 0.0f }, { 1/5.0f, 4/5.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } }
+};
+
+static inline float decodeBC4(uint32_t const* block, int texel) {
+  uint64_t const bits = uint64_t(block[0]) | uint64_t(block[1]) << 32;
+  uint32_t const r0 = bits & 0xff;
+  uint32_t const r1 = (bits >> 8) & 0xff;
+  float const* weights = weightsBC4[r0 <= r1][(bits >> (16 + 3*texel)) & 7];
+  return (weights[0]*r0 + weights[1]*r1)*(1.0f/255.0f) + weights[2];
+}
+
+static void encodeBC4(float const values[16], uint32_t * block) {
+  float minimum = values[0], maximum = values[0];
+  for (int i = 1; i < 16; ++i) {
+    minimum = std::min(minimum, values[i]);
+    maximum = std::max(maximum, values[i]);
+  }
+  uint64_t const r0 = std::lround(std::min(std::max(maximum, 0.0f), 1.0f)*255.0f);
+  uint64_t const r1 = std::lround(std::min(std::max(minimum, 0.0f), 1.0f)*255.0f);
+  uint64_t bits = r0 | r1 << 8;
+
+  // Eight value mode (r0 > r1), the closest value for every texel
+  if (r0 > r1) {
+    float palette[8];
+    palette[0] = r0/255.0f;
+    palette[1] = r1/255.0f;
+    for (int p = 2; p < 8; ++p)
+      palette[p] = ((8-p)*palette[0] + (p-1)*palette[1])/7.0f;
+    for (int i = 0; i < 16; ++i) {
+      uint64_t best = 0;
+      for (int p = 1; p < 8; ++p)
+        if (std::fabs(values[i] - palette[p]) < std::fabs(values[i] - palette[best]))
+          best = p;
+      bits |= best << (16 + 3*i);
+    }
+  }
+  block[0] = uint32_t(bits);
+  block[1] = uint32_t(bits >> 32);
+}
+
+// Levels //////////////////////////////////////////////////////////////////////
+
+void Texture::Level::allocate(int width, int height, Layout layout, Format format) {
+  this->width = width;
+  this->height = height;
+  this->format = format;
+  this->tilesPerRow = (width+3)/4;
+  // Tiled levels are padded to full tiles, compressed levels always consist
+  // of blocks
+  int const blocks = this->tilesPerRow*((height+3)/4);
+  this->layout = (format == BC1 || format == BC5) ? TILED : layout;
+  int const texels = this->layout == TILED ? blocks*16 : width*height;
+  switch (format) {
+  case RGBA8:
+    this->data.assign(texels, 0xff000000u);
+    break;
+  case HALF:
+    this->data.assign(2*texels, 0u);
+    break;
+  case BC1:
+    this->data.assign(2*blocks, 0u);
+    break;
+  case BC5:
+    this->data.assign(4*blocks, 0u);
+    break;
+  }
+}
+
+__m128 Texture::Level::fetch(int x, int y) const {
+  switch (this->format) {
+  case RGBA8:
+    return unpackTexel(this->data[this->index(x,y)]);
+  case HALF: {
+    uint32_t const* texel = &this->data[2*this->index(x,y)];
+    return unpackHalf(uint64_t(texel[0]) | uint64_t(texel[1]) << 32);
+  }
+  case BC1:
+    return decodeBC1(&this->data[2*this->block(x,y)], ((y & 3) << 2) + (x & 3));
+  case BC5: {
+    // Normal maps: x and y are stored, z is reconstructed
+    uint32_t const* block = &this->data[4*this->block(x,y)];
+    int const texel = ((y & 3) << 2) + (x & 3);
+    float const red = decodeBC4(block, texel);
+    float const green = decodeBC4(block+2, texel);
+    float const nx = 2.0f*red - 1.0f;
+    float const ny = 2.0f*green - 1.0f;
+    float const nz = std::sqrt(std::max(1.0f - nx*nx - ny*ny, 0.0f));
+    return _mm_set_ps(1.0f, 0.5f*(nz + 1.0f), green, red);
+  }
+  }
+  return _mm_setzero_ps();
+}
+
+void Texture::Level::store(int blockX, int blockY, __m128 const texels[16]) {
+  switch (this->format) {
+  case RGBA8:
+  case HALF:
+    for (int i = 0; i < 16; ++i) {
+      int const x = 4*blockX + (i & 3);
+      int const y = 4*blockY + (i >> 2);
+      if (x >= this->width || y >= this->height)
+        continue;
+      if (this->format == RGBA8) {
+        this->data[this->index(x,y)] = packTexel(texels[i]);
+      } else {
+        uint64_t const halfs = packHalf(texels[i]);
+        this->data[2*this->index(x,y)] = uint32_t(halfs);
+        this->data[2*this->index(x,y)+1] = uint32_t(halfs >> 32);
+      }
+    }
+    break;
+  case BC1:
+    encodeBC1(texels, &this->data[2*(blockY*this->tilesPerRow + blockX)]);
+    break;
+  case BC5: {
+    float red[16], green[16];
+    for (int i = 0; i < 16; ++i) {
+      float values[4];
+      _mm_storeu_ps(values, texels[i]);
+      red[i] = values[0];
+      green[i] = values[1];
+    }
+    uint32_t * block = &this->data[4*(blockY*this->tilesPerRow + blockX)];
+    encodeBC4(red, block);
+    encodeBC4(green, block+2);
+    break;
+  }
+  }
+}
+
+template <typename Function>
+void Texture::Level::fill(Function const& texelAt) {
+  int const blockRows = (this->height+3)/4;
+  #pragma omp parallel for
+  for (int blockY = 0; blockY < blockRows; ++blockY) {
+    __m128 texels[16];
+    for (int blockX = 0; blockX < this->tilesPerRow; ++blockX) {
+      // Blocks at the border repeat the last row and column
+      for (int i = 0; i < 16; ++i)
+        texels[i] = texelAt(std::min(4*blockX + (i & 3), this->width-1),
+                            std::min(4*blockY + (i >> 2), this->height-1));
+      this->store(blockX, blockY, texels);
+    }
+  }
+}
+
+// Texture /////////////////////////////////////////////////////////////////////
+
+Texture::Texture(int width, int height, Format format)
+  : wrapMode_(REPEAT) {
+  if (width > 0 && height > 0) {
+    this->image_ = std::make_shared<Image>();
+    this->image_->cacheFile = -1;
+    this->image_->levels.resize(1);
+    this->image_->levels[0].allocate(width, height, SCANLINE, format);
+  }
+}
+
+Texture::Texture(char const* fileName, LoadMode loadMode)
+  : wrapMode_(REPEAT) {
+  this->load(fileName, loadMode);
+}
+
+void Texture::resize(int width, int height) {
+  Texture resized(width, height);
+  if (!this->isNull()) {
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+        resized.setPixelAt(x, y, this->color((x+0.5f)/width, (y+0.5f)/height));
+
+    // Keep the storage of the original, the pyramid is built before the
+    // texels get compressed
+    resized.setLayout(this->layout());
+    if (this->levelCount() > 1)
+      resized.generateMipmaps();
+    resized.setFormat(this->format());
+  }
+  this->image_ = resized.image_;
+}
+
+bool Texture::load(char const* fileName, LoadMode loadMode) {
+  // HDR images are kept as half floats. The TextureCache only keeps 8-bit
+  // tiles, so they are always loaded eagerly.
+  std::size_t const length = std::strlen(fileName);
+  bool const isPFM = length > 4
+      && (!std::strcmp(fileName+length-4, ".pfm") || !std::strcmp(fileName+length-4, ".PFM"));
+
+  if (loadMode == LAZY && !isPFM) {
+    int const cacheFile = TextureCache::instance().open(fileName);
+    if (cacheFile >= 0)
+      return this->loadCached(cacheFile);
+
+    // Without a tiled file (e.g. next to an image in a read-only directory)
+    // the texture is still usable when it is resident
+    printf("(Texture): Loading %s eagerly instead\n", fileName);
+  }
+
+  if (isPFM) {
+    if (!this->loadPFM(fileName)) {
+      printf("(Texture): Could not open image file: %s\n", fileName);
+      this->image_.reset();
+      return false;
+    }
+  } else {
+    // Qt is only used to decode the file, the texels are converted once into
+    // our own linear RGBA layout
+    QImage const file = QImage(fileName).convertToFormat(QImage::Format_RGBA8888);
+    if (file.isNull()) {
+      printf("(Texture): Could not open image file: %s\n", fileName);
+      this->image_.reset();
+      return false;
+    }
+
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    image->cacheFile = -1;
+    image->levels.resize(1);
+    Level & level = image->levels[0];
+    level.allocate(file.width(), file.height(), SCANLINE, RGBA8);
+    for (int y = 0; y < level.height; ++y)
+      std::memcpy(&level.data[y*level.width], file.constScanLine(y), level.width*sizeof(uint32_t));
+    this->image_ = image;
+  }
+
+  // Textures read from disk are sampled, so they get their mipmaps right away
+  // and are stored in tiles, which keeps the taps of a lookup together
+  this->setLayout(TILED);
+  this->generateMipmaps();
+  return true;
+}
+
+bool Texture::loadPFM(char const* fileName) {
+  // Portable float map: "PF" (RGB) or "Pf" (gray), the size and the scale
+  // in text, then the rows from bottom to top. A negative scale means
+  // little endian floats.
+  FILE * file = std::fopen(fileName, "rb");
+  if (!file)
+    return false;
+  char magic[3] = {};
+  int width = 0, height = 0;
+  float scale = 0.0f;
+  if (std::fscanf(file, "%2s %d %d %f", magic, &width, &height, &scale) != 4 ||
+      (std::strcmp(magic, "PF") && std::strcmp(magic, "Pf")) ||
+      width <= 0 || height <= 0 || std::fgetc(file) == EOF) {
+    std::fclose(file);
+    return false;
+  }
+  int const channels = magic[1] == 'F' ? 3 : 1;
+  std::vector<float> values(std::size_t(width)*height*channels);
+  bool const complete = std::fread(values.data(), sizeof(float), values.size(), file) == values.size();
+  std::fclose(file);
+  if (!complete)
+    return false;
+
+  // We only run on little endian machines
+  if (scale > 0.0f) {
+    for (float & value : values) {
+      uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      bits = __builtin_bswap32(bits);
+      std::memcpy(&value, &bits, sizeof(bits));
+    }
+  }
+
+  std::shared_ptr<Image> image = std::make_shared<Image>();
+  image->cacheFile = -1;
+  image->levels.resize(1);
+  Level & level = image->levels[0];
+  level.allocate(width, height, SCANLINE, HALF);
+  level.fill([&](int x, int y) {
+    float const* texel = &values[(std::size_t(height-1-y)*width + x)*channels];
+    return channels == 3 ? _mm_set_ps(1.0f, texel[2], texel[1], texel[0])
+                         : _mm_set_ps(1.0f, texel[0], texel[0], texel[0]);
+  });
+  this->image_ = image;
+  return true;
+}
+
+bool Texture::loadCached(int cacheFile) {
+  if (cacheFile < 0) {
+    this->image_.reset();
+    return false;
+  }
+
+  // Only the level sizes are known up front, see TextureCache
+  std::vector<TextureCache::Level> const& levels = TextureCache::instance().levels(cacheFile);
+  std::shared_ptr<Image> image = std::make_shared<Image>();
+  image->cacheFile = cacheFile;
+  image->levels.resize(levels.size());
+  for (unsigned int i = 0; i < levels.size(); ++i) {
+    image->levels[i].width = levels[i].width;
+    image->levels[i].height = levels[i].height;
+    image->levels[i].layout = SCANLINE;
+    image->levels[i].format = RGBA8;
+  }
+  this->image_ = image;
+  return true;
+}
+
+bool Texture::save(char const* fileName) const {
+  if (this->isNull())
+    return false;
+
+  QImage file(this->width(), this->height(), QImage::Format_RGBA8888);
+  for (int y = 0; y < this->height(); ++y) {
+    uint32_t * line = reinterpret_cast<uint32_t*>(file.scanLine(y));
+    for (int x = 0; x < this->width(); ++x)
+      line[x] = this->texel(x,y);
+  }
+  return file.save(fileName);
+}
+
+std::size_t Texture::memoryUsage() const {
+  // Texels of lazily loaded images are accounted by the TextureCache
+  std::size_t bytes = 0;
+  if (!this->isNull() && !this->isLazy())
+    for (Level const& level : this->image_->levels)
+      bytes += level.data.size()*sizeof(uint32_t);
+  return bytes;
+}
+
+uint32_t Texture::texel(int x, int y, int levelIndex) const {
+  if (this->isLazy())
+    return TextureCache::instance().texel(this->image_->cacheFile, levelIndex, x, y);
+  Level const& level = this->image_->levels[levelIndex];
+  if (level.format == RGBA8)
+    return level.data[level.index(x,y)];
+  return packTexel(level.fetch(x,y));
+}
+
+Color Texture::pixel(int x, int y) const {
+  // Half float images keep their full range
+  if (this->isLazy())
+    return Color(_mm_and_ps(unpackTexel(this->texel(x,y)), colorMask()));
+  return Color(_mm_and_ps(this->image_->levels[0].fetch(x,y), colorMask()));
+}
+
+void Texture::setLayout(Layout layout) {
+  // Compressed formats are always stored in blocks
+  if (this->isNull() || this->isLazy() || this->layout() == layout ||
+      this->format() == BC1 || this->format() == BC5)
+    return;
+  this->convert(layout, this->format());
+}
+
+void Texture::setFormat(Format format) {
+  if (!this->isNull() && !this->isLazy() && this->format() != format)
+    this->convert(this->layout(), format);
+}
+
+void Texture::convert(Layout layout, Format format) {
+  // Reencode the texels of every level into a new image, copies of this
+  // texture keep the old one
+  std::shared_ptr<Image> image = std::make_shared<Image>();
+  image->cacheFile = -1;
+  image->levels.resize(this->image_->levels.size());
+  for (unsigned int i = 0; i < image->levels.size(); ++i) {
+    Level const& source = this->image_->levels[i];
+    Level & level = image->levels[i];
+    level.allocate(source.width, source.height, layout, format);
+    level.fill([&source](int x, int y) { return source.fetch(x,y); });
+  }
+  this->image_ = image;
+}
+
+void Texture::fill(std::function<Color(int x, int y)> const& colorAt) {
+  if (this->isNull() || this->isLazy())
+    return;
+
+  this->detach();
+  std::vector<Level> & levels = this->image_->levels;
+  levels.resize(1);
+  levels[0].fill([&colorAt](int x, int y) {
+    return _mm_blend_ps(colorAt(x, y).mmvalue, _mm_set1_ps(1.0f), 0x8);
+  });
+}
+
+void Texture::generateMipmaps() {
+  // Lazily loaded textures come with their pyramid
+  if (this->isNull() || this->isLazy())
+    return;
+
+  this->detach();
+
+  // Drop the old pyramid and reduce the image by 2x2 box filtering until
+  // a single texel is left
+  std::vector<Level> & levels = this->image_->levels;
+  levels.resize(1);
+  while (levels.back().width > 1 || levels.back().height > 1) {
+    Level const& source = levels.back();
+    Level level;
+    level.allocate(std::max(source.width/2, 1), std::max(source.height/2, 1),
+                   source.layout, source.format);
+    level.fill([&source](int x, int y) {
+      int const x0 = std::min(2*x, source.width-1);
+      int const x1 = std::min(2*x+1, source.width-1);
+      int const y0 = std::min(2*y, source.height-1);
+      int const y1 = std::min(2*y+1, source.height-1);
+      __m128 const sum = _mm_add_ps(_mm_add_ps(source.fetch(x0,y0), source.fetch(x1,y0)),
+                                    _mm_add_ps(source.fetch(x0,y1), source.fetch(x1,y1)));
+      return _mm_mul_ps(sum, _mm_set1_ps(0.25f));
+    });
+    levels.push_back(std::move(level));
+  }
+}
 
 Color Texture::color(float u, float v) const {
   if (this->isNull())
     return Color();
-
-  u = u * this->width() - 0.5f;
-  v = v * this->height() - 0.5f;
-  int const x = std::floor(u);
-  int const y = std::floor(v);
-  float const u_ratio = u - x;
-  float const v_ratio = v - y;
-  float const u_opposite = 1.0f - u_ratio;
-  float const v_opposite = 1.0f - v_ratio;
-  return
-      (this->pixel(x,y+0)*u_opposite + this->pixel(x+1,y+0)*u_ratio) * v_opposite +
-      (this->pixel(x,y+1)*u_opposite + this->pixel(x+1,y+1)*u_ratio) * v_ratio;
+  return Color(_mm_and_ps(this->bilinear(0, u, v), colorMask()));
 }
 
 Color Texture::color(Vector2d const& surfacePosition) const {
   return color(surfacePosition.u, surfacePosition.v);
 }
 
-bool Texture::savePPM(char const* fileName) {
-  if (!this->image_.isNull()) {
-    std::ofstream file(fileName);
-    file << "P3" << std::endl; // Magic number for .ppm
-    file << this->image_.width() << " " << this->image_.height() << " " << 255 << std::endl;
-    for (int y = this->image_.height()-1; y >= 0; --y) {
-      for (int x = 0; x < this->image_.width(); ++x) {
-        file << this->image_.pixelColor(x,y).red() << " "
-             << this->image_.pixelColor(x,y).green() << " "
-             << this->image_.pixelColor(x,y).blue() << " "
-             << "\t";
-      }
-      file << std::endl;
-      file << std::flush;
+Color Texture::color(float u, float v, float level) const {
+  if (this->isNull())
+    return Color();
+  return Color(_mm_and_ps(this->trilinear(u, v, level), colorMask()));
+}
+
+Color Texture::color(Vector2d const& surfacePosition,
+                     Vector2d const& uvDx, Vector2d const& uvDy) const {
+  if (this->isNull())
+    return Color();
+  return Color(_mm_and_ps(this->rgba(surfacePosition, uvDx, uvDy), colorMask()));
+}
+
+__m128 Texture::rgba(Vector2d const& surfacePosition,
+                     Vector2d const& uvDx, Vector2d const& uvDy) const {
+  if (this->isNull())
+    return _mm_setzero_ps();
+
+  // The level is chosen by the longer axis of the pixel footprint in texels
+  Vector2d const size(this->width(), this->height());
+  float const footprint = std::max(dotProduct(uvDx*size, uvDx*size),
+                                   dotProduct(uvDy*size, uvDy*size));
+  float const level = footprint > 1.0f ? 0.5f*std::log2(footprint) : 0.0f;
+  return this->trilinear(surfacePosition.u, surfacePosition.v, level);
+}
+
+__m128 Texture::trilinear(float u, float v, float level) const {
+  // Clamp the level to the pyramid and blend the two closest levels
+  float const maximumLevel = this->levelCount()-1;
+  level = std::min(std::max(level, 0.0f), maximumLevel);
+  int const level0 = static_cast<int>(level);
+  float const ratio = level - level0;
+  __m128 texel = this->bilinear(level0, u, v);
+  if (ratio > 0.0f)
+    texel = _mm_add_ps(texel, _mm_mul_ps(_mm_sub_ps(this->bilinear(level0+1, u, v), texel),
+                                         _mm_set1_ps(ratio)));
+  return texel;
+}
+
+__m128 Texture::bilinear(int levelIndex, float u, float v) const {
+  Level const& level = this->image_->levels[levelIndex];
+  int const width = level.width;
+  int const height = level.height;
+
+  u = u * width - 0.5f;
+  v = v * height - 0.5f;
+  int const x = std::floor(u);
+  int const y = std::floor(v);
+  __m128 const u_ratio = _mm_set1_ps(u - x);
+  __m128 const v_ratio = _mm_set1_ps(v - y);
+
+  // Wrapped texel coordinates of the four taps
+  int const x0 = wrapCoordinate(x, width, this->wrapMode_);
+  int const x1 = wrapCoordinate(x+1, width, this->wrapMode_);
+  int const y0 = wrapCoordinate(y, height, this->wrapMode_);
+  int const y1 = wrapCoordinate(y+1, height, this->wrapMode_);
+  __m128 t00, t10, t01, t11;
+  if (this->isLazy()) {
+    TextureCache & cache = TextureCache::instance();
+    int const cacheFile = this->image_->cacheFile;
+    t00 = unpackTexel(cache.texel(cacheFile, levelIndex, x0, y0));
+    t10 = unpackTexel(cache.texel(cacheFile, levelIndex, x1, y0));
+    t01 = unpackTexel(cache.texel(cacheFile, levelIndex, x0, y1));
+    t11 = unpackTexel(cache.texel(cacheFile, levelIndex, x1, y1));
+  } else if (level.format == RGBA8) {
+    uint32_t const* texels = level.data.data();
+    t00 = unpackTexel(texels[level.index(x0,y0)]);
+    t10 = unpackTexel(texels[level.index(x1,y0)]);
+    t01 = unpackTexel(texels[level.index(x0,y1)]);
+    t11 = unpackTexel(texels[level.index(x1,y1)]);
+  } else {
+    // Compressed and half float texels are decoded on the fly
+    t00 = level.fetch(x0,y0);
+    t10 = level.fetch(x1,y0);
+    t01 = level.fetch(x0,y1);
+    t11 = level.fetch(x1,y1);
+  }
+
+  // Bilinear interpolation on all channels at once
+  __m128 const top = _mm_add_ps(t00, _mm_mul_ps(_mm_sub_ps(t10, t00), u_ratio));
+  __m128 const bottom = _mm_add_ps(t01, _mm_mul_ps(_mm_sub_ps(t11, t01), u_ratio));
+  return _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), v_ratio));
+}
+
+bool Texture::savePPM(char const* fileName) const {
+  if (this->isNull())
+    return false;
+  FILE * file = std::fopen(fileName, "wb");
+  if (!file)
+    return false;
+
+  // Binary .ppm (P6), one write per row, top row (y=0) first like save()
+  std::fprintf(file, "P6\n%d %d\n255\n", this->width(), this->height());
+  std::vector<unsigned char> row(3*this->width());
+  bool success = true;
+  for (int y = 0; y < this->height() && success; ++y) {
+    for (int x = 0; x < this->width(); ++x) {
+      uint32_t const texel = this->texel(x,y);
+      row[3*x+0] = texel & 0xff;
+      row[3*x+1] = (texel >> 8) & 0xff;
+      row[3*x+2] = (texel >> 16) & 0xff;
     }
-    printf("Image file written to: \"%s\"\n", fileName);
-    file.close();
-    return true;
+    success = std::fwrite(row.data(), 1, row.size(), file) == row.size();
   }
-  return false;
+  success &= std::fclose(file) == 0;
+  if (success)
+    printf("Image file written to: \"%s\"\n", fileName);
+  return success;
 }
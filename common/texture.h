@@ -1,47 +1,166 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
-#include <QColor>
-#include <QImage>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "common/alignedallocator.h"
 #include "common/color.h"
 #include "common/vector2d.h"
 
 class Texture {
 
 public:
+  // Behaviour of lookups outside of the [0,1] range
+  enum WrapMode {
+    REPEAT,
+    CLAMP
+  };
+  // Order of the texels in memory
+  enum Layout {
+    SCANLINE, // row by row
+    TILED     // 4x4 texel tiles, one cache line each, tiles row by row
+  };
+  // Storage format of the texels
+  enum Format {
+    RGBA8, // 8-bit per channel, 4 bytes per texel
+    BC1,   // block compressed RGB (565 endpoints), 0.5 bytes per texel
+    BC5,   // block compressed two channels (e.g. normal x and y), 1 byte per texel
+    HALF   // 16-bit float RGBA for HDR images, 8 bytes per texel
+  };
+  // When the texels of an image file are read
+  enum LoadMode {
+    EAGER, // decode the whole image while loading
+    LAZY   // read tiles on first access through the TextureCache, if its
+           // tiled file can be written (8-bit images only, HDR images and
+           // the others are loaded eagerly)
+  };
+
   // Constructor
-  Texture(int width = 0, int height = 0)
-    : image_(width, height, QImage::Format_RGB32) {}
-  Texture(char const* fileName)
-    : image_(fileName) {}
+  Texture(int width = 0, int height = 0, Format format = RGBA8);
+  Texture(char const* fileName, LoadMode loadMode = EAGER);
 
   // Image functions
-  void resize(int width, int height) { this->image_ = this->image_.scaled(width, height); }
-  bool load(char const* fileName) { return this->image_.load(fileName); }
-  bool save(char const* fileName) { return this->image_.save(fileName); }
-  bool savePPM(char const* fileName);
+  // Note: Copies of a texture share their texels until one of them changes
+  // them (copy on write, like the QImage did before): setPixelAt() and
+  // generateMipmaps() copy shared texels first, and load(), resize(),
+  // setLayout() and setFormat() give a texture new storage anyway. A shared
+  // texture must not be changed from several threads at once.
+  void resize(int width, int height);
+  bool load(char const* fileName, LoadMode loadMode = EAGER);
+  // Lazily loaded texture of a file that is open in the TextureCache
+  bool loadCached(int cacheFile);
+  bool save(char const* fileName) const;
+  bool savePPM(char const* fileName) const;
+  void generateMipmaps();
+  // Encode the whole image from the colors a function returns for (x,y),
+  // in the format of the texture, so HALF textures keep HDR colors. The
+  // mipmaps are dropped.
+  void fill(std::function<Color(int x, int y)> const& colorAt);
+  void setLayout(Layout layout);
+  void setFormat(Format format);
 
   // Get
-  bool isNull() const { return this->image_.isNull(); }
-  int width() const { return this->image_.width(); }
-  int height() const { return this->image_.height(); }
-  Color pixel(int x, int y) const {
-    QColor const c = image_.pixel(x,y);
-    return Color(c.redF(), c.greenF(), c.blueF());
-  }
+  bool isNull() const { return !this->image_; }
+  int width() const { return this->image_ ? this->image_->levels[0].width : 0; }
+  int height() const { return this->image_ ? this->image_->levels[0].height : 0; }
+  int levelCount() const { return this->image_ ? this->image_->levels.size() : 0; }
+  WrapMode wrapMode() const { return this->wrapMode_; }
+  Layout layout() const { return this->image_ ? this->image_->levels[0].layout : SCANLINE; }
+  Format format() const { return this->image_ ? this->image_->levels[0].format : RGBA8; }
+  bool isLazy() const { return this->image_ && this->image_->cacheFile >= 0; }
+  int cacheFile() const { return this->image_ ? this->image_->cacheFile : -1; }
+  std::size_t memoryUsage() const;
+  uint32_t texel(int x, int y, int level = 0) const;
+  Color pixel(int x, int y) const;
 
   // Set
-  void setPixelAt(int x, int y, Color const& color) {
-    Color const c = clamped(color);
-    image_.setPixel(x, y, QColor(c.r*255, c.g*255, c.b*255).rgb());
+  void setWrapMode(WrapMode wrapMode) { this->wrapMode_ = wrapMode; }
+  void setPixelAt(int x, int y, Color const& color, float alpha = 1.0f) {
+    assert(!this->isLazy() && this->format() == RGBA8);
+    this->detach();
+    // Rendered texels are opaque, the alpha channel is only used for data
+    Level & level = this->image_->levels[0];
+    level.data[level.index(x,y)] =
+        packTexel(_mm_blend_ps(clamped(color).mmvalue, _mm_set1_ps(alpha), 0x8));
   }
 
   // Color functions
   Color color(float u, float v) const;
   Color color(Vector2d const& surfacePosition) const;
+  // Trilinear lookup in the mipmap pyramid, either at a given level or at the
+  // level matching the uv footprint of a pixel (see Primitive::uvDerivatives)
+  Color color(float u, float v, float level) const;
+  Color color(Vector2d const& surfacePosition,
+              Vector2d const& uvDx, Vector2d const& uvDy) const;
+  // Same lookup, but with all four channels (e.g. for packed material maps)
+  __m128 rgba(Vector2d const& surfacePosition,
+              Vector2d const& uvDx, Vector2d const& uvDy) const;
+
+  // Texel conversion (8-bit RGBA in memory order <-> float RGBA in [0,1])
+  static __m128 unpackTexel(uint32_t texel) {
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(texel))),
+                      _mm_set1_ps(1.0f/255.0f));
+  }
+  static uint32_t packTexel(__m128 rgba) {
+    __m128i const value = _mm_cvtps_epi32(_mm_mul_ps(rgba, _mm_set1_ps(255.0f)));
+    return _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(value, value), value));
+  }
+  // Removes the alpha channel from a texel so it can be used as a Color
+  static __m128 colorMask() {
+    return _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  }
 
 private:
-  QImage image_;
+  // Texel storage in 32-bit words, cache line aligned. Block compressed
+  // formats always store their 4x4 blocks like the tiled layout.
+  struct Level {
+    int width, height;
+    int tilesPerRow; // tiles or blocks of 4x4 texels
+    Layout layout;
+    Format format;
+    std::vector<uint32_t, AlignedAllocator<uint32_t> > data;
+
+    void allocate(int width, int height, Layout layout, Format format);
+    // Position of a texel, in texels (RGBA8, HALF)
+    int index(int x, int y) const {
+      if (this->layout == SCANLINE)
+        return y*this->width + x;
+      return (((y >> 2)*this->tilesPerRow + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+    }
+    // Position of the 4x4 block containing a texel, in blocks (BC1, BC5)
+    int block(int x, int y) const { return (y >> 2)*this->tilesPerRow + (x >> 2); }
+    // Decoded RGBA of a texel in [0,1] (or beyond for HALF)
+    __m128 fetch(int x, int y) const;
+    // Encode a 4x4 block of texels, parts outside of the level are ignored
+    void store(int blockX, int blockY, __m128 const texels[16]);
+    // Encode the whole level from a function returning the texel at (x,y)
+    template <typename Function>
+    void fill(Function const& texelAt);
+  };
+  // The mipmap pyramid, levels[0] is the full resolution image. Lazily
+  // loaded images only know the sizes of their levels, the texels are kept
+  // by the TextureCache.
+  struct Image {
+    int cacheFile; // handle in the TextureCache, or -1 if resident
+    std::vector<Level> levels;
+  };
+
+  // Give the texture its own copy of shared texels before changing them
+  void detach() {
+    if (this->image_.use_count() > 1)
+      this->image_ = std::make_shared<Image>(*this->image_);
+  }
+  bool loadPFM(char const* fileName);
+  void convert(Layout layout, Format format);
+
+  __m128 bilinear(int level, float u, float v) const;
+  __m128 trilinear(float u, float v, float level) const;
+
+  std::shared_ptr<Image> image_;
+  WrapMode wrapMode_;
 
 };
 
@@ -0,0 +1,277 @@
+#include "common/texturecache.h"
+#include "common/texture.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+// Layout of the tiled file:
+// header   "TTX1", width, height, level count, tile size (int32 each)
+// levels   width, height, tiles per row, tiles per column (int32 each),
+//          offset of the first tile (int64)
+// tiles    level by level, row by row, tileSize*tileSize texels each
+static char const magic[4] = { 'T', 'T', 'X', '1' };
+
+// Size of the per-thread lookup caches (must be a power of two)
+static int const threadCacheSize = 256;
+
+// Key of a tile: file (16 bit) | level (6 bit) | tile row (21 bit) | tile column (21 bit)
+static inline uint64_t tileKey(int file, int level, int tileX, int tileY) {
+  return (static_cast<uint64_t>(file) << 48) | (static_cast<uint64_t>(level) << 42)
+      | (static_cast<uint64_t>(tileY) << 21) | static_cast<uint64_t>(tileX);
+}
+
+// The per-thread lookup cache, a direct mapped table of recently used tiles
+struct ThreadCache {
+  uint64_t keys[threadCacheSize];
+  std::shared_ptr<TextureCache::Tile const> tiles[threadCacheSize];
+
+  ThreadCache() { std::fill(keys, keys+threadCacheSize, ~static_cast<uint64_t>(0)); }
+};
+static thread_local ThreadCache threadCache;
+
+TextureCache & TextureCache::instance() {
+  static TextureCache cache;
+  return cache;
+}
+
+TextureCache::TextureCache()
+  : files_(maximumFiles), fileCount_(0),
+    memoryBudget_(static_cast<std::size_t>(512) << 20), memoryUsage_(0),
+    loads_(0), evictions_(0) {}
+
+TextureCache::~TextureCache() {
+  for (int i = 0; i < this->fileCount_; ++i)
+    fclose(this->files_[i]->handle);
+}
+
+std::size_t TextureCache::memoryUsage() const {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  return this->memoryUsage_;
+}
+
+void TextureCache::setMemoryBudget(std::size_t bytes) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->memoryBudget_ = bytes;
+}
+
+int TextureCache::open(char const* fileName) {
+  // Convert the image if there is no tiled file or if it is outdated
+  std::string const tiledFileName = std::string(fileName) + ".tiles";
+  struct stat imageStatus, tiledStatus;
+  bool const hasImage = stat(fileName, &imageStatus) == 0;
+  bool const hasTiles = stat(tiledFileName.c_str(), &tiledStatus) == 0;
+  if (!hasTiles || (hasImage && imageStatus.st_mtime > tiledStatus.st_mtime)) {
+    if (!this->convert(fileName, tiledFileName.c_str()))
+      return -1;
+  }
+  return this->openTiled(tiledFileName);
+}
+
+int TextureCache::openDerived(std::string const& tiledFileName, std::vector<int> const& sources,
+                              int width, int height, TexelFunction const& texelAt) {
+  // Write the tiled file if there is none or if one of the sources is newer
+  struct stat tiledStatus;
+  bool outdated = stat(tiledFileName.c_str(), &tiledStatus) != 0;
+  for (unsigned int i = 0; i < sources.size() && !outdated; ++i) {
+    struct stat sourceStatus;
+    outdated = stat(this->fileName(sources[i]).c_str(), &sourceStatus) != 0
+        || sourceStatus.st_mtime > tiledStatus.st_mtime;
+  }
+  if (outdated) {
+    // Same pyramid as Texture::generateMipmaps
+    int levelCount = 1;
+    while ((width >> (levelCount-1)) > 1 || (height >> (levelCount-1)) > 1)
+      ++levelCount;
+    if (!this->writeTiles(tiledFileName.c_str(), width, height, levelCount, texelAt))
+      return -1;
+    printf("(TextureCache): %s written\n", tiledFileName.c_str());
+  }
+  return this->openTiled(tiledFileName);
+}
+
+int TextureCache::openTiled(std::string const& tiledFileName) {
+  // Read the header
+  std::unique_ptr<File> file(new File);
+  file->name = tiledFileName;
+  file->handle = fopen(tiledFileName.c_str(), "rb");
+  if (!file->handle) {
+    printf("(TextureCache): Could not open tiled file: %s\n", tiledFileName.c_str());
+    return -1;
+  }
+  char fileMagic[4];
+  int32_t header[4];
+  if (fread(fileMagic, 1, 4, file->handle) != 4 || std::memcmp(fileMagic, magic, 4) != 0
+      || fread(header, sizeof(int32_t), 4, file->handle) != 4 || header[3] != tileSize) {
+    printf("(TextureCache): Invalid tiled file: %s\n", tiledFileName.c_str());
+    fclose(file->handle);
+    return -1;
+  }
+  file->levels.resize(header[2]);
+  for (unsigned int i = 0; i < file->levels.size(); ++i) {
+    int32_t size[4];
+    int64_t offset;
+    if (fread(size, sizeof(int32_t), 4, file->handle) != 4
+        || fread(&offset, sizeof(int64_t), 1, file->handle) != 1) {
+      printf("(TextureCache): Invalid tiled file: %s\n", tiledFileName.c_str());
+      fclose(file->handle);
+      return -1;
+    }
+    file->levels[i] = { size[0], size[1], size[2], size[3], static_cast<long>(offset) };
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  if (this->fileCount_ == maximumFiles) {
+    printf("(TextureCache): Too many open files for: %s\n", tiledFileName.c_str());
+    fclose(file->handle);
+    return -1;
+  }
+  this->files_[this->fileCount_] = std::move(file);
+  printf("(TextureCache): %s opened (%dx%d, %d levels)\n", tiledFileName.c_str(), header[0], header[1], header[2]);
+  return this->fileCount_++;
+}
+
+uint32_t TextureCache::texel(int file, int level, int x, int y) {
+  std::shared_ptr<Tile const> const& tile = this->tile(file, level, x / tileSize, y / tileSize);
+  return (*tile)[(y % tileSize)*tileSize + (x % tileSize)];
+}
+
+std::shared_ptr<TextureCache::Tile const> const& TextureCache::tile(int file, int level, int tileX, int tileY) {
+  // Look into the cache of this thread first...
+  uint64_t const key = tileKey(file, level, tileX, tileY);
+  int const slot = (key * 0x9E3779B97F4A7C15ull) >> 56 & (threadCacheSize-1);
+  if (threadCache.keys[slot] == key)
+    return threadCache.tiles[slot];
+
+  // ... then into the shared cache ...
+  std::shared_ptr<Tile const> tile;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto const entry = this->index_.find(key);
+    if (entry != this->index_.end()) {
+      this->entries_.splice(this->entries_.begin(), this->entries_, entry->second);
+      tile = entry->second->tile;
+    }
+  }
+
+  // ... and read the tile from disk if all else fails
+  if (!tile) {
+    tile = this->readTile(file, level, tileX, tileY);
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto const entry = this->index_.find(key);
+    if (entry != this->index_.end()) {
+      // Another thread was faster
+      tile = entry->second->tile;
+    } else {
+      this->entries_.push_front({key, tile});
+      this->index_[key] = this->entries_.begin();
+      this->memoryUsage_ += tile->size()*sizeof(uint32_t);
+      ++this->loads_;
+
+      // Evict the least recently used tiles. Threads that still hold an
+      // evicted tile in their lookup cache keep it alive until they replace it.
+      while (this->memoryUsage_ > this->memoryBudget_ && this->entries_.size() > 1) {
+        Entry const& last = this->entries_.back();
+        this->memoryUsage_ -= last.tile->size()*sizeof(uint32_t);
+        this->index_.erase(last.key);
+        this->entries_.pop_back();
+        ++this->evictions_;
+      }
+    }
+  }
+
+  threadCache.keys[slot] = key;
+  threadCache.tiles[slot] = tile;
+  return threadCache.tiles[slot];
+}
+
+std::shared_ptr<TextureCache::Tile const> TextureCache::readTile(int fileIndex, int level, int tileX, int tileY) {
+  File & file = *this->files_[fileIndex];
+  Level const& size = file.levels[level];
+  long const tileBytes = tileSize*tileSize*sizeof(uint32_t);
+
+  std::shared_ptr<Tile> tile = std::make_shared<Tile>(tileSize*tileSize);
+  std::lock_guard<std::mutex> lock(file.mutex);
+  fseek(file.handle, size.offset + (tileY*size.tilesPerRow + tileX)*tileBytes, SEEK_SET);
+  if (fread(tile->data(), tileBytes, 1, file.handle) != 1)
+    printf("(TextureCache): Could not read tile from: %s\n", file.name.c_str());
+  return tile;
+}
+
+bool TextureCache::convert(char const* fileName, char const* tiledFileName) {
+  // Decode the image with its mipmaps once
+  Texture const image(fileName);
+  if (image.isNull())
+    return false;
+  // The tiles keep 8-bit texels, which would clamp HDR images
+  if (image.format() == Texture::HALF) {
+    printf("(TextureCache): HDR images are not cached: %s\n", fileName);
+    return false;
+  }
+
+  if (!this->writeTiles(tiledFileName, image.width(), image.height(), image.levelCount(),
+                        [&](int level, int x, int y) { return image.texel(x, y, level); }))
+    return false;
+  printf("(TextureCache): %s converted to %s\n", fileName, tiledFileName);
+  return true;
+}
+
+bool TextureCache::writeTiles(char const* tiledFileName, int width, int height, int levelCount,
+                              TexelFunction const& texelAt) {
+  // Write a new file and replace the old one with it, so an interrupted
+  // conversion never leaves a truncated tiled file behind
+  std::string const temporaryFileName = std::string(tiledFileName) + ".tmp";
+  FILE * file = fopen(temporaryFileName.c_str(), "wb");
+  if (!file) {
+    printf("(TextureCache): Could not write tiled file: %s\n", temporaryFileName.c_str());
+    return false;
+  }
+
+  // Header and level table
+  int32_t const header[4] = { width, height, levelCount, tileSize };
+  bool success = fwrite(magic, 1, 4, file) == 4
+      && fwrite(header, sizeof(int32_t), 4, file) == 4;
+  int64_t offset = 4 + sizeof(header) + levelCount*(4*sizeof(int32_t) + sizeof(int64_t));
+  for (int level = 0; level < levelCount && success; ++level) {
+    int32_t const levelWidth = std::max(width >> level, 1);
+    int32_t const levelHeight = std::max(height >> level, 1);
+    int32_t const size[4] = { levelWidth, levelHeight, (levelWidth+tileSize-1)/tileSize, (levelHeight+tileSize-1)/tileSize };
+    success = fwrite(size, sizeof(int32_t), 4, file) == 4
+        && fwrite(&offset, sizeof(int64_t), 1, file) == 1;
+    offset += static_cast<int64_t>(size[2])*size[3]*tileSize*tileSize*sizeof(uint32_t);
+  }
+
+  // Tiles, partial tiles at the border repeat the last row and column
+  Tile tile(tileSize*tileSize);
+  for (int level = 0; level < levelCount && success; ++level) {
+    int const levelWidth = std::max(width >> level, 1);
+    int const levelHeight = std::max(height >> level, 1);
+    for (int tileY = 0; tileY < levelHeight && success; tileY += tileSize) {
+      for (int tileX = 0; tileX < levelWidth && success; tileX += tileSize) {
+        #pragma omp parallel for
+        for (int y = 0; y < tileSize; ++y)
+          for (int x = 0; x < tileSize; ++x)
+            tile[y*tileSize + x] = texelAt(level, std::min(tileX+x, levelWidth-1),
+                                           std::min(tileY+y, levelHeight-1));
+        success = fwrite(tile.data(), sizeof(uint32_t), tile.size(), file) == tile.size();
+      }
+    }
+  }
+  success &= fclose(file) == 0;
+  success = success && std::rename(temporaryFileName.c_str(), tiledFileName) == 0;
+
+  if (!success) {
+    std::remove(temporaryFileName.c_str());
+    printf("(TextureCache): Could not write tiled file: %s\n", tiledFileName);
+    return false;
+  }
+  return true;
+}
+
+void TextureCache::printStatistics() const {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  printf("(TextureCache): %zu tiles loaded, %zu evicted, %zu of %zu MiB in use\n",
+         this->loads_, this->evictions_, this->memoryUsage_ >> 20, this->memoryBudget_ >> 20);
+}
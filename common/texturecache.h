@@ -0,0 +1,110 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/alignedallocator.h"
+
+// Shared cache for textures that are too large (or too many) to keep them
+// resident. Every image is converted once into a tiled mipmap pyramid on
+// disk (next to the image, with the suffix ".tiles"). Tiles are read on
+// their first access and evicted in LRU order once the memory budget is
+// exceeded. Each thread keeps a small lookup cache of the tiles it used last,
+// so most lookups never touch the shared state.
+// Note: HDR images (e.g. .pfm) are not cached, see Texture::LAZY.
+class TextureCache {
+
+public:
+  // Tiles are square blocks of 8-bit RGBA texels in scanline order
+  static int const tileSize = 64;
+  typedef std::vector<uint32_t, AlignedAllocator<uint32_t> > Tile;
+  // Texel of a level at (x,y), called from several threads at once
+  typedef std::function<uint32_t(int level, int x, int y)> TexelFunction;
+
+  // Size of a single mipmap level
+  struct Level {
+    int width, height;
+    int tilesPerRow, tilesPerColumn;
+    long offset; // position of the first tile in the file
+  };
+
+  // The shared instance
+  static TextureCache & instance();
+
+  // Get
+  std::size_t memoryBudget() const { return this->memoryBudget_; }
+  std::size_t memoryUsage() const;
+  std::vector<Level> const& levels(int file) const { return this->files_[file]->levels; }
+  std::string const& fileName(int file) const { return this->files_[file]->name; }
+
+  // Set
+  void setMemoryBudget(std::size_t bytes);
+
+  // Opens an image file and returns its handle, or -1 if it cannot be read.
+  // Only the header of the tiled file is read, the texels are loaded lazily.
+  int open(char const* fileName);
+  // Opens a tiled file of texels derived from other cached files (e.g.
+  // packed material maps). The file is written first from the texel function
+  // if it is missing or older than one of the sources.
+  int openDerived(std::string const& tiledFileName, std::vector<int> const& sources,
+                  int width, int height, TexelFunction const& texelAt);
+
+  // Texel access (8-bit RGBA in memory order)
+  uint32_t texel(int file, int level, int x, int y);
+
+  // Statistics
+  void printStatistics() const;
+
+private:
+  // Constructor / Destructor
+  TextureCache();
+  ~TextureCache();
+  TextureCache(TextureCache const&) = delete;
+  TextureCache & operator=(TextureCache const&) = delete;
+
+  struct File {
+    std::string name;
+    FILE * handle;
+    std::mutex mutex; // serializes reads from the handle
+    std::vector<Level> levels;
+  };
+  struct Entry {
+    uint64_t key;
+    std::shared_ptr<Tile const> tile;
+  };
+
+  int openTiled(std::string const& tiledFileName);
+  bool convert(char const* fileName, char const* tiledFileName);
+  bool writeTiles(char const* tiledFileName, int width, int height, int levelCount,
+                  TexelFunction const& texelAt);
+  std::shared_ptr<Tile const> const& tile(int file, int level, int tileX, int tileY);
+  std::shared_ptr<Tile const> readTile(int file, int level, int tileX, int tileY);
+
+  // Registered files, the handle of a file is its index. The table never
+  // grows, so threads rendering with open files can look them up without
+  // the lock while another file is opened.
+  static int const maximumFiles = 1 << 16; // see the tile keys
+  std::vector<std::unique_ptr<File> > files_;
+  int fileCount_;
+
+  // LRU list (most recently used first) and its index
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+  std::size_t memoryBudget_;
+  std::size_t memoryUsage_;
+
+  // Statistics
+  std::size_t loads_, evictions_;
+
+};
+
+#endif // TEXTURECACHE_H
@@ -0,0 +1,100 @@
+#include "common/tilescheduler.h"
+#include "common/progressbar.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+
+// Interleave the bits of x and y (x in the even bits)
+static inline uint32_t mortonCode(uint32_t x, uint32_t y) {
+  uint32_t code = 0;
+  for (int bit = 0; bit < 16; ++bit)
+    code |= ((x >> bit) & 1u) << (2*bit) | ((y >> bit) & 1u) << (2*bit+1);
+  return code;
+}
+
+// The tiles left to a thread, a range of the tile list. The owner takes
+// tiles from the front, thieves from the back.
+struct TileQueue {
+  std::mutex mutex;
+  int begin, end;
+
+  bool pop(int * tile) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->begin >= this->end)
+      return false;
+    *tile = this->begin++;
+    return true;
+  }
+  bool steal(int * tile) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->begin >= this->end)
+      return false;
+    *tile = --this->end;
+    return true;
+  }
+};
+
+TileScheduler::TileScheduler(int width, int height, int tileSize)
+  : width_(width), height_(height), tileSize_(tileSize) {
+  int const tilesPerRow = (width+tileSize-1)/tileSize;
+  int const tilesPerColumn = (height+tileSize-1)/tileSize;
+
+  // Order the tiles along the Morton curve
+  std::vector<std::pair<uint32_t, Tile> > tiles;
+  tiles.reserve(tilesPerRow*tilesPerColumn);
+  for (int ty = 0; ty < tilesPerColumn; ++ty) {
+    for (int tx = 0; tx < tilesPerRow; ++tx) {
+      Tile tile;
+      tile.x0 = tx*tileSize;
+      tile.y0 = ty*tileSize;
+      tile.x1 = std::min(tile.x0+tileSize, width);
+      tile.y1 = std::min(tile.y0+tileSize, height);
+      tiles.push_back(std::make_pair(mortonCode(tx, ty), tile));
+    }
+  }
+  std::sort(tiles.begin(), tiles.end(),
+            [](std::pair<uint32_t, Tile> const& a, std::pair<uint32_t, Tile> const& b) {
+              return a.first < b.first;
+            });
+  this->tiles_.reserve(tiles.size());
+  for (unsigned int i = 0; i < tiles.size(); ++i)
+    this->tiles_.push_back(tiles[i].second);
+}
+
+void TileScheduler::run(std::function<void(Tile const&)> const& renderTile,
+                        ProgressBar * bar) const {
+  int const tileCount = this->tiles_.size();
+  int const threadCount = std::max(std::min(omp_get_max_threads(), tileCount), 1);
+
+  // Deal out contiguous runs of tiles
+  std::unique_ptr<TileQueue[]> queues(new TileQueue[threadCount]);
+  for (int i = 0; i < threadCount; ++i) {
+    queues[i].begin = static_cast<long>(tileCount)*i/threadCount;
+    queues[i].end = static_cast<long>(tileCount)*(i+1)/threadCount;
+  }
+  std::atomic<int> finished(0);
+
+  #pragma omp parallel num_threads(threadCount)
+  {
+    int const thread = omp_get_thread_num();
+    int tile;
+    for (;;) {
+      // Own tiles first, then the other queues starting with the neighbor
+      bool found = queues[thread].pop(&tile);
+      for (int i = 1; !found && i < threadCount; ++i)
+        found = queues[(thread+i) % threadCount].steal(&tile);
+      if (!found)
+        break;
+
+      renderTile(this->tiles_[tile]);
+
+      int const done = ++finished;
+      if (bar && thread == 0)
+        bar->progress(static_cast<float>(done)/tileCount);
+    }
+  }
+}
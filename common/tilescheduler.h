@@ -0,0 +1,45 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <functional>
+#include <vector>
+
+// Forward declarations
+struct ProgressBar;
+
+// Splits an image into square tiles and renders them on all threads in one
+// parallel region. The tiles are ordered along a Morton curve, which keeps
+// the tiles of a thread close together, and dealt out in contiguous runs.
+// A thread that runs out of tiles steals single tiles from the end of the
+// runs of the others, so a few expensive tiles (e.g. a large mirror) do not
+// leave the other threads waiting.
+class TileScheduler {
+
+public:
+  struct Tile {
+    int x0, y0; // first pixel
+    int x1, y1; // one past the last pixel
+  };
+
+  // Constructor
+  TileScheduler(int width, int height, int tileSize = 16);
+
+  // Get
+  int width() const { return this->width_; }
+  int height() const { return this->height_; }
+  int tileSize() const { return this->tileSize_; }
+  std::vector<Tile> const& tiles() const { return this->tiles_; }
+
+  // Calls renderTile once for every tile, from all threads. The progress
+  // bar (if any) is updated by the calling thread.
+  void run(std::function<void(Tile const&)> const& renderTile,
+           ProgressBar * bar = nullptr) const;
+
+private:
+  int width_, height_;
+  int tileSize_;
+  std::vector<Tile> tiles_;
+
+};
+
+#endif // TILESCHEDULER_H
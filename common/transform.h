@@ -0,0 +1,54 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+#include "common/vector3d.h"
+
+// Rigid transformation with a uniform scale: p' = scale*R*p + translation,
+// where R rotates around the x, then the y and then the z axis. Without
+// shearing the inverse is cheap and normals transform like directions.
+class Transform {
+
+public:
+  // Constructor
+  Transform(Vector3d const& translation = Vector3d(),
+            Vector3d const& rotation = Vector3d(), // angles in radians
+            float scale = 1.0f)
+    : translation_(translation), rotation_(rotation), scale_(scale) {
+    float const cx = std::cos(rotation.x), sx = std::sin(rotation.x);
+    float const cy = std::cos(rotation.y), sy = std::sin(rotation.y);
+    float const cz = std::cos(rotation.z), sz = std::sin(rotation.z);
+    this->column_[0] = Vector3d(cy*cz, cy*sz, -sy);
+    this->column_[1] = Vector3d(sx*sy*cz - cx*sz, sx*sy*sz + cx*cz, sx*cy);
+    this->column_[2] = Vector3d(cx*sy*cz + sx*sz, cx*sy*sz - sx*cz, cx*cy);
+  }
+
+  // Get
+  Vector3d translation() const { return this->translation_; }
+  Vector3d rotation() const { return this->rotation_; }
+  float scale() const { return this->scale_; }
+
+  // Transformation functions
+  Vector3d rotate(Vector3d const& v) const {
+    return this->column_[0]*v.x + this->column_[1]*v.y + this->column_[2]*v.z;
+  }
+  Vector3d inverseRotate(Vector3d const& v) const {
+    return Vector3d(dotProduct(this->column_[0], v),
+                    dotProduct(this->column_[1], v),
+                    dotProduct(this->column_[2], v));
+  }
+  Vector3d point(Vector3d const& p) const {
+    return this->rotate(p)*this->scale_ + this->translation_;
+  }
+  Vector3d inversePoint(Vector3d const& p) const {
+    return this->inverseRotate(p - this->translation_)/this->scale_;
+  }
+
+private:
+  Vector3d translation_, rotation_;
+  float scale_;
+  Vector3d column_[3]; // of R
+
+};
+
+#endif // TRANSFORM_H
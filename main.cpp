@@ -23,6 +23,9 @@
 #include "shader/materialshader.h"
 #include "shader/brdfshader.h"
 
+#include "common/imagewriter.h"
+#include "common/texturecache.h"
+
 #include <iostream>
 #include <omp.h>
 
@@ -33,7 +36,7 @@ int main() {
 
   // Set up the scene
   SimpleScene scene;
-  scene.setEnvironmentMap(Texture("data/sky_stars_night_bg.jpg"));
+  scene.setEnvironmentMap(EnvironmentMap(Texture("data/sky_stars_night_bg.jpg"), EnvironmentMap::CUBE));
   scene.setBackgroundColor(Color(0,0,0));
 
   // Set up the camera
@@ -64,13 +67,16 @@ int main() {
   scene.add(toonYellow);
 
   // Set up terrain
-  Texture mountainDiffuse("data/mountain/color.tif");
-  Texture mountainNormal("data/mountain/normal.tif");
+  // The terrain maps are large, their tiles are only read when rays hit them
+  TextureCache::instance().setMemoryBudget(256 << 20);
+  Texture mountainDiffuse("data/mountain/color.tif", Texture::LAZY);
+  Texture mountainNormal("data/mountain/normal.tif", Texture::LAZY);
   MaterialShader * mountainShader = new MaterialShader();
   mountainShader->setDiffuseMap(mountainDiffuse);
   mountainShader->setDiffuseCoefficient(0.7f);
   mountainShader->setNormalMap(mountainNormal);
   mountainShader->setNormalCoefficient(0.8f);
+  mountainShader->compile();
   scene.add(mountainShader);
 
   ObjModel * mountain = new ObjModel(mountainShader);
@@ -120,8 +126,11 @@ int main() {
   renderer.setApertureRays(100);
   renderer.setFocalDistance(100);*/
 
-  // ... and render an image
-  renderer.renderImage(scene, camera, 1000, 1000).save("result.png");
+  // ... and render an image, which is written in the background
+  ImageWriter writer;
+  writer.save(renderer.renderImage(scene, camera, 1000, 1000), "result.png");
+  writer.save(renderer.sampleCountMap(), "samples.png");
+  TextureCache::instance().printStatistics();
 
   return 0;
 }
@@ -0,0 +1,75 @@
+#include "primitive/dynamicmesh.h"
+#include "primitive/triangle.h"
+#include "common/bvh.h"
+
+#include <cassert>
+
+
+// Constructor / Destructor ////////////////////////////////////////////////////
+
+DynamicMesh::DynamicMesh(std::vector<Vector3d> const& vertices, std::vector<int> const& indices,
+                         Shader * shader)
+  : Primitive(shader), vertices_(vertices), indices_(indices) {
+  for (unsigned int i = 0; i+2 < indices.size(); i += 3)
+    this->triangles_.push_back(new Triangle(vertices[indices[i]], vertices[indices[i+1]],
+                                            vertices[indices[i+2]], shader));
+  this->bvh_ = new Bvh(this->triangles_);
+  this->updateBounds();
+}
+
+DynamicMesh::~DynamicMesh() {
+  delete this->bvh_;
+  for (unsigned int i = 0; i < this->triangles_.size(); ++i)
+    delete this->triangles_[i];
+}
+
+void DynamicMesh::setVertices(std::vector<Vector3d> const& vertices) {
+  assert(vertices.size() == this->vertices_.size());
+  this->vertices_ = vertices;
+  int const triangleCount = this->triangles_.size();
+  #pragma omp parallel for schedule(static)
+  for (int t = 0; t < triangleCount; ++t) {
+    Triangle * triangle = static_cast<Triangle*>(this->triangles_[t]);
+    for (int k = 0; k < 3; ++k)
+      triangle->setVertex(k, vertices[this->indices_[3*t+k]]);
+  }
+  this->bvh_->refit();
+  this->updateBounds();
+}
+
+void DynamicMesh::updateBounds() {
+  this->minimumBounds_ = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+  this->maximumBounds_ = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+  for (unsigned int i = 0; i < this->vertices_.size(); ++i) {
+    this->minimumBounds_ = minimum(this->minimumBounds_, this->vertices_[i]);
+    this->maximumBounds_ = maximum(this->maximumBounds_, this->vertices_[i]);
+  }
+}
+
+
+// Primitive functions /////////////////////////////////////////////////////////
+
+bool DynamicMesh::intersect(Ray * ray) const {
+  return this->bvh_->intersect(ray);
+}
+
+RayPacket::Mask DynamicMesh::intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+  return this->bvh_->intersectPacket(packet, active);
+}
+
+Vector3d DynamicMesh::normalFromRay(Ray const& ray) const {
+  // Never called, the rays hit the individual triangles
+  (void)ray; // unused
+  return Vector3d(0,0,0);
+}
+
+
+// Bounding box ////////////////////////////////////////////////////////////////
+
+float DynamicMesh::minimumBounds(int dimension) const {
+  return this->minimumBounds_[dimension];
+}
+
+float DynamicMesh::maximumBounds(int dimension) const {
+  return this->maximumBounds_[dimension];
+}
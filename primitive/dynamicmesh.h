@@ -0,0 +1,50 @@
+#ifndef DYNAMICMESH_H
+#define DYNAMICMESH_H
+
+#include <vector>
+#include "primitive/primitive.h"
+
+// Forward declarations
+class Bvh;
+
+// Triangle mesh whose vertices may move every frame (e.g. a simulated cloth
+// or a skinned character). The triangles are kept in a Bvh, which is
+// refitted after the vertices moved instead of being built again.
+class DynamicMesh : public Primitive {
+
+public:
+  // Constructor / Destructor
+  // Three vertex indices per triangle
+  DynamicMesh(std::vector<Vector3d> const& vertices, std::vector<int> const& indices,
+              Shader * shader = nullptr);
+  virtual ~DynamicMesh();
+
+  // Get
+  std::vector<Vector3d> const& vertices() const { return this->vertices_; }
+  Bvh const& bvh() const { return *this->bvh_; }
+
+  // Set
+  // Move all vertices, the triangles stay the same
+  void setVertices(std::vector<Vector3d> const& vertices);
+
+  // Primitive functions
+  virtual bool intersect(Ray * ray) const;
+  virtual RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const;
+  virtual Vector3d normalFromRay(Ray const& ray) const;
+
+  // Bounding box
+  virtual float minimumBounds(int dimension) const;
+  virtual float maximumBounds(int dimension) const;
+
+private:
+  void updateBounds();
+
+  std::vector<Vector3d> vertices_;
+  std::vector<int> indices_;
+  std::vector<Primitive*> triangles_;
+  Bvh * bvh_;
+  Vector3d minimumBounds_, maximumBounds_;
+
+};
+
+#endif
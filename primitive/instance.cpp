@@ -0,0 +1,96 @@
+#include "primitive/instance.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+// Constructor /////////////////////////////////////////////////////////////////
+
+Instance::Instance(Primitive * primitive, Transform const& transform)
+  : Primitive(primitive->shader()), primitive_(primitive) {
+  this->setTransform(transform);
+}
+
+void Instance::setTransform(Transform const& transform) {
+  this->transform_ = transform;
+
+  // Bounds of the transformed corners, unbounded primitives stay unbounded
+  BoundingBox const bounds = this->primitive_->boundingBox();
+  Vector3d const extent = bounds.maximumCorner - bounds.minimumCorner;
+  if (!std::isfinite(extent.x) || !std::isfinite(extent.y) || !std::isfinite(extent.z)) {
+    this->minimumBounds_ = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+    this->maximumBounds_ = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+    return;
+  }
+  this->minimumBounds_ = Vector3d(+INFINITY, +INFINITY, +INFINITY);
+  this->maximumBounds_ = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+  for (int corner = 0; corner < 8; ++corner) {
+    Vector3d const point((corner & 1) ? bounds.maximumCorner.x : bounds.minimumCorner.x,
+                         (corner & 2) ? bounds.maximumCorner.y : bounds.minimumCorner.y,
+                         (corner & 4) ? bounds.maximumCorner.z : bounds.minimumCorner.z);
+    Vector3d const transformed = transform.point(point);
+    this->minimumBounds_ = minimum(this->minimumBounds_, transformed);
+    this->maximumBounds_ = maximum(this->maximumBounds_, transformed);
+  }
+}
+
+// Primitive functions /////////////////////////////////////////////////////////
+
+Ray Instance::objectRay(Ray const& ray) const {
+  // Directions stay normalized, so lengths only change with the scale
+  Ray result = ray;
+  result.origin = this->transform_.inversePoint(ray.origin);
+  result.direction = this->transform_.inverseRotate(ray.direction);
+  result.length = ray.length/this->transform_.scale();
+  result.primitive = ray.instancedPrimitive;
+  result.instancedPrimitive = nullptr;
+  result.hasDifferentials = false;
+  return result;
+}
+
+bool Instance::intersect(Ray * ray) const {
+  Ray localRay = this->objectRay(*ray);
+  localRay.primitive = nullptr;
+  if (!this->primitive_->intersect(&localRay))
+    return false;
+
+  // The instance is the primitive hit in the scene, it remembers the one
+  // inside for the normal and the uv coordinates
+  ray->length = localRay.length*this->transform_.scale();
+  ray->primitive = this;
+  ray->instancedPrimitive = localRay.primitive;
+  ray->surfacePosition = localRay.surfacePosition;
+  return true;
+}
+
+Vector3d Instance::normalFromRay(Ray const& ray) const {
+  Ray const localRay = this->objectRay(ray);
+  return this->transform_.rotate(localRay.primitive->normalFromRay(localRay));
+}
+
+Vector2d Instance::uvFromRay(Ray const& ray) const {
+  Ray const localRay = this->objectRay(ray);
+  return localRay.primitive->uvFromRay(localRay);
+}
+
+void Instance::uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const {
+  Ray const localRay = this->objectRay(ray);
+  float const inverseScale = 1.0f/this->transform_.scale();
+  localRay.primitive->uvDerivatives(localRay,
+                                    this->transform_.inverseRotate(positionDx)*inverseScale,
+                                    this->transform_.inverseRotate(positionDy)*inverseScale,
+                                    uvDx, uvDy);
+}
+
+
+// Bounding box ////////////////////////////////////////////////////////////////
+
+float Instance::minimumBounds(int dimension) const {
+  return this->minimumBounds_[dimension];
+}
+
+float Instance::maximumBounds(int dimension) const {
+  return this->maximumBounds_[dimension];
+}
@@ -0,0 +1,48 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "common/transform.h"
+#include "primitive/primitive.h"
+
+// Places a primitive (e.g. an ObjModel with its kd-tree) in the scene with a
+// transformation. The rays are transformed into the space of the primitive
+// instead, so moving an instance never rebuilds the acceleration structure
+// inside, and one primitive can be shown by several instances.
+// Note: The instance does not own the primitive, which must outlive it, and
+// instances of instances are not supported.
+class Instance : public Primitive {
+
+public:
+  // Constructor
+  Instance(Primitive * primitive, Transform const& transform = Transform());
+
+  // Get
+  Primitive * primitive() const { return this->primitive_; }
+  Transform const& transform() const { return this->transform_; }
+
+  // Set
+  void setTransform(Transform const& transform);
+
+  // Primitive functions
+  virtual bool intersect(Ray * ray) const;
+  virtual Vector3d normalFromRay(Ray const& ray) const;
+  virtual Vector2d uvFromRay(Ray const& ray) const;
+  virtual void uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const;
+
+  // Bounding box
+  virtual float minimumBounds(int dimension) const;
+  virtual float maximumBounds(int dimension) const;
+
+private:
+  // The ray in the space of the primitive, with the same hit
+  Ray objectRay(Ray const& ray) const;
+
+  Primitive * primitive_;
+  Transform transform_;
+  Vector3d minimumBounds_, maximumBounds_;
+
+};
+
+#endif
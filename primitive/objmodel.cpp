@@ -190,6 +190,10 @@ bool ObjModel::intersect(Ray * ray) const {
   return this->tree->intersect(ray);
 }
 
+RayPacket::Mask ObjModel::intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+  return this->tree->intersectPacket(packet, active);
+}
+
 Vector3d ObjModel::normalFromRay(Ray const& ray) const {
   // This function should never be called as all requests should go
   // to the individual triangles in the mesh.
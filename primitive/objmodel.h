@@ -34,6 +34,7 @@ public:
 
   // Primitive functions
   virtual bool intersect(Ray * ray) const;
+  virtual RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const;
   virtual Vector3d normalFromRay(Ray const& ray) const;
 
   // Bounding box
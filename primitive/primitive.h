@@ -3,6 +3,7 @@
 
 #include "common/boundingbox.h"
 #include "common/ray.h"
+#include "common/raypacket.h"
 #include "shader/shader.h"
 
 class Primitive {
@@ -20,13 +21,36 @@ public:
 
   // Primitive functions
   virtual bool intersect(Ray * ray) const = 0;
+  // Intersect the active rays of a packet and return the ones that hit, the
+  // default implementation tests the rays one by one
+  virtual RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+    RayPacket::Mask hits = 0;
+    for (int i = 0; i < RayPacket::size; ++i) {
+      if ((active >> i & 1) && this->intersect(&packet->rays[i])) {
+        packet->length[i] = packet->rays[i].length;
+        hits |= RayPacket::Mask(1) << i;
+      }
+    }
+    return hits;
+  }
   virtual Vector3d normalFromRay(Ray const& ray) const = 0;
   virtual Vector2d uvFromRay(Ray const& ray) const { return ray.surfacePosition; }
+  // Change of the uv coordinates for the given offsets on the surface,
+  // primitives without a parametrization report no change
+  virtual void uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const {
+    (void)ray; (void)positionDx; (void)positionDy; // unused in the default implementation
+    *uvDx = Vector2d();
+    *uvDy = Vector2d();
+  }
 
   // Bounding box
   virtual float minimumBounds(int dimension) const = 0;
   virtual float maximumBounds(int dimension) const = 0;
-  BoundingBox boundingBox() const {
+  // All bounds at once, primitives that get them cheaper than with six
+  // calls may override it (the Bvh asks for them on every refit)
+  virtual BoundingBox boundingBox() const {
     return BoundingBox(Vector3d(this->minimumBounds(Vector3d::X),
                                 this->minimumBounds(Vector3d::Y),
                                 this->minimumBounds(Vector3d::Z)),
@@ -21,3 +21,15 @@ Vector2d TexturedTriangle::uvFromRay(Ray const& ray) const {
       + ray.surfacePosition.v * textureCoordinates_[2]
       + (1.0f - ray.surfacePosition.u - ray.surfacePosition.v) * textureCoordinates_[0];
 }
+
+void TexturedTriangle::uvDerivatives(Ray const& ray,
+                                     Vector3d const& positionDx, Vector3d const& positionDy,
+                                     Vector2d * uvDx, Vector2d * uvDy) const {
+  (void)ray; // ray is unused in this case, but we do not want a warning.
+  Vector2d const barycentricDx = this->barycentricOffset(positionDx);
+  Vector2d const barycentricDy = this->barycentricOffset(positionDy);
+  Vector2d const edge1 = textureCoordinates_[1] - textureCoordinates_[0];
+  Vector2d const edge2 = textureCoordinates_[2] - textureCoordinates_[0];
+  *uvDx = barycentricDx.u * edge1 + barycentricDx.v * edge2;
+  *uvDy = barycentricDy.u * edge1 + barycentricDy.v * edge2;
+}
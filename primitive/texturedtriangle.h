@@ -20,6 +20,9 @@ public:
 
   // Primitive functions
   virtual Vector2d uvFromRay(Ray const& ray) const;
+  virtual void uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const;
 
 protected:
   Vector2d textureCoordinates_[3];
@@ -55,6 +55,77 @@ bool Triangle::intersect(Ray * ray) const {
   return true;
 }
 
+RayPacket::Mask Triangle::intersectPacket(RayPacket * packet, RayPacket::Mask active) const {
+  // Same test as above, for four rays at a time. The triangle data is
+  // fetched once for the whole packet.
+  Vector3d const edge1 = this->vertex_[1] - this->vertex_[0];
+  Vector3d const edge2 = this->vertex_[2] - this->vertex_[0];
+  __m128 const e1x = _mm_set1_ps(edge1.x), e1y = _mm_set1_ps(edge1.y), e1z = _mm_set1_ps(edge1.z);
+  __m128 const e2x = _mm_set1_ps(edge2.x), e2y = _mm_set1_ps(edge2.y), e2z = _mm_set1_ps(edge2.z);
+  __m128 const v0x = _mm_set1_ps(this->vertex_[0].x);
+  __m128 const v0y = _mm_set1_ps(this->vertex_[0].y);
+  __m128 const v0z = _mm_set1_ps(this->vertex_[0].z);
+  __m128 const zero = _mm_setzero_ps();
+  __m128 const one = _mm_set1_ps(1.0f);
+  __m128 const epsilon = _mm_set1_ps(EPSILON);
+  __m128 const signMask = _mm_set1_ps(-0.0f);
+
+  RayPacket::Mask hits = 0;
+  for (int i = 0; i < RayPacket::size; i += 4) {
+    if (!(active >> i & 0xF))
+      continue;
+    __m128 const dx = _mm_load_ps(packet->directionX + i);
+    __m128 const dy = _mm_load_ps(packet->directionY + i);
+    __m128 const dz = _mm_load_ps(packet->directionZ + i);
+
+    // Determinant, rays parallel to the triangle are rejected
+    __m128 const px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 const py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 const pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 const det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 mask = _mm_cmpge_ps(_mm_andnot_ps(signMask, det), epsilon);
+    __m128 const invDet = _mm_div_ps(one, det);
+
+    // Barycentric u
+    __m128 const tx = _mm_sub_ps(_mm_load_ps(packet->originX + i), v0x);
+    __m128 const ty = _mm_sub_ps(_mm_load_ps(packet->originY + i), v0y);
+    __m128 const tz = _mm_sub_ps(_mm_load_ps(packet->originZ + i), v0z);
+    __m128 const u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+    // Barycentric v
+    __m128 const qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 const qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 const qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 const v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+    // Distance, which has to be closer than the current hit
+    __m128 const t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, epsilon), _mm_cmple_ps(t, _mm_load_ps(packet->length + i))));
+
+    int laneHits = _mm_movemask_ps(mask) & (active >> i & 0xF);
+    if (!laneHits)
+      continue;
+
+    // Prepare the rays that hit
+    alignas(16) float tValues[4], uValues[4], vValues[4];
+    _mm_store_ps(tValues, t);
+    _mm_store_ps(uValues, u);
+    _mm_store_ps(vValues, v);
+    hits |= RayPacket::Mask(laneHits) << i;
+    for (; laneHits; laneHits &= laneHits - 1) {
+      int const lane = __builtin_ctz(laneHits);
+      Ray & ray = packet->rays[i + lane];
+      packet->length[i + lane] = tValues[lane];
+      ray.length = tValues[lane];
+      ray.primitive = this;
+      ray.surfacePosition = Vector2d(uValues[lane], vValues[lane]);
+    }
+  }
+  return hits;
+}
+
 Vector3d Triangle::normalFromRay(Ray const& ray) const {
     Vector3d const edge1 = this->vertex_[1] - this->vertex_[0];
      Vector3d const edge2 = this->vertex_[2] - this->vertex_[0];
@@ -63,6 +134,24 @@ Vector3d Triangle::normalFromRay(Ray const& ray) const {
      return (dotProduct(normal, ray.direction) < 0 ? normal : (-1)*normal);
 }
 
+void Triangle::uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const {
+  (void)ray; // ray is unused in this case, but we do not want a warning.
+  *uvDx = this->barycentricOffset(positionDx);
+  *uvDy = this->barycentricOffset(positionDy);
+}
+
+Vector2d Triangle::barycentricOffset(Vector3d const& offset) const {
+  // Solve offset = u*edge1 + v*edge2 within the triangle plane
+  Vector3d const edge1 = this->vertex_[1] - this->vertex_[0];
+  Vector3d const edge2 = this->vertex_[2] - this->vertex_[0];
+  Vector3d const normal = crossProduct(edge1, edge2);
+  float const inverseArea = 1.0f / dotProduct(normal, normal);
+  return Vector2d(dotProduct(crossProduct(offset, edge2), normal) * inverseArea,
+                  dotProduct(crossProduct(edge1, offset), normal) * inverseArea);
+}
+
 
 // Bounding box ////////////////////////////////////////////////////////////////
 
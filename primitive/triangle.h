@@ -18,13 +18,24 @@ public:
 
   // Primitive functions
   virtual bool intersect(Ray * ray) const;
+  virtual RayPacket::Mask intersectPacket(RayPacket * packet, RayPacket::Mask active) const;
   virtual Vector3d normalFromRay(Ray const& ray) const;
+  virtual void uvDerivatives(Ray const& ray,
+                             Vector3d const& positionDx, Vector3d const& positionDy,
+                             Vector2d * uvDx, Vector2d * uvDy) const;
 
   // Bounding box
   virtual float minimumBounds(int dimension) const;
   virtual float maximumBounds(int dimension) const;
+  virtual BoundingBox boundingBox() const {
+    return BoundingBox(minimum(this->vertex_[0], minimum(this->vertex_[1], this->vertex_[2])),
+                       maximum(this->vertex_[0], maximum(this->vertex_[1], this->vertex_[2])));
+  }
 
 protected:
+  // Barycentric coordinates of an offset within the triangle plane
+  Vector2d barycentricOffset(Vector3d const& offset) const;
+
   Vector3d vertex_[3];
 
 };
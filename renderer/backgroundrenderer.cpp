@@ -3,6 +3,7 @@
 #include "camera/camera.h"
 #include "common/benchmark.h"
 #include "common/progressbar.h"
+#include "common/tilescheduler.h"
 
 #include <iostream>
 #include <omp.h>
@@ -20,18 +21,17 @@ Texture BackgroundRenderer::renderImage(Scene const& scene,
   timer.start();
 
   Texture image(width, height);
-  for (int x = 0; x < image.width(); ++x) {
-
-    // Peform for-statement on seperate threads
-    #pragma omp parallel for
-    for (int y = 0; y < image.height(); ++y) {
-      Ray ray = camera.castRay(static_cast<float>(x)/width,
-                               static_cast<float>(y)/height);
-      image.setPixelAt(x, y, clamped(scene.traceRay(&ray)));
+  // Render the tiles on all threads
+  TileScheduler const scheduler(width, height);
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        Ray ray = camera.castRay(static_cast<float>(x)/width,
+                                 static_cast<float>(y)/height);
+        image.setPixelAt(x, y, clamped(scene.traceRay(&ray)));
+      }
     }
-
-    bar.progress((float)(x) / width);
-  }
+  }, &bar);
 
   // Stop timer and progressbar
   timer.end();
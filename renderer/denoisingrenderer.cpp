@@ -0,0 +1,45 @@
+#include "renderer/denoisingrenderer.h"
+#include "renderer/simplerenderer.h"
+#include "common/postprocessing.h"
+#include "common/benchmark.h"
+
+#include <iostream>
+
+Texture DenoisingRenderer::renderImage(Scene const& scene,
+                                       Camera const& camera,
+                                       int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer DenoisingRenderer::renderFrame(Scene const& scene,
+                                           Camera const& camera,
+                                           int width, int height,
+                                           int channels) {
+  // The noisy image with the guides, if the renderer averages them over
+  // its samples. Otherwise they come from a trace without shading.
+  int const guideChannels = FrameBuffer::NORMAL | FrameBuffer::DEPTH | FrameBuffer::ALBEDO;
+  bool const hasGuides = (this->renderer_->supportedChannels() & guideChannels) == guideChannels;
+  int const noiseChannels = this->renderer_->supportedChannels() & FrameBuffer::VARIANCE;
+  FrameBuffer frame = this->renderer_->renderFrame(scene, camera, width, height,
+                                                   channels | FrameBuffer::COLOR | noiseChannels
+                                                   | (hasGuides ? guideChannels : 0));
+  FrameBuffer guides;
+  if (!hasGuides) {
+    SimpleRenderer guideRenderer;
+    guides = guideRenderer.renderFrame(scene, camera, width, height, guideChannels);
+  }
+
+  std::cout << "(DenoisingRenderer): Denoising..." << std::endl;
+  Timer timer;
+  timer.start();
+  this->process(&frame, hasGuides ? frame : guides);
+  timer.end();
+  std::cout << "(DenoisingRenderer): Denoising time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+
+  return frame;
+}
+
+void DenoisingRenderer::process(FrameBuffer * frame, FrameBuffer const& guides) const {
+  applyDenoising(frame, guides, this->iterations_, this->colorSigma_, this->albedoSigma_,
+                 this->normalPower_, this->depthSigma_);
+}
@@ -0,0 +1,60 @@
+#ifndef DENOISINGRENDERER_H
+#define DENOISINGRENDERER_H
+
+#include "renderer/renderer.h"
+
+// Renders with another renderer at a low sample count and removes the noise
+// with an a-trous filter (see applyDenoising), e.g. a SuperRenderer with a
+// super sampling factor of 2 or a DepthOfFieldRenderer with 16 aperture
+// rays instead of 100. The normal, depth and albedo guides come from the
+// renderer if it supports them (see supportedChannels), otherwise from one
+// extra SimpleRenderer trace, which costs no shading.
+class DenoisingRenderer : public Renderer {
+
+public:
+  // Constructor / Destructor
+  DenoisingRenderer(Renderer * renderer)
+    : renderer_(renderer), iterations_(4), colorSigma_(2.0f),
+      albedoSigma_(0.3f), normalPower_(128.0f), depthSigma_(1.0f) {}
+  virtual ~DenoisingRenderer() {}
+
+  // Get
+  Renderer * renderer() const { return this->renderer_; }
+  int iterations() const { return this->iterations_; }
+  float colorSigma() const { return this->colorSigma_; }
+  float albedoSigma() const { return this->albedoSigma_; }
+  float normalPower() const { return this->normalPower_; }
+  float depthSigma() const { return this->depthSigma_; }
+  virtual int supportedChannels() const { return this->renderer_->supportedChannels() | FrameBuffer::COLOR; }
+
+  // Set
+  // The renderer is not owned
+  void setRenderer(Renderer * renderer) { this->renderer_ = renderer; }
+  void setIterations(int count) { this->iterations_ = count; }
+  void setColorSigma(float sigma) { this->colorSigma_ = sigma; }
+  void setAlbedoSigma(float sigma) { this->albedoSigma_ = sigma; }
+  void setNormalPower(float power) { this->normalPower_ = power; }
+  void setDepthSigma(float sigma) { this->depthSigma_ = sigma; }
+
+  // Render functions
+  virtual Texture renderImage(Scene const& scene,
+                              Camera const& camera,
+                              int width, int height);
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
+  // Denoises an already rendered frame with the given guides
+  void process(FrameBuffer * frame, FrameBuffer const& guides) const;
+
+private:
+  Renderer * renderer_;
+  int iterations_;
+  float colorSigma_;
+  float albedoSigma_;
+  float normalPower_;
+  float depthSigma_;
+
+};
+
+#endif
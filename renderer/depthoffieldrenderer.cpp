@@ -2,34 +2,46 @@
 #include "scene/scene.h"
 #include "camera/camera.h"
 #include "common/progressbar.h"
+#include "common/tilescheduler.h"
 #include "common/benchmark.h"
+#include "common/pixelestimate.h"
 #include "common/vector2d.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
 
-#include <time.h>
 #include <omp.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 
-Vector3d unitCircleRandom(float radius) {
-  Vector2d randomVec(
-    2*PI*((float)rand() / RAND_MAX),
-    std::sqrt((float)rand() / RAND_MAX)
-  );
-
-  Vector2d circleVec = Vector2d(std::cos(randomVec.u), std::sin(randomVec.v));
-  Vector2d unitCirclePos = ( (radius * randomVec.v) * circleVec );
-
-  return Vector3d(unitCirclePos.u, unitCirclePos.v, 0);
-}
-
-Vector3d pixelRandom() {
-   Vector3d randomVec(rand()/RAND_MAX, rand()/RAND_MAX, 0);
-   return randomVec;
+// Offset on the aperture disk for a point of the unit square. The concentric
+// mapping (Shirley & Chiu) keeps the strata of the square apart on the disk.
+Vector3d apertureOffset(Vector2d const& sample, float radius) {
+  float const a = 2*sample.u - 1, b = 2*sample.v - 1;
+  if (a == 0 && b == 0)
+    return Vector3d();
+  float distance, angle;
+  if (a*a > b*b) {
+    distance = radius*a;
+    angle = (PI/4)*(b/a);
+  } else {
+    distance = radius*b;
+    angle = PI/2 - (PI/4)*(a/b);
+  }
+  return Vector3d(distance*std::cos(angle), distance*std::sin(angle), 0);
 }
 
 Texture DepthOfFieldRenderer::renderImage(Scene const& scene,
                                     Camera const& camera,
                                     int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer DepthOfFieldRenderer::renderFrame(Scene const& scene,
+                                              Camera const& camera,
+                                              int width, int height,
+                                              int channels) {
   std::cout << "(DepthOfFieldRenderer): Rendering..." << std::endl;
 
   // Setup timer and progressbar
@@ -39,51 +51,158 @@ Texture DepthOfFieldRenderer::renderImage(Scene const& scene,
   Timer timer;
   timer.start();
 
-  // Initialize random generator
-  srand( (unsigned) time(NULL) * omp_get_thread_num());
-
-  Texture image(width, height);
+  FrameBuffer frame(width, height, channels | FrameBuffer::COLOR);
+  bool const needsHits = frame.hasChannel(FrameBuffer::DEPTH) || frame.hasChannel(FrameBuffer::NORMAL)
+      || frame.hasChannel(FrameBuffer::ALBEDO);
 
   float const aspectRatio = static_cast<float>(height)/width;
-  for (int x = 0; x < image.width(); ++x) {
-
-    // Peform for-statement on seperate threads
-    #pragma omp parallel for
-    for (int y = 0; y < image.height(); ++y) {
-      Ray ray = camera.castRay((static_cast<float>(x)/width*2-1),
-                               (static_cast<float>(y)/height*2-1)*aspectRatio);
-
-      // Calculate the focal point on the focal plane
-      Vector3d focalPoint = ray.origin + this->focalDistance_ * ray.direction;
-
-      // Aperture color buffer
-      Color apertureColor;
-
-      for (int i = 0; i < this->apertureRays_; i++) {
-        // prepare ray using jittered random origin simulating the aperture
-        Ray apertureRay = ray;
-        apertureRay.origin += unitCircleRandom(this->apertureRadius_);
-        Vector3d pixelJitter = focalPoint + pixelRandom();
-
-        // calculate new direction based on focal point and jittered origin
-        apertureRay.direction = normalized(pixelJitter - apertureRay.origin);
-
-        // trace the aperture ray and add color to color buffer
-        apertureColor += scene.traceRay(&apertureRay);
+  int const minimumRays = std::max(std::min(this->minimumRays_, this->apertureRays_), 1);
+
+  // First pass: radius of the circle of confusion of the primary hits, in
+  // pixels. The angle between the rays of two neighboring pixels converts
+  // the angular radius.
+  float const pixelAngle = std::max(length(camera.castRay(2.0f/width, 0).direction
+                                           - camera.castRay(0, 0).direction), 1e-6f);
+  std::vector<float> radii(width*height);
+  TileScheduler const scheduler(width, height, FrameBuffer::tileSize);
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        Ray ray = camera.castRay((x + 0.5f)/width*2-1, ((y + 0.5f)/height*2-1)*aspectRatio);
+        float const distance = scene.findIntersection(&ray) ? ray.length : INFINITY;
+        radii[y*width + x] = this->circleOfConfusion(distance)/pixelAngle;
       }
+    }
+  });
+
+  // A blurred object spreads over its neighbors, e.g. a foreground object
+  // over the background in focus, so every pixel is sampled for the largest
+  // circle of confusion that reaches its tile
+  int const tileSize = FrameBuffer::tileSize;
+  int const tilesPerRow = (width+tileSize-1)/tileSize;
+  int const tilesPerColumn = (height+tileSize-1)/tileSize;
+  std::vector<float> tileRadii(tilesPerRow*tilesPerColumn, 0.0f), reachingRadii(tilesPerRow*tilesPerColumn, 0.0f);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      tileRadii[(y/tileSize)*tilesPerRow + x/tileSize] = std::max(tileRadii[(y/tileSize)*tilesPerRow + x/tileSize], radii[y*width + x]);
+
+  // Only tiles within the largest radius can reach a tile
+  float const maximumRadius = *std::max_element(tileRadii.begin(), tileRadii.end());
+  int const window = static_cast<int>(std::min(std::ceil(maximumRadius/tileSize) + 1.0f,
+                                               static_cast<float>(std::max(tilesPerRow, tilesPerColumn))));
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < tilesPerRow*tilesPerColumn; ++t) {
+    int const tileX = t % tilesPerRow, tileY = t / tilesPerRow;
+    for (int sy = std::max(tileY-window, 0); sy <= std::min(tileY+window, tilesPerColumn-1); ++sy) {
+      for (int sx = std::max(tileX-window, 0); sx <= std::min(tileX+window, tilesPerRow-1); ++sx) {
+        float const radius = tileRadii[sy*tilesPerRow + sx];
+        // Gap between the two tiles in pixels
+        float const gapX = std::max(std::abs(sx - tileX) - 1, 0)*tileSize;
+        float const gapY = std::max(std::abs(sy - tileY) - 1, 0)*tileSize;
+        if (radius > reachingRadii[t] && gapX*gapX + gapY*gapY <= radius*radius)
+          reachingRadii[t] = radius;
+      }
+    }
+  }
 
-      // calculate average over color buffer and set the color
-      apertureColor = apertureColor / this->apertureRays_;
-      image.setPixelAt(x, y, clamped(apertureColor));
+  // Second pass: every pixel starts with a few aperture rays, at most as
+  // many as its circle of confusion covers pixels, and takes twice as many
+  // while its standard error is above the threshold
+  long totalRays = 0;
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    float const radius = reachingRadii[(tile.y0/tileSize)*tilesPerRow + tile.x0/tileSize];
+    float const area = PI*radius*radius;
+    int const maximumRays = area >= this->apertureRays_ ? this->apertureRays_
+        : std::max(static_cast<int>(std::ceil(area)), minimumRays);
+    // A single estimate of few rays easily misses a small bright spot of
+    // the blur, so larger circles start with more rays
+    int const initialRays = this->adaptiveThreshold_ > 0.0f
+        ? std::min(std::max(static_cast<int>(std::ceil(area/8)), minimumRays), maximumRays) : maximumRays;
+    long tileRays = 0;
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        // Aperture color estimate, and the first hits of the aperture rays
+        PixelEstimate estimate;
+        Color albedo;
+        Vector3d normal;
+        float depth = 0.0f;
+        int hitCount = 0;
+
+        // Trace aperture rays until the pixel has the given number of samples
+        auto sample = [&](int count) {
+          for (int i = estimate.count; i < count; i++) {
+            // Jittered position in the pixel and on the aperture
+            Vector2d const pixelSample = this->sampler_.sample(x, y, i, maximumRays, 0);
+            Vector2d const apertureSample = this->sampler_.sample(x, y, i, maximumRays, 1);
+            Ray ray = camera.castDifferentialRay(((x + pixelSample.u)/width*2-1),
+                                                 ((y + pixelSample.v)/height*2-1)*aspectRatio,
+                                                 2.0f/width, 2.0f/height*aspectRatio);
+
+            // Calculate the focal point on the focal plane
+            Vector3d const focalPoint = ray.origin + this->focalDistance_ * ray.direction;
+
+            // prepare ray using jittered random origin simulating the aperture
+            Ray apertureRay = ray;
+            apertureRay.origin += apertureOffset(apertureSample, this->apertureRadius_);
+
+            // calculate new direction based on focal point and jittered origin
+            apertureRay.direction = normalized(focalPoint - apertureRay.origin);
+
+            // The first hit is recorded before shading, which may turn the
+            // ray into a secondary one (e.g. mirrors)
+            bool const hit = scene.findIntersection(&apertureRay);
+            if (needsHits && hit) {
+              albedo += apertureRay.primitive->shader()->albedo(apertureRay);
+              normal += apertureRay.primitive->normalFromRay(apertureRay);
+              depth += apertureRay.length;
+              ++hitCount;
+            }
+
+            // shade the aperture ray and add its color to the estimate
+            estimate.add(hit && apertureRay.remainingBounces-- > 0
+                         ? apertureRay.primitive->shader()->shade(&apertureRay)
+                         : scene.environmentColor(apertureRay.direction));
+          }
+        };
+        sample(initialRays);
+        while (estimate.count < maximumRays && estimate.error() > this->adaptiveThreshold_)
+          sample(std::min(2*estimate.count, maximumRays));
+        tileRays += estimate.count;
+
+        // average of the aperture rays
+        frame.setColor(x, y, estimate.color());
+        if (frame.hasChannel(FrameBuffer::DEPTH))
+          frame.setDepth(x, y, 2*hitCount >= estimate.count ? depth/hitCount : INFINITY);
+        if (frame.hasChannel(FrameBuffer::NORMAL))
+          frame.setNormal(x, y, normal/estimate.count);
+        if (frame.hasChannel(FrameBuffer::ALBEDO))
+          frame.setAlbedo(x, y, albedo/estimate.count);
+        if (frame.hasChannel(FrameBuffer::SAMPLE_COUNT))
+          frame.setSampleCount(x, y, estimate.count);
+        if (frame.hasChannel(FrameBuffer::VARIANCE))
+          frame.setVariance(x, y, estimate.error()*estimate.error());
+      }
     }
 
-    bar.progress((float)(x) / width);
-  }
+    #pragma omp atomic
+    totalRays += tileRays;
+  }, &bar);
 
   // Stop timer and progressbar
   timer.end();
   bar.end();
   std::cout << "(DepthOfFieldRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+  printf("(DepthOfFieldRenderer): %.2f aperture rays per pixel on average (at most %d)\n",
+         static_cast<float>(totalRays)/(width*height), this->apertureRays_);
+
+  return frame;
+}
 
-  return image;
+float DepthOfFieldRenderer::circleOfConfusion(float distance) const {
+  // The aperture rays of a pixel meet at the focal distance, in between
+  // they span a cone, seen from the lens at the angle radius*|d-f|/(f*d)
+  if (!std::isfinite(distance))
+    return this->apertureRadius_/this->focalDistance_;
+  return this->apertureRadius_*std::fabs(distance - this->focalDistance_)/(this->focalDistance_*distance);
 }
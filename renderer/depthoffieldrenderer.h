@@ -2,33 +2,70 @@
 #define DEPTHOFFIELDRENDERER_H
 
 #include "renderer/renderer.h"
+#include "common/sampler.h"
 
+// Thin lens depth of field: the aperture rays of a pixel start on a disk of
+// the aperture radius and meet at the focal distance. Pixels take aperture
+// rays by the blur they show, i.e. by the circle of confusion of the first
+// hits around them: surfaces in focus need only a few rays for
+// antialiasing, and blurred pixels take more while their estimate is noisy,
+// up to the number of aperture rays.
 class DepthOfFieldRenderer : public Renderer {
 
 public:
   // Constructor / Destructor
-  DepthOfFieldRenderer() {}
+  DepthOfFieldRenderer()
+    : apertureRadius_(1.0f), apertureRays_(100), focalDistance_(100.0f),
+      minimumRays_(4), adaptiveThreshold_(0.005f) {}
   virtual ~DepthOfFieldRenderer() {}
 
   // Get
   float apertureRadius() { return this->apertureRadius_; }
   int apertureRays() { return this->apertureRays_; }
   float focalDistance() { return this->focalDistance_; }
+  Sampler const& sampler() { return this->sampler_; }
+  int minimumRays() { return this->minimumRays_; }
+  float adaptiveThreshold() { return this->adaptiveThreshold_; }
+  // The extra channels are averaged over the aperture rays, so they are as
+  // blurred as the color (e.g. as guides for a DenoisingRenderer)
+  virtual int supportedChannels() const {
+    return FrameBuffer::COLOR | FrameBuffer::DEPTH | FrameBuffer::NORMAL
+        | FrameBuffer::ALBEDO | FrameBuffer::SAMPLE_COUNT | FrameBuffer::VARIANCE;
+  }
 
   // Set
   void setApertureRadius(float radius) { this->apertureRadius_ = radius; }
   void setApertureRays(int count) { this->apertureRays_ = count; }
   void setFocalDistance(float distance) { this->focalDistance_ = distance; }
+  void setSampler(Sampler const& sampler) { this->sampler_ = sampler; }
+  // Aperture rays of every pixel, there are as many more as the circle of
+  // confusion covers pixels, up to the aperture rays
+  void setMinimumRays(int count) { this->minimumRays_ = count; }
+  // Standard error of the luminance up to which the rays of a pixel are
+  // doubled. A threshold of 0 always takes all rays the circle of confusion
+  // allows, and with as many minimum rays as aperture rays every pixel
+  // takes them all.
+  void setAdaptiveThreshold(float threshold) { this->adaptiveThreshold_ = threshold; }
 
   // Render functions
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
 
 private:
+  // Angular radius of the blur of a point at the given distance
+  float circleOfConfusion(float distance) const;
+
   float apertureRadius_;
   int apertureRays_;
   float focalDistance_;
+  Sampler sampler_;
+  int minimumRays_;
+  float adaptiveThreshold_;
 
 };
 
@@ -11,9 +11,13 @@ public:
   virtual ~DepthRenderer() {}
 
   // Render functions
+  // Traces the scene once with SimpleRenderer and applies the effect
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  // Applies the effect to an already rendered frame (with depth), so
+  // several effects can share one trace
+  Texture process(FrameBuffer frame) const;
 
 };
 
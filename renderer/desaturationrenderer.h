@@ -17,9 +17,13 @@ public:
   void setIntensity(float intensity) { this->intensity_ = intensity; }
 
   // Render functions
+  // Traces the scene once with SimpleRenderer and applies the effect
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  // Applies the effect to an already rendered frame (with color), so
+  // several effects can share one trace
+  Texture process(FrameBuffer frame) const;
 
 private:
   float intensity_;
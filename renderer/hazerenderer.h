@@ -19,9 +19,13 @@ public:
   void setFalloff(float falloff) { this->falloff_ = falloff; }
 
   // Render functions
+  // Traces the scene once with SimpleRenderer and applies the effect
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  // Applies the effect to an already rendered frame (with color and depth), so
+  // several effects can share one trace
+  Texture process(FrameBuffer frame) const;
 
 private:
   float falloff_;
@@ -0,0 +1,225 @@
+#include "renderer/progressiverenderer.h"
+#include "scene/scene.h"
+#include "camera/camera.h"
+#include "common/progressbar.h"
+#include "common/tilescheduler.h"
+#include "common/benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// Checkpoint file layout: the header, then six 32-bit values per pixel (the
+// color sum, the luminance sums and the sample count)
+static char const checkpointMagic[8] = {'T','R','C','Y','P','R','G','1'};
+struct CheckpointHeader {
+  char magic[8];
+  int32_t width, height;
+  int32_t pattern;
+  uint32_t seed;
+  int32_t maximumSamples; // the sample points depend on it
+};
+
+Texture ProgressiveRenderer::renderImage(Scene const& scene,
+                                         Camera const& camera,
+                                         int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer ProgressiveRenderer::renderFrame(Scene const& scene,
+                                             Camera const& camera,
+                                             int width, int height,
+                                             int channels) {
+  std::cout << "(ProgressiveRenderer): Rendering..." << std::endl;
+
+  // Start from the checkpoint of an interrupted render, if there is one
+  std::vector<PixelEstimate> estimates(width*height);
+  int samples = 0;
+  if (!this->checkpointFileName_.empty() && this->loadCheckpoint(&estimates, width, height)) {
+    samples = estimates.empty() ? 0 : estimates[0].count;
+    printf("(ProgressiveRenderer): Resuming at %d samples per pixel\n", samples);
+  }
+
+  // Setup timer and progressbar
+  ProgressBar bar(70);
+  bar.start();
+
+  Timer timer, checkpointTimer;
+  timer.start();
+  checkpointTimer.start();
+
+  float const aspectRatio = static_cast<float>(height)/width;
+  int const samplesPerPass = std::max(this->samplesPerPass_, 1);
+  TileScheduler const scheduler(width, height, FrameBuffer::tileSize);
+  float error = INFINITY;
+  while (samples < this->maximumSamples_) {
+    // Take the next samples of every pixel
+    int const passSamples = std::min(samples + samplesPerPass, this->maximumSamples_);
+    scheduler.run([&](TileScheduler::Tile const& tile) {
+      for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+          PixelEstimate & estimate = estimates[y*width + x];
+          for (int i = samples; i < passSamples; ++i) {
+            Vector2d const offset = this->sampler_.sample(x, y, i, this->maximumSamples_);
+            Ray ray = camera.castDifferentialRay(((x + offset.u)/width*2-1),
+                                                 ((y + offset.v)/height*2-1)*aspectRatio,
+                                                 2.0f/width, 2.0f/height*aspectRatio);
+            estimate.add(scene.traceRay(&ray));
+          }
+        }
+      }
+    });
+    samples = passSamples;
+
+    // Mean error of the pixels, which needs two samples
+    if (samples >= 2) {
+      double errorSum = 0.0;
+      int const pixelCount = width*height;
+      #pragma omp parallel for reduction(+:errorSum)
+      for (int i = 0; i < pixelCount; ++i)
+        errorSum += estimates[i].error();
+      error = errorSum/pixelCount;
+    }
+
+    // Publish the estimate
+    if (this->passCallback_)
+      this->passCallback_(this->resolve(estimates, width, height, channels), samples);
+
+    timer.end();
+    float const elapsed = timer.getMicroseconds().count()/1e6f;
+    float progress = static_cast<float>(samples)/this->maximumSamples_;
+    if (this->timeBudget_ > 0.0f)
+      progress = std::max(progress, elapsed/this->timeBudget_);
+    if (this->noiseThreshold_ > 0.0f && std::isfinite(error))
+      progress = std::max(progress, this->noiseThreshold_/error);
+    bar.progress(std::min(progress, 1.0f));
+
+    checkpointTimer.end();
+    if (!this->checkpointFileName_.empty()
+        && checkpointTimer.getMicroseconds().count()/1e6f >= this->checkpointInterval_) {
+      this->saveCheckpoint(estimates, width, height);
+      checkpointTimer.start();
+    }
+
+    // The budget is checked between passes, so it is exceeded by up to one
+    // pass
+    if (this->noiseThreshold_ > 0.0f && error <= this->noiseThreshold_)
+      break;
+    if (this->timeBudget_ > 0.0f && elapsed >= this->timeBudget_)
+      break;
+  }
+  if (!this->checkpointFileName_.empty())
+    this->saveCheckpoint(estimates, width, height);
+
+  // Stop timer and progressbar
+  timer.end();
+  bar.end();
+  std::cout << "(ProgressiveRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+  printf("(ProgressiveRenderer): %d samples per pixel, mean error %.5f\n", samples, error);
+
+  return this->resolve(estimates, width, height, channels);
+}
+
+FrameBuffer ProgressiveRenderer::resolve(std::vector<PixelEstimate> const& estimates,
+                                         int width, int height, int channels) const {
+  FrameBuffer frame(width, height, channels | FrameBuffer::COLOR);
+  #pragma omp parallel for
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      PixelEstimate const& estimate = estimates[y*width + x];
+      frame.setColor(x, y, estimate.color());
+      if (frame.hasChannel(FrameBuffer::SAMPLE_COUNT))
+        frame.setSampleCount(x, y, estimate.count);
+      if (frame.hasChannel(FrameBuffer::VARIANCE))
+        frame.setVariance(x, y, estimate.error()*estimate.error());
+    }
+  }
+  return frame;
+}
+
+bool ProgressiveRenderer::saveCheckpoint(std::vector<PixelEstimate> const& estimates,
+                                         int width, int height) const {
+  // Write a new file and replace the old one with it
+  std::string const temporaryFileName = this->checkpointFileName_ + ".tmp";
+  FILE * file = std::fopen(temporaryFileName.c_str(), "wb");
+  if (!file) {
+    printf("(ProgressiveRenderer): Could not write checkpoint: %s\n", temporaryFileName.c_str());
+    return false;
+  }
+
+  CheckpointHeader header;
+  std::memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+  header.width = width;
+  header.height = height;
+  header.pattern = this->sampler_.pattern();
+  header.seed = this->sampler_.seed();
+  header.maximumSamples = this->maximumSamples_;
+  bool success = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+  std::vector<float> row(6*std::size_t(width));
+  for (int y = 0; y < height && success; ++y) {
+    for (int x = 0; x < width; ++x) {
+      PixelEstimate const& estimate = estimates[y*width + x];
+      float * values = &row[6*x];
+      values[0] = estimate.sum.r;
+      values[1] = estimate.sum.g;
+      values[2] = estimate.sum.b;
+      values[3] = estimate.luminanceSum;
+      values[4] = estimate.luminanceSquares;
+      int32_t const count = estimate.count;
+      std::memcpy(&values[5], &count, sizeof(count));
+    }
+    success = std::fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+  }
+  success &= std::fclose(file) == 0;
+  success = success && std::rename(temporaryFileName.c_str(), this->checkpointFileName_.c_str()) == 0;
+
+  if (success)
+    printf("(ProgressiveRenderer): Checkpoint written to: \"%s\"\n", this->checkpointFileName_.c_str());
+  else
+    printf("(ProgressiveRenderer): Could not write checkpoint: %s\n", this->checkpointFileName_.c_str());
+  return success;
+}
+
+bool ProgressiveRenderer::loadCheckpoint(std::vector<PixelEstimate> * estimates,
+                                         int width, int height) const {
+  FILE * file = std::fopen(this->checkpointFileName_.c_str(), "rb");
+  if (!file)
+    return false;
+
+  // Only a checkpoint of the same image and sample points can be resumed
+  CheckpointHeader header;
+  bool success = std::fread(&header, sizeof(header), 1, file) == 1
+      && std::memcmp(header.magic, checkpointMagic, sizeof(header.magic)) == 0
+      && header.width == width && header.height == height
+      && header.pattern == this->sampler_.pattern()
+      && header.seed == this->sampler_.seed()
+      && header.maximumSamples == this->maximumSamples_;
+  if (!success)
+    printf("(ProgressiveRenderer): Ignoring checkpoint of a different render: %s\n",
+           this->checkpointFileName_.c_str());
+
+  std::vector<PixelEstimate> loaded(width*height);
+  std::vector<float> row(6*std::size_t(width));
+  for (int y = 0; y < height && success; ++y) {
+    success = std::fread(row.data(), sizeof(float), row.size(), file) == row.size();
+    for (int x = 0; x < width && success; ++x) {
+      PixelEstimate & estimate = loaded[y*width + x];
+      float const* values = &row[6*x];
+      estimate.sum = Color(values[0], values[1], values[2]);
+      estimate.luminanceSum = values[3];
+      estimate.luminanceSquares = values[4];
+      int32_t count;
+      std::memcpy(&count, &values[5], sizeof(count));
+      estimate.count = count;
+    }
+  }
+  std::fclose(file);
+
+  if (success)
+    estimates->swap(loaded);
+  return success;
+}
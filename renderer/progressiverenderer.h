@@ -0,0 +1,86 @@
+#ifndef PROGRESSIVERENDERER_H
+#define PROGRESSIVERENDERER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "renderer/renderer.h"
+#include "common/pixelestimate.h"
+#include "common/sampler.h"
+
+// Accumulates the samples of all pixels in passes, so there is an image
+// after every pass, and stops at a time budget, a noise level or the
+// maximum number of samples, whichever comes first. With a checkpoint file
+// the accumulated samples are saved every now and then, and an interrupted
+// render of the same size and sampler resumes from there.
+// Note: The samples come from the sampler by their index, so a resumed
+// render takes exactly the samples the interrupted one would have taken.
+// The Sobol patterns suit this best, as every prefix of them is well
+// distributed.
+class ProgressiveRenderer : public Renderer {
+
+public:
+  typedef std::function<void(FrameBuffer const& estimate, int samplesPerPixel)> PassCallback;
+
+  // Constructor / Destructor
+  ProgressiveRenderer()
+    : sampler_(Sampler::SOBOL), samplesPerPass_(1), maximumSamples_(1024),
+      timeBudget_(0.0f), noiseThreshold_(0.0f), checkpointInterval_(60.0f) {}
+  virtual ~ProgressiveRenderer() {}
+
+  // Get
+  Sampler const& sampler() const { return this->sampler_; }
+  int samplesPerPass() const { return this->samplesPerPass_; }
+  int maximumSamples() const { return this->maximumSamples_; }
+  float timeBudget() const { return this->timeBudget_; }
+  float noiseThreshold() const { return this->noiseThreshold_; }
+  std::string const& checkpointFileName() const { return this->checkpointFileName_; }
+  float checkpointInterval() const { return this->checkpointInterval_; }
+  virtual int supportedChannels() const {
+    return FrameBuffer::COLOR | FrameBuffer::SAMPLE_COUNT | FrameBuffer::VARIANCE;
+  }
+
+  // Set
+  void setSampler(Sampler const& sampler) { this->sampler_ = sampler; }
+  void setSamplesPerPass(int count) { this->samplesPerPass_ = count; }
+  void setMaximumSamples(int count) { this->maximumSamples_ = count; }
+  // Wall clock time of a render in seconds, 0 for none
+  void setTimeBudget(float seconds) { this->timeBudget_ = seconds; }
+  // Mean standard error of the pixel luminances to stop at, 0 for none
+  void setNoiseThreshold(float threshold) { this->noiseThreshold_ = threshold; }
+  // Empty for no checkpoints. The file is also written when the render
+  // stops, and it is replaced atomically, so a crash never leaves a broken
+  // checkpoint behind.
+  void setCheckpointFileName(std::string const& fileName) { this->checkpointFileName_ = fileName; }
+  void setCheckpointInterval(float seconds) { this->checkpointInterval_ = seconds; }
+  // Called with the current estimate after every pass
+  void setPassCallback(PassCallback const& callback) { this->passCallback_ = callback; }
+
+  // Render functions
+  virtual Texture renderImage(Scene const& scene,
+                              Camera const& camera,
+                              int width, int height);
+  // Produces the color, the sample count and the variance channels
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
+
+private:
+  FrameBuffer resolve(std::vector<PixelEstimate> const& estimates,
+                      int width, int height, int channels) const;
+  bool saveCheckpoint(std::vector<PixelEstimate> const& estimates, int width, int height) const;
+  bool loadCheckpoint(std::vector<PixelEstimate> * estimates, int width, int height) const;
+
+  Sampler sampler_;
+  int samplesPerPass_;
+  int maximumSamples_;
+  float timeBudget_;
+  float noiseThreshold_;
+  std::string checkpointFileName_;
+  float checkpointInterval_;
+  PassCallback passCallback_;
+
+};
+
+#endif
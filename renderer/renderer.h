@@ -1,6 +1,8 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include "common/framebuffer.h"
+#include "common/imagestream.h"
 #include "common/texture.h"
 
 // Forward declarations
@@ -19,6 +21,40 @@ public:
                               Camera const& camera,
                               int width, int height) = 0;
 
+  // Channels renderFrame fills in, the others keep their defaults
+  virtual int supportedChannels() const { return FrameBuffer::COLOR; }
+
+  // Render into a float frame buffer with the requested channels (see
+  // FrameBuffer::Channel). Renderers that only produce an 8-bit image fall
+  // back to this default, which copies the image into the color channel.
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR) {
+    Texture const image = this->renderImage(scene, camera, width, height);
+    FrameBuffer frame(width, height, channels | FrameBuffer::COLOR);
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+        frame.setColor(x, y, image.pixel(x, y));
+    return frame;
+  }
+
+  // Render straight into an image file. Renderers that support it write
+  // .ppm and .pfm files band by band (see ImageStream), the default renders
+  // the whole frame first.
+  virtual bool renderToFile(Scene const& scene,
+                            Camera const& camera,
+                            int width, int height,
+                            char const* fileName) {
+    if (!ImageStream::supports(fileName))
+      return this->renderImage(scene, camera, width, height).save(fileName);
+    ImageStream stream(fileName, width, height);
+    if (!stream.isOpen())
+      return false;
+    stream.write(0, this->renderFrame(scene, camera, width, height));
+    return stream.close();
+  }
+
 };
 
 #endif
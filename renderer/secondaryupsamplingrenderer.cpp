@@ -0,0 +1,260 @@
+#include "renderer/secondaryupsamplingrenderer.h"
+#include "scene/scene.h"
+#include "camera/camera.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
+#include "common/alignedallocator.h"
+#include "common/fastmath.h"
+#include "common/progressbar.h"
+#include "common/raypacket.h"
+#include "common/tilescheduler.h"
+#include "common/benchmark.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+// The primary hit of a pixel and the secondary rays its shader spawned,
+// without the rays themselves
+struct Fragment {
+  Color direct; // the color of the hit without the secondary rays
+  Vector3d normal;
+  Vector3d directions[Shader::maximumSecondaryRays];
+  Color weights[Shader::maximumSecondaryRays];
+  Shader const* shader;
+  float depth;
+  int secondaryCount;
+};
+
+Texture SecondaryUpsamplingRenderer::renderImage(Scene const& scene,
+                                                 Camera const& camera,
+                                                 int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer SecondaryUpsamplingRenderer::renderFrame(Scene const& scene,
+                                                     Camera const& camera,
+                                                     int width, int height,
+                                                     int channels) {
+  std::cout << "(SecondaryUpsamplingRenderer): Rendering..." << std::endl;
+
+  // Setup timer and progressbar
+  ProgressBar bar(70);
+  bar.start();
+
+  Timer timer;
+  timer.start();
+
+  float const aspectRatio = static_cast<float>(height)/width;
+  int const factor = std::max(this->factor_, 1);
+  int const blocksPerRow = (width+factor-1)/factor;
+  int const blocksPerColumn = (height+factor-1)/factor;
+
+  // Shade the primary hit of a pixel and keep its secondary rays
+  auto shadePrimary = [&](Ray * ray, bool hit, Fragment * fragment, SecondaryRay * secondaryRays) {
+    fragment->shader = nullptr;
+    fragment->depth = hit ? ray->length : INFINITY;
+    fragment->normal = hit ? ray->primitive->normalFromRay(*ray) : Vector3d();
+    fragment->secondaryCount = 0;
+    if (hit && ray->remainingBounces-- > 0) {
+      fragment->shader = ray->primitive->shader();
+      fragment->direct = fragment->shader->shadeDeferred(ray, secondaryRays, &fragment->secondaryCount);
+      for (int i = 0; i < fragment->secondaryCount; ++i) {
+        fragment->directions[i] = secondaryRays[i].ray.direction;
+        fragment->weights[i] = secondaryRays[i].weight;
+      }
+    } else {
+      fragment->direct = scene.environmentColor(ray->direction);
+    }
+  };
+
+  // The pixel in the middle of a block traces the secondary rays for it
+  auto tracedPixel = [&](int blockX, int blockY) {
+    return std::min(blockY*factor + factor/2, height-1)*width
+        + std::min(blockX*factor + factor/2, width-1);
+  };
+
+  // First pass: shade the traced pixel of every block and trace its
+  // secondary rays, which take the footprint of the block
+  std::vector<Fragment, AlignedAllocator<Fragment> > fragments(blocksPerRow*blocksPerColumn);
+  std::vector<Color, AlignedAllocator<Color> > secondaryColors(blocksPerRow*blocksPerColumn*Shader::maximumSecondaryRays);
+  long tracedPixels = 0;
+  TileScheduler const blockScheduler(blocksPerRow, blocksPerColumn, FrameBuffer::tileSize);
+  blockScheduler.run([&](TileScheduler::Tile const& tile) {
+    SecondaryRay secondaryRays[Shader::maximumSecondaryRays];
+    long tileTraced = 0;
+    // The traced pixels of 4x4 blocks are intersected in one packet
+    for (int by = tile.y0; by < tile.y1; by += 4) {
+      for (int bx = tile.x0; bx < tile.x1; bx += 4) {
+        int count = 0;
+        int blocks[RayPacket::size];
+        float screenX[RayPacket::size], screenY[RayPacket::size];
+        for (int blockY = by; blockY < std::min(by+4, tile.y1); ++blockY) {
+          for (int blockX = bx; blockX < std::min(bx+4, tile.x1); ++blockX) {
+            int const traced = tracedPixel(blockX, blockY);
+            blocks[count] = blockY*blocksPerRow + blockX;
+            screenX[count] = static_cast<float>(traced % width)/width*2-1;
+            screenY[count++] = (static_cast<float>(traced / width)/height*2-1)*aspectRatio;
+          }
+        }
+
+        RayPacket packet;
+        camera.castPacket(count, screenX, screenY, 2.0f/width, 2.0f/height*aspectRatio, &packet);
+        RayPacket::Mask const hits = scene.findIntersections(&packet);
+        for (int j = 0; j < count; ++j) {
+          Fragment & fragment = fragments[blocks[j]];
+          shadePrimary(&packet.rays[j], hits >> j & 1, &fragment, secondaryRays);
+          for (int i = 0; i < fragment.secondaryCount; ++i) {
+            Ray & ray = secondaryRays[i].ray;
+            ray.originDx *= factor;
+            ray.originDy *= factor;
+            ray.directionDx *= factor;
+            ray.directionDy *= factor;
+            secondaryColors[blocks[j]*Shader::maximumSecondaryRays + i] = scene.traceRay(&ray);
+          }
+          tileTraced += fragment.secondaryCount > 0;
+        }
+      }
+    }
+
+    #pragma omp atomic
+    tracedPixels += tileTraced;
+  });
+
+  // Second pass: shade the primary hits of the other pixels. Every pixel
+  // takes the secondary colors of the traced pixels of its own and the
+  // neighboring blocks, weighted by distance and by how similar the hits
+  // and the secondary rays are.
+  FrameBuffer frame(width, height, channels | FrameBuffer::COLOR);
+  float const spatialFalloff = 1.0f/(factor*factor);
+  TileScheduler const scheduler(width, height, FrameBuffer::tileSize);
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    SecondaryRay secondaryRays[Shader::maximumSecondaryRays];
+    long tileTraced = 0;
+    // Primary rays are intersected in coherent packets of 4x4 pixels, the
+    // traced pixels are done already
+    for (int by = tile.y0; by < tile.y1; by += 4) {
+      for (int bx = tile.x0; bx < tile.x1; bx += 4) {
+        int count = 0;
+        int pixelX[RayPacket::size], pixelY[RayPacket::size];
+        float screenX[RayPacket::size], screenY[RayPacket::size];
+        for (int y = by; y < std::min(by+4, tile.y1); ++y) {
+          for (int x = bx; x < std::min(bx+4, tile.x1); ++x) {
+            int const blockX = x/factor, blockY = y/factor;
+            if (tracedPixel(blockX, blockY) == y*width + x) {
+              Fragment const& fragment = fragments[blockY*blocksPerRow + blockX];
+              Color color = fragment.direct;
+              for (int i = 0; i < fragment.secondaryCount; ++i)
+                color += fragment.weights[i]*secondaryColors[(blockY*blocksPerRow + blockX)*Shader::maximumSecondaryRays + i];
+              frame.setColor(x, y, color);
+              if (frame.hasChannel(FrameBuffer::DEPTH))
+                frame.setDepth(x, y, fragment.depth);
+              if (frame.hasChannel(FrameBuffer::NORMAL))
+                frame.setNormal(x, y, fragment.normal);
+              continue;
+            }
+            pixelX[count] = x;
+            pixelY[count] = y;
+            screenX[count] = static_cast<float>(x)/width*2-1;
+            screenY[count++] = (static_cast<float>(y)/height*2-1)*aspectRatio;
+          }
+        }
+        if (count == 0)
+          continue;
+
+        RayPacket packet;
+        camera.castPacket(count, screenX, screenY, 2.0f/width, 2.0f/height*aspectRatio, &packet);
+        RayPacket::Mask const hits = scene.findIntersections(&packet);
+        for (int j = 0; j < count; ++j) {
+          int const x = pixelX[j], y = pixelY[j];
+          Fragment fragment;
+          shadePrimary(&packet.rays[j], hits >> j & 1, &fragment, secondaryRays);
+          Color color = fragment.direct;
+          int const blockX = x/factor, blockY = y/factor;
+
+          if (fragment.secondaryCount > 0) {
+            // Exponents of the weights of the traced pixels around, for every
+            // secondary ray. exp(-p*(1-cos)) falls off like cos^p for similar
+            // directions.
+            static int const maximumTaps = 12; // 3x3 blocks, padded
+            alignas(16) float exponents[Shader::maximumSecondaryRays][maximumTaps];
+            int taps[maximumTaps];
+            int tapCount = 0;
+            for (int oy = std::max(blockY-1, 0); oy <= std::min(blockY+1, blocksPerColumn-1); ++oy) {
+              for (int ox = std::max(blockX-1, 0); ox <= std::min(blockX+1, blocksPerRow-1); ++ox) {
+                // Only hits with the same shader spawn the same kind of rays
+                int const traced = tracedPixel(ox, oy);
+                Fragment const& other = fragments[oy*blocksPerRow + ox];
+                if (other.shader != fragment.shader || other.secondaryCount != fragment.secondaryCount)
+                  continue;
+
+                float const dx = traced % width - x, dy = traced / width - y;
+                float const exponent = -(dx*dx + dy*dy)*spatialFalloff
+                    - std::fabs(other.depth - fragment.depth)/(this->depthSigma_*fragment.depth)
+                    - this->normalPower_*(1.0f - dotProduct(other.normal, fragment.normal));
+                for (int i = 0; i < fragment.secondaryCount; ++i)
+                  exponents[i][tapCount] = exponent
+                      - this->normalPower_*(1.0f - dotProduct(other.directions[i], fragment.directions[i]));
+                taps[tapCount++] = (oy*blocksPerRow + ox)*Shader::maximumSecondaryRays;
+              }
+            }
+            int const paddedCount = (tapCount + 3) & ~3;
+            for (int k = tapCount; k < paddedCount; ++k) {
+              for (int i = 0; i < fragment.secondaryCount; ++i)
+                exponents[i][k] = -INFINITY;
+              taps[k] = taps[0];
+            }
+
+            Color sums[Shader::maximumSecondaryRays];
+            float weightSums[Shader::maximumSecondaryRays] = {};
+            for (int i = 0; i < fragment.secondaryCount && tapCount > 0; ++i) {
+              for (int k = 0; k < paddedCount; k += 4) {
+                alignas(16) float weights[4];
+                _mm_store_ps(weights, fastExp(_mm_load_ps(&exponents[i][k])));
+                for (int l = 0; l < 4; ++l) {
+                  sums[i] += weights[l]*secondaryColors[taps[k+l] + i];
+                  weightSums[i] += weights[l];
+                }
+              }
+            }
+
+            // Without a similar traced pixel nearby the pixel traces the
+            // secondary rays its shading spawned
+            bool similar = true;
+            for (int i = 0; i < fragment.secondaryCount; ++i)
+              similar &= weightSums[i] > 1e-3f;
+            if (similar) {
+              for (int i = 0; i < fragment.secondaryCount; ++i)
+                color += fragment.weights[i]*sums[i]/weightSums[i];
+            } else {
+              for (int i = 0; i < fragment.secondaryCount; ++i)
+                color += secondaryRays[i].weight*scene.traceRay(&secondaryRays[i].ray);
+              ++tileTraced;
+            }
+          }
+
+          frame.setColor(x, y, color);
+          if (frame.hasChannel(FrameBuffer::DEPTH))
+            frame.setDepth(x, y, fragment.depth);
+          if (frame.hasChannel(FrameBuffer::NORMAL))
+            frame.setNormal(x, y, fragment.normal);
+        }
+      }
+    }
+
+    #pragma omp atomic
+    tracedPixels += tileTraced;
+  }, &bar);
+
+  // Stop timer and progressbar
+  timer.end();
+  bar.end();
+  std::cout << "(SecondaryUpsamplingRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+  printf("(SecondaryUpsamplingRenderer): Secondary rays traced for %.1f%% of the pixels\n",
+         100.0f*tracedPixels/(width*height));
+
+  return frame;
+}
@@ -0,0 +1,59 @@
+#ifndef SECONDARYUPSAMPLINGRENDERER_H
+#define SECONDARYUPSAMPLINGRENDERER_H
+
+#include "renderer/renderer.h"
+
+// Shades the primary hits of all pixels, but traces the secondary rays of
+// the shaders (mirror, refraction and reflectance rays, see
+// Shader::shadeDeferred) only for one pixel of every block of factor x
+// factor pixels. The other pixels take their secondary colors from the
+// traced blocks around them with a joint bilateral filter, which is guided
+// by the depth and the normal of the primary hits and by the direction of
+// the secondary rays, so the colors do not blur across edges. Pixels
+// without a similar traced neighbor (e.g. at silhouettes) trace their own
+// secondary rays.
+// Note: The secondary rays of a traced pixel take the footprint of its
+// whole block, so the reflected textures are filtered at that rate.
+class SecondaryUpsamplingRenderer : public Renderer {
+
+public:
+  // Constructor / Destructor
+  SecondaryUpsamplingRenderer()
+    : factor_(2), normalPower_(32.0f), depthSigma_(0.05f) {}
+  virtual ~SecondaryUpsamplingRenderer() {}
+
+  // Get
+  int factor() const { return this->factor_; }
+  float normalPower() const { return this->normalPower_; }
+  float depthSigma() const { return this->depthSigma_; }
+  virtual int supportedChannels() const {
+    return FrameBuffer::COLOR | FrameBuffer::DEPTH | FrameBuffer::NORMAL;
+  }
+
+  // Set
+  // Block size in pixels, 1 traces the secondary rays of every pixel
+  void setFactor(int factor) { this->factor_ = factor; }
+  // Exponent of the cosine between the normals of two pixels, and of the
+  // cosine between their secondary rays
+  void setNormalPower(float power) { this->normalPower_ = power; }
+  // Depth difference of two pixels, relative to the depth, at which the
+  // weight falls to 1/e
+  void setDepthSigma(float sigma) { this->depthSigma_ = sigma; }
+
+  // Render functions
+  virtual Texture renderImage(Scene const& scene,
+                              Camera const& camera,
+                              int width, int height);
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
+
+private:
+  int factor_;
+  float normalPower_;
+  float depthSigma_;
+
+};
+
+#endif
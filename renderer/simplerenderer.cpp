@@ -1,15 +1,26 @@
 #include "renderer/simplerenderer.h"
 #include "scene/scene.h"
 #include "camera/camera.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
+#include "common/imagestream.h"
 #include "common/progressbar.h"
 #include "common/benchmark.h"
 
 #include <omp.h>
+#include <algorithm>
 #include <iostream>
 
 Texture SimpleRenderer::renderImage(Scene const& scene,
                                     Camera const& camera,
                                     int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer SimpleRenderer::renderFrame(Scene const& scene,
+                                        Camera const& camera,
+                                        int width, int height,
+                                        int channels) {
   std::cout << "(SimpleRenderer): Rendering..." << std::endl;
 
   // Setup timer and progressbar
@@ -19,26 +30,117 @@ Texture SimpleRenderer::renderImage(Scene const& scene,
   Timer timer;
   timer.start();
 
-  Texture image(width, height);
+  // Without the color channel (e.g. only depth) nothing is shaded
+  FrameBuffer frame(width, height, channels);
 
-  float const aspectRatio = static_cast<float>(height)/width;
-  for (int x = 0; x < image.width(); ++x) {
-
-    // Peform for-statement on seperate threads
-    #pragma omp parallel for
-    for (int y = 0; y < image.height(); ++y) {
-      Ray ray = camera.castRay((static_cast<float>(x)/width*2-1),
-                               (static_cast<float>(y)/height*2-1)*aspectRatio);
-      image.setPixelAt(x, y, clamped(scene.traceRay(&ray)));
-    }
+  // Render the tiles on all threads
+  TileScheduler const scheduler(width, height, FrameBuffer::tileSize);
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    this->renderTile(scene, camera, width, height, tile, &frame, 0);
+  }, &bar);
 
-    bar.progress((float)(x) / width);
+  // Stop timer and progressbar
+  timer.end();
+  bar.end();
+  std::cout << "(SimpleRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+
+  return frame;
+}
+
+bool SimpleRenderer::renderToFile(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  char const* fileName) {
+  if (!ImageStream::supports(fileName))
+    return Renderer::renderToFile(scene, camera, width, height, fileName);
+
+  std::cout << "(SimpleRenderer): Rendering to " << fileName << "..." << std::endl;
+  ImageStream stream(fileName, width, height);
+  if (!stream.isOpen())
+    return false;
+
+  // Setup timer and progressbar
+  ProgressBar bar(70);
+  bar.start();
+
+  Timer timer;
+  timer.start();
+
+  // Bands of four tile rows, each one is handed to the writer thread as
+  // soon as its tiles are done
+  int const bandHeight = 4*FrameBuffer::tileSize;
+  for (int y0 = 0; y0 < height; y0 += bandHeight) {
+    int const rowCount = std::min(bandHeight, height-y0);
+    FrameBuffer band(width, rowCount);
+    TileScheduler const scheduler(width, rowCount, FrameBuffer::tileSize);
+    scheduler.run([&](TileScheduler::Tile const& bandTile) {
+      TileScheduler::Tile tile = bandTile;
+      tile.y0 += y0;
+      tile.y1 += y0;
+      this->renderTile(scene, camera, width, height, tile, &band, y0);
+    });
+    stream.write(y0, std::move(band));
+    bar.progress(static_cast<float>(y0+rowCount)/height);
   }
+  bool const success = stream.close();
 
   // Stop timer and progressbar
   timer.end();
   bar.end();
   std::cout << "(SimpleRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
 
-  return image;
+  return success;
+}
+
+void SimpleRenderer::renderTile(Scene const& scene, Camera const& camera,
+                                int width, int height, TileScheduler::Tile const& tile,
+                                FrameBuffer * frame, int y0) const {
+  float const aspectRatio = static_cast<float>(height)/width;
+
+  // Primary rays are traced in coherent packets of 4x4 pixels
+  for (int by = tile.y0; by < tile.y1; by += 4) {
+    for (int bx = tile.x0; bx < tile.x1; bx += 4) {
+      int count = 0;
+      int pixelX[RayPacket::size], pixelY[RayPacket::size];
+      float screenX[RayPacket::size], screenY[RayPacket::size];
+      for (int y = by; y < std::min(by+4, tile.y1); ++y) {
+        for (int x = bx; x < std::min(bx+4, tile.x1); ++x) {
+          pixelX[count] = x;
+          pixelY[count] = y - y0;
+          screenX[count] = static_cast<float>(x)/width*2-1;
+          screenY[count++] = (static_cast<float>(y)/height*2-1)*aspectRatio;
+        }
+      }
+
+      RayPacket packet;
+      camera.castPacket(count, screenX, screenY, 2.0f/width, 2.0f/height*aspectRatio, &packet);
+      RayPacket::Mask const hits = scene.findIntersections(&packet);
+
+      // The extra channels describe the first hit, before shading sends
+      // the rays on
+      if (frame->channels() & ~FrameBuffer::COLOR) {
+        for (int i = 0; i < count; ++i) {
+          Ray const& ray = packet.rays[i];
+          bool const hit = hits >> i & 1;
+          if (frame->hasChannel(FrameBuffer::DEPTH))
+            frame->setDepth(pixelX[i], pixelY[i], hit ? ray.length : INFINITY);
+          if (frame->hasChannel(FrameBuffer::NORMAL))
+            frame->setNormal(pixelX[i], pixelY[i], hit ? ray.primitive->normalFromRay(ray) : Vector3d());
+          if (frame->hasChannel(FrameBuffer::ALBEDO))
+            frame->setAlbedo(pixelX[i], pixelY[i], hit ? ray.primitive->shader()->albedo(ray) : Color());
+          if (frame->hasChannel(FrameBuffer::PRIMITIVE_ID))
+            frame->setPrimitiveId(pixelX[i], pixelY[i], FrameBuffer::primitiveIdOf(hit ? ray.primitive : nullptr));
+          if (frame->hasChannel(FrameBuffer::SAMPLE_COUNT))
+            frame->setSampleCount(pixelX[i], pixelY[i], 1.0f);
+        }
+      }
+
+      if (frame->hasChannel(FrameBuffer::COLOR)) {
+        Color colors[RayPacket::size];
+        scene.shadePacket(&packet, hits, colors);
+        for (int i = 0; i < count; ++i)
+          frame->setColor(pixelX[i], pixelY[i], colors[i]);
+      }
+    }
+  }
 }
@@ -2,6 +2,7 @@
 #define SIMPLERENDERER_H
 
 #include "renderer/renderer.h"
+#include "common/tilescheduler.h"
 
 class SimpleRenderer : public Renderer {
 
@@ -10,10 +11,34 @@ public:
   SimpleRenderer() {}
   virtual ~SimpleRenderer() {}
 
+  // Get
+  virtual int supportedChannels() const {
+    return FrameBuffer::COLOR | FrameBuffer::DEPTH | FrameBuffer::NORMAL
+        | FrameBuffer::ALBEDO | FrameBuffer::PRIMITIVE_ID | FrameBuffer::SAMPLE_COUNT;
+  }
+
   // Render functions
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
+  // Renders bands of a few tile rows and streams each one to the file
+  // while the next is being rendered, so .ppm and .pfm images of any size
+  // fit into memory
+  virtual bool renderToFile(Scene const& scene,
+                            Camera const& camera,
+                            int width, int height,
+                            char const* fileName);
+
+private:
+  // Traces the pixels of a tile into a frame, whose first row is row y0 of
+  // the image
+  void renderTile(Scene const& scene, Camera const& camera,
+                  int width, int height, TileScheduler::Tile const& tile,
+                  FrameBuffer * frame, int y0) const;
 
 };
 
@@ -1,15 +1,31 @@
 #include "renderer/superrenderer.h"
 #include "scene/scene.h"
 #include "camera/camera.h"
+#include "common/pixelestimate.h"
 #include "common/progressbar.h"
+#include "common/raypacket.h"
+#include "common/tilescheduler.h"
 #include "common/benchmark.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
 #include <omp.h>
+#include <vector>
 
 Texture SuperRenderer::renderImage(Scene const& scene,
-                                Camera const& camera,
-                                int width, int height) {
+                                   Camera const& camera,
+                                   int width, int height) {
+  return this->renderFrame(scene, camera, width, height).toTexture();
+}
+
+FrameBuffer SuperRenderer::renderFrame(Scene const& scene,
+                                       Camera const& camera,
+                                       int width, int height,
+                                       int channels) {
   std::cout << "(SuperRenderer): Rendering..." << std::endl;
 
   // Setup timer and progressbar
@@ -20,37 +36,209 @@ Texture SuperRenderer::renderImage(Scene const& scene,
   timer.start();
 
   // A few helpful constants
-  int const sampleCount = this->superSamplingFactor_*this->superSamplingFactor_;
+  int const maximumSamples = this->superSamplingFactor_*this->superSamplingFactor_;
+  int const initialSamples = this->adaptiveThreshold_ > 0.0f && this->shadingRate_ <= 0
+      ? std::max(std::min(this->initialSamples_, maximumSamples), 1) : maximumSamples;
   float const samplingStep = 1.0f/this->superSamplingFactor_;
-
-  // The usual render loop
-  Texture image(width, height);
   float const aspectRatio = static_cast<float>(height)/width;
-  for (int x = 0; x < image.width(); ++x) {
-
-    // Peform for-statement on seperate threads
-    #pragma omp parallel for
-    for (int y = 0; y < image.height(); ++y) {
-      // The fragment color is averaged over all sub-pixel rays
-      Color fragmentColor;
-      for (int xs = 0; xs < this->superSamplingFactor_; ++xs) {
-
-        for (int ys = 0; ys < this->superSamplingFactor_; ++ys) {
-          Ray ray = camera.castRay(((xs* (samplingStep + rand()/RAND_MAX / this->superSamplingFactor_ ) + x)/width*2-1),
-                                   ((ys* (samplingStep + rand()/RAND_MAX / this->superSamplingFactor_ ) + y)/height*2-1)*aspectRatio);
-          fragmentColor += scene.traceRay(&ray);
+
+  // Trace sub-pixel rays until a pixel has the given number of samples
+  std::vector<PixelEstimate> estimates(width*height);
+  auto sample = [&](int x, int y, int count) {
+    PixelEstimate & estimate = estimates[y*width + x];
+    for (int i = estimate.count; i < count; ++i) {
+      Vector2d const offset = this->sampler_.sample(x, y, i, maximumSamples);
+      Ray ray = camera.castDifferentialRay(((x + offset.u)/width*2-1),
+                                           ((y + offset.v)/height*2-1)*aspectRatio,
+                                           2.0f*samplingStep/width, 2.0f*samplingStep/height*aspectRatio);
+      estimate.add(scene.traceRay(&ray));
+    }
+  };
+
+  // Decoupled shading: all sub-pixel rays find their hits, but the hits on
+  // the same primitive in the same cell of the shading grid are shaded only
+  // once, at the sample nearest to their centroid, and that color counts for
+  // all of them. Shading takes the differentials of a cell, so textures are
+  // filtered over it.
+  int const shadingRate = std::min(this->shadingRate_, this->superSamplingFactor_);
+  long shadedSamples = 0;
+  // The sub-pixel samples of a pixel, the buffers are allocated once per tile
+  struct Samples {
+    std::vector<Ray> rays;
+    std::vector<Vector2d> offsets;
+    std::vector<Color> colors;
+    std::vector<int> cells;
+    std::vector<char> shaded;
+    std::vector<int> missIndices;
+    std::vector<Vector3d> missDirections;
+    std::vector<Color> missColors;
+
+    explicit Samples(int count)
+      : rays(count), offsets(count), colors(count), cells(count), shaded(count),
+        missIndices(count), missDirections(count), missColors(count) {}
+  };
+  auto sampleDecoupled = [&](int x, int y, Samples & samples) {
+    std::vector<Ray> & rays = samples.rays;
+    std::vector<Vector2d> & offsets = samples.offsets;
+    std::vector<Color> & colors = samples.colors;
+    std::vector<int> & cells = samples.cells;
+    std::vector<char> & shaded = samples.shaded;
+    std::fill(shaded.begin(), shaded.end(), false);
+
+    // Visibility, a packet of sub-pixel rays at a time
+    int missCount = 0;
+    std::vector<int> & missIndices = samples.missIndices;
+    std::vector<Vector3d> & missDirections = samples.missDirections;
+    for (int first = 0; first < maximumSamples; first += RayPacket::size) {
+      int const count = std::min(maximumSamples - first, static_cast<int>(RayPacket::size));
+      float screenX[RayPacket::size], screenY[RayPacket::size];
+      for (int i = 0; i < count; ++i) {
+        offsets[first+i] = this->sampler_.sample(x, y, first+i, maximumSamples);
+        screenX[i] = (x + offsets[first+i].u)/width*2-1;
+        screenY[i] = ((y + offsets[first+i].v)/height*2-1)*aspectRatio;
+        cells[first+i] = std::min(static_cast<int>(offsets[first+i].v*shadingRate), shadingRate-1)*shadingRate
+            + std::min(static_cast<int>(offsets[first+i].u*shadingRate), shadingRate-1);
+      }
+      RayPacket packet;
+      camera.castPacket(count, screenX, screenY, 2.0f/(width*shadingRate),
+                        2.0f/(height*shadingRate)*aspectRatio, &packet);
+      RayPacket::Mask const hits = scene.findIntersections(&packet);
+      for (int i = 0; i < count; ++i) {
+        rays[first+i] = packet.rays[i];
+        if (!(hits >> i & 1)) {
+          shaded[first+i] = true;
+          missIndices[missCount] = first+i;
+          missDirections[missCount++] = packet.rays[i].direction;
+        }
+      }
+    }
+
+    // Shading, once for every primitive that was hit in a cell
+    long pixelShaded = 0;
+    for (int i = 0; i < maximumSamples; ++i) {
+      if (shaded[i])
+        continue;
+      Ray const& ray = rays[i];
+      auto const samePrimitive = [&](int j) {
+        return !shaded[j] && cells[j] == cells[i] && rays[j].primitive == ray.primitive
+            && rays[j].instancedPrimitive == ray.instancedPrimitive;
+      };
+      Vector2d centroid;
+      int coverage = 0;
+      for (int j = i; j < maximumSamples; ++j) {
+        if (samePrimitive(j)) {
+          centroid += offsets[j];
+          ++coverage;
+        }
+      }
+      centroid /= static_cast<float>(coverage);
+      int nearest = i;
+      for (int j = i+1; j < maximumSamples; ++j) {
+        if (samePrimitive(j)
+            && length(offsets[j] - centroid) < length(offsets[nearest] - centroid))
+          nearest = j;
+      }
+
+      Ray shadingRay = rays[nearest];
+      Color const color = shadingRay.remainingBounces-- > 0
+          ? shadingRay.primitive->shader()->shade(&shadingRay)
+          : scene.environmentColor(shadingRay.direction);
+      for (int j = maximumSamples-1; j >= i; --j) {
+        if (samePrimitive(j)) {
+          colors[j] = color;
+          shaded[j] = true;
         }
       }
-      image.setPixelAt(x, y, clamped(fragmentColor/sampleCount));
+      ++pixelShaded;
+    }
+
+    // The environment of the misses is looked up together
+    if (missCount > 0) {
+      scene.environmentColors(missCount, missDirections.data(), samples.missColors.data());
+      for (int i = 0; i < missCount; ++i)
+        colors[missIndices[i]] = samples.missColors[i];
+    }
+
+    PixelEstimate & estimate = estimates[y*width + x];
+    for (int i = 0; i < maximumSamples; ++i)
+      estimate.add(colors[i]);
+    #pragma omp atomic
+    shadedSamples += pixelShaded;
+  };
+
+  // First pass: a few samples for every pixel
+  TileScheduler const scheduler(width, height, FrameBuffer::tileSize);
+  scheduler.run([&](TileScheduler::Tile const& tile) {
+    Samples samples(shadingRate > 0 ? maximumSamples : 0);
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        if (shadingRate > 0)
+          sampleDecoupled(x, y, samples);
+        else
+          sample(x, y, initialSamples);
+      }
     }
+  }, initialSamples < maximumSamples ? nullptr : &bar);
 
-    bar.progress((float)(x) / width);
+  // Second pass: refine the pixels that are noisy or differ from their
+  // neighbors (which catches edges all first samples missed), doubling the
+  // samples until the error is small enough
+  if (initialSamples < maximumSamples) {
+    std::vector<float> luminance(width*height);
+    for (int i = 0; i < width*height; ++i)
+      luminance[i] = estimates[i].luminance();
+
+    scheduler.run([&](TileScheduler::Tile const& tile) {
+      for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+          float const center = luminance[y*width + x];
+          float contrast = 0.0f;
+          if (x > 0)
+            contrast = std::max(contrast, std::fabs(center - luminance[y*width + x-1]));
+          if (x < width-1)
+            contrast = std::max(contrast, std::fabs(center - luminance[y*width + x+1]));
+          if (y > 0)
+            contrast = std::max(contrast, std::fabs(center - luminance[(y-1)*width + x]));
+          if (y < height-1)
+            contrast = std::max(contrast, std::fabs(center - luminance[(y+1)*width + x]));
+
+          PixelEstimate const& estimate = estimates[y*width + x];
+          if (contrast <= this->contrastThreshold_ && estimate.error() <= this->adaptiveThreshold_)
+            continue;
+          do {
+            sample(x, y, std::min(2*estimate.count, maximumSamples));
+          } while (estimate.count < maximumSamples && estimate.error() > this->adaptiveThreshold_);
+        }
+      }
+    }, &bar);
+  }
+
+  // Resolve the image and the sample count map
+  FrameBuffer frame(width, height, channels | FrameBuffer::COLOR);
+  this->sampleCountMap_ = Texture(width, height);
+  long totalSamples = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      PixelEstimate const& estimate = estimates[y*width + x];
+      frame.setColor(x, y, estimate.sum/estimate.count);
+      if (frame.hasChannel(FrameBuffer::SAMPLE_COUNT))
+        frame.setSampleCount(x, y, estimate.count);
+      if (frame.hasChannel(FrameBuffer::VARIANCE))
+        frame.setVariance(x, y, estimate.error()*estimate.error());
+      this->sampleCountMap_.setPixelAt(x, y, Color(1,1,1)*(static_cast<float>(estimate.count)/maximumSamples));
+      totalSamples += estimate.count;
+    }
   }
 
   // Stop timer and progressbar
   timer.end();
   bar.end();
   std::cout << "(SuperRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+  printf("(SuperRenderer): %.2f samples per pixel on average (at most %d)\n",
+         static_cast<float>(totalSamples)/(width*height), maximumSamples);
+  if (shadingRate > 0)
+    printf("(SuperRenderer): %.2f shaded samples per pixel on average\n",
+           static_cast<float>(shadedSamples)/(width*height));
 
-  return image;
+  return frame;
 }
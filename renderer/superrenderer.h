@@ -2,28 +2,69 @@
 #define SUPERRENDERER_H
 
 #include "renderer/renderer.h"
+#include "common/sampler.h"
 
 class SuperRenderer : public Renderer {
 
 public:
   // Constructor / Destructor
-  SuperRenderer() {}
+  SuperRenderer()
+    : superSamplingFactor_(4), initialSamples_(4), adaptiveThreshold_(0.005f),
+      contrastThreshold_(0.05f), shadingRate_(0) {}
   virtual ~SuperRenderer() {}
 
   // Get
   int superSamplingFactor() { return this->superSamplingFactor_; }
+  Sampler const& sampler() { return this->sampler_; }
+  int initialSamples() { return this->initialSamples_; }
+  float adaptiveThreshold() { return this->adaptiveThreshold_; }
+  float contrastThreshold() { return this->contrastThreshold_; }
+  int shadingRate() { return this->shadingRate_; }
+  // Samples per pixel of the last image, relative to the maximum
+  Texture const& sampleCountMap() { return this->sampleCountMap_; }
+  virtual int supportedChannels() const {
+    return FrameBuffer::COLOR | FrameBuffer::SAMPLE_COUNT | FrameBuffer::VARIANCE;
+  }
 
   // Set
   void setSuperSamplingFactor(int factor) { this->superSamplingFactor_ = factor; }
+  void setSampler(Sampler const& sampler) { this->sampler_ = sampler; }
+  // Adaptive sampling: every pixel starts with a few samples. Pixels whose
+  // standard error (of the luminance) is above the threshold, or that differ
+  // from a neighbor by more than the contrast threshold, get more samples,
+  // up to the square of the super sampling factor. A threshold of 0 always
+  // takes all samples.
+  void setInitialSamples(int count) { this->initialSamples_ = count; }
+  void setAdaptiveThreshold(float threshold) { this->adaptiveThreshold_ = threshold; }
+  void setContrastThreshold(float threshold) { this->contrastThreshold_ = threshold; }
+  // Decoupled shading (like MSAA): every pixel takes all sub-pixel rays for
+  // visibility, but shades every primitive they hit only once in each cell
+  // of a rate x rate grid over the pixel. Edges stay antialiased, while flat
+  // regions cost about rate^2 shaded samples per pixel. Shading that varies
+  // on one primitive inside a cell (e.g. sharp reflections or shadow edges)
+  // is not supersampled then, and the adaptive thresholds are not used.
+  // A rate of 0 shades every sample.
+  void setShadingRate(int rate) { this->shadingRate_ = rate; }
 
   // Render functions
   virtual Texture renderImage(Scene const& scene,
                               Camera const& camera,
                               int width, int height);
+  // Produces the color, the sample count and the variance channels
+  virtual FrameBuffer renderFrame(Scene const& scene,
+                                  Camera const& camera,
+                                  int width, int height,
+                                  int channels = FrameBuffer::COLOR);
 
 
 private:
   int superSamplingFactor_;
+  Sampler sampler_;
+  int initialSamples_;
+  float adaptiveThreshold_;
+  float contrastThreshold_;
+  int shadingRate_;
+  Texture sampleCountMap_;
 
 };
 
@@ -0,0 +1,282 @@
+#include "renderer/wavefrontrenderer.h"
+#include "scene/scene.h"
+#include "camera/camera.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
+#include "common/progressbar.h"
+#include "common/raypacket.h"
+#include "common/benchmark.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <unordered_map>
+
+// Spread the lower 10 bits of a value to every third bit
+static inline uint32_t spreadBits(uint32_t value) {
+  value &= 0x3FF;
+  value = (value | (value << 16)) & 0x030000FF;
+  value = (value | (value << 8)) & 0x0300F00F;
+  value = (value | (value << 4)) & 0x030C30C3;
+  value = (value | (value << 2)) & 0x09249249;
+  return value;
+}
+
+Texture WavefrontRenderer::renderImage(Scene const& scene,
+                                       Camera const& camera,
+                                       int width, int height) {
+  std::cout << "(WavefrontRenderer): Rendering..." << std::endl;
+
+  // Setup timer and progressbar
+  ProgressBar bar(70);
+  bar.start();
+
+  Timer timer;
+  timer.start();
+
+  float const aspectRatio = static_cast<float>(height)/width;
+  ColorBuffer pixels(width*height);
+
+  // The pixels are ordered in blocks of 4x4, so the primary rays of a block
+  // form a coherent packet
+  int const blocksPerRow = (width+3)/4;
+  int const blockCount = blocksPerRow*((height+3)/4);
+  int const blocksPerBatch = std::max(this->batchSize_/RayPacket::size, 1);
+  std::vector<DepthStatistics> statistics;
+  for (int firstBlock = 0; firstBlock < blockCount; firstBlock += blocksPerBatch) {
+    int const lastBlock = std::min(firstBlock+blocksPerBatch, blockCount);
+
+    // Generate the primary rays, unused slots of the border blocks are
+    // removed afterwards
+    Wave wave((lastBlock-firstBlock)*RayPacket::size);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int block = firstBlock; block < lastBlock; ++block) {
+      int const x0 = (block % blocksPerRow)*4;
+      int const y0 = (block / blocksPerRow)*4;
+      int count = 0;
+      int pixel[RayPacket::size];
+      float screenX[RayPacket::size], screenY[RayPacket::size];
+      for (int y = y0; y < std::min(y0+4, height); ++y) {
+        for (int x = x0; x < std::min(x0+4, width); ++x) {
+          pixel[count] = y*width + x;
+          screenX[count] = static_cast<float>(x)/width*2-1;
+          screenY[count++] = (static_cast<float>(y)/height*2-1)*aspectRatio;
+        }
+      }
+
+      RayPacket packet;
+      camera.castPacket(count, screenX, screenY, 2.0f/width, 2.0f/height*aspectRatio, &packet);
+      WaveRay * const waveRays = &wave[(block-firstBlock)*RayPacket::size];
+      for (int i = 0; i < RayPacket::size; ++i) {
+        waveRays[i].ray = packet.rays[i];
+        waveRays[i].weight = Color(1,1,1);
+        waveRays[i].pixel = i < count ? pixel[i] : -1;
+      }
+    }
+    wave.erase(std::remove_if(wave.begin(), wave.end(),
+                              [](WaveRay const& waveRay) { return waveRay.pixel < 0; }),
+               wave.end());
+
+    // Trace the waves until no secondary rays are left
+    for (unsigned int depth = 0; !wave.empty(); ++depth) {
+      if (statistics.size() <= depth)
+        statistics.push_back(DepthStatistics{0, 0, 0, 0});
+      DepthStatistics & depthStatistics = statistics[depth];
+      depthStatistics.rays += wave.size();
+      Timer stageTimer;
+
+      if (depth > 0 && this->reorderSecondaryRays_) {
+        stageTimer.start();
+        this->reorder(&wave);
+        stageTimer.end();
+        depthStatistics.reorderTime += stageTimer.getMicroseconds().count()/1000.0f;
+      }
+
+      std::vector<unsigned char> hits;
+      stageTimer.start();
+      this->intersect(scene, &wave, &hits);
+      stageTimer.end();
+      depthStatistics.intersectTime += stageTimer.getMicroseconds().count()/1000.0f;
+
+      stageTimer.start();
+      wave = this->shade(scene, &wave, hits, &pixels);
+      stageTimer.end();
+      depthStatistics.shadeTime += stageTimer.getMicroseconds().count()/1000.0f;
+    }
+
+    bar.progress(static_cast<float>(lastBlock)/blockCount);
+  }
+
+  // Write the image
+  Texture image(width, height);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      image.setPixelAt(x, y, clamped(pixels[y*width + x]));
+
+  // Stop timer and progressbar
+  timer.end();
+  bar.end();
+  for (unsigned int depth = 0; depth < statistics.size(); ++depth)
+    printf("(WavefrontRenderer): Depth %u: %ld rays, reorder %.1f ms, intersect %.1f ms, shade %.1f ms\n",
+           depth, statistics[depth].rays, statistics[depth].reorderTime,
+           statistics[depth].intersectTime, statistics[depth].shadeTime);
+  std::cout << "(WavefrontRenderer): Rendering time: " << timer.getMilliseconds().count() << " milliseconds." << std::endl;
+
+  return image;
+}
+
+void WavefrontRenderer::reorder(Wave * wave) const {
+  // Bounds of the ray origins
+  int const rayCount = wave->size();
+  Vector3d minimumOrigin(INFINITY, INFINITY, INFINITY), maximumOrigin(-INFINITY, -INFINITY, -INFINITY);
+  for (int i = 0; i < rayCount; ++i) {
+    minimumOrigin = minimum(minimumOrigin, (*wave)[i].ray.origin);
+    maximumOrigin = maximum(maximumOrigin, (*wave)[i].ray.origin);
+  }
+  Vector3d const extent = maximumOrigin - minimumOrigin;
+  Vector3d const scale(extent.x > 0 ? 1023.0f/extent.x : 0.0f,
+                       extent.y > 0 ? 1023.0f/extent.y : 0.0f,
+                       extent.z > 0 ? 1023.0f/extent.z : 0.0f);
+
+  // Sort the rays by direction octant first, so the rays of a packet visit
+  // the kd-tree nodes in the same order, and then along the Morton curve of
+  // their origins in a 1024^3 grid
+  std::vector<std::pair<uint64_t, int> > keys(rayCount);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < rayCount; ++i) {
+    Ray const& ray = (*wave)[i].ray;
+    Vector3d const cell = componentProduct(ray.origin - minimumOrigin, scale);
+    uint64_t const octant = (ray.direction.x < 0 ? 1 : 0)
+        | (ray.direction.y < 0 ? 2 : 0) | (ray.direction.z < 0 ? 4 : 0);
+    uint32_t const morton = spreadBits(static_cast<uint32_t>(cell.x))
+        | spreadBits(static_cast<uint32_t>(cell.y)) << 1
+        | spreadBits(static_cast<uint32_t>(cell.z)) << 2;
+    keys[i] = std::make_pair(octant << 30 | morton, i);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  // Move the rays, each one keeps its pixel
+  Wave sorted(rayCount);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < rayCount; ++i)
+    sorted[i] = (*wave)[keys[i].second];
+  wave->swap(sorted);
+}
+
+void WavefrontRenderer::intersect(Scene const& scene, Wave * wave,
+                                  std::vector<unsigned char> * hits) const {
+  // Consecutive rays are intersected as packets, which pays off as long as
+  // they are coherent and costs little if they are not
+  int const rayCount = wave->size();
+  int const packetCount = (rayCount+RayPacket::size-1)/RayPacket::size;
+  hits->assign(rayCount, 0);
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int p = 0; p < packetCount; ++p) {
+    int const first = p*RayPacket::size;
+    RayPacket packet;
+    packet.count = std::min(RayPacket::size, rayCount-first);
+    for (int i = 0; i < packet.count; ++i)
+      packet.rays[i] = (*wave)[first+i].ray;
+    packet.update();
+
+    RayPacket::Mask const packetHits = scene.findIntersections(&packet);
+    for (int i = 0; i < packet.count; ++i) {
+      if (packetHits >> i & 1) {
+        Ray & ray = (*wave)[first+i].ray;
+        ray.length = packet.rays[i].length;
+        ray.primitive = packet.rays[i].primitive;
+        ray.instancedPrimitive = packet.rays[i].instancedPrimitive;
+        ray.surfacePosition = packet.rays[i].surfacePosition;
+        (*hits)[first+i] = 1;
+      }
+    }
+  }
+}
+
+WavefrontRenderer::Wave WavefrontRenderer::shade(Scene const& scene, Wave * wave,
+                                                 std::vector<unsigned char> const& hits,
+                                                 ColorBuffer * pixels) const {
+  int const rayCount = wave->size();
+  ColorBuffer colors(rayCount);
+
+  // Queue the hits by shader, shaders that were not added to the scene share
+  // the last queue. Rays that leave the scene or have no bounces left see the
+  // environment.
+  std::vector<Shader*> const& shaders = scene.shaders();
+  std::unordered_map<Shader const*, int> shaderIndex;
+  for (unsigned int i = 0; i < shaders.size(); ++i)
+    shaderIndex[shaders[i]] = i;
+  int const queueCount = shaders.size()+1;
+
+  std::vector<int> rayQueue(rayCount), queueStart(queueCount+1, 0);
+  std::vector<int> misses;
+  for (int i = 0; i < rayCount; ++i) {
+    Ray & ray = (*wave)[i].ray;
+    if (hits[i] && ray.remainingBounces-- > 0) {
+      auto const found = shaderIndex.find(ray.primitive->shader());
+      rayQueue[i] = found != shaderIndex.end() ? found->second : queueCount-1;
+      ++queueStart[rayQueue[i]+1];
+    } else {
+      rayQueue[i] = -1;
+      misses.push_back(i);
+    }
+  }
+  for (int q = 0; q < queueCount; ++q)
+    queueStart[q+1] += queueStart[q];
+  int const shadedCount = queueStart[queueCount];
+  std::vector<int> queued(shadedCount);
+  {
+    std::vector<int> next(queueStart.begin(), queueStart.end()-1);
+    for (int i = 0; i < rayCount; ++i)
+      if (rayQueue[i] >= 0)
+        queued[next[rayQueue[i]]++] = i;
+  }
+
+  // Look up the environment for the misses in batches
+  int const missCount = misses.size();
+  int const batchCount = (missCount+63)/64;
+  #pragma omp parallel for schedule(dynamic, 4)
+  for (int b = 0; b < batchCount; ++b) {
+    int const first = b*64;
+    int const count = std::min(64, missCount-first);
+    Vector3d directions[64];
+    Color environment[64];
+    for (int i = 0; i < count; ++i)
+      directions[i] = (*wave)[misses[first+i]].ray.direction;
+    scene.environmentColors(count, directions, environment);
+    for (int i = 0; i < count; ++i)
+      colors[misses[first+i]] = environment[i];
+  }
+
+  // Shade the queues one after another, every shader runs on a coherent
+  // stream of hits
+  int const maximumSecondaryRays = Shader::maximumSecondaryRays;
+  std::vector<SecondaryRay, AlignedAllocator<SecondaryRay> > secondaryRays(shadedCount*maximumSecondaryRays);
+  std::vector<int> secondaryCounts(shadedCount, 0);
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int k = 0; k < shadedCount; ++k) {
+    Ray * ray = &(*wave)[queued[k]].ray;
+    colors[queued[k]] = ray->primitive->shader()->shadeDeferred(
+          ray, &secondaryRays[k*maximumSecondaryRays], &secondaryCounts[k]);
+  }
+
+  // Add the colors to the pixels and collect the next wave. Everything is
+  // done in a fixed order, so the image does not depend on the threads.
+  for (int i = 0; i < rayCount; ++i)
+    (*pixels)[(*wave)[i].pixel] += (*wave)[i].weight*colors[i];
+  Wave nextWave;
+  for (int k = 0; k < shadedCount; ++k) {
+    WaveRay const& parent = (*wave)[queued[k]];
+    for (int s = 0; s < secondaryCounts[k]; ++s) {
+      SecondaryRay const& secondary = secondaryRays[k*maximumSecondaryRays+s];
+      WaveRay waveRay;
+      waveRay.ray = secondary.ray;
+      waveRay.weight = parent.weight*secondary.weight;
+      waveRay.pixel = parent.pixel;
+      nextWave.push_back(waveRay);
+    }
+  }
+  return nextWave;
+}
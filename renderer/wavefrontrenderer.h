@@ -0,0 +1,66 @@
+#ifndef WAVEFRONTRENDERER_H
+#define WAVEFRONTRENDERER_H
+
+#include <vector>
+#include "renderer/renderer.h"
+#include "common/alignedallocator.h"
+#include "common/color.h"
+#include "common/ray.h"
+
+// Renders breadth first instead of path by path: the primary rays of a large
+// batch of pixels are intersected together, the hits are sorted by shader and
+// shaded in coherent runs (see Shader::shadeDeferred), and the secondary rays
+// they spawn form the next wave. Shadow rays are still traced by the lights
+// while shading. Secondary rays are reordered by origin and direction before
+// they are intersected, which makes the packets of the later waves coherent
+// again.
+class WavefrontRenderer : public Renderer {
+
+public:
+  // Constructor / Destructor
+  WavefrontRenderer() : batchSize_(1 << 16), reorderSecondaryRays_(true) {}
+  virtual ~WavefrontRenderer() {}
+
+  // Get
+  int batchSize() { return this->batchSize_; }
+  bool reorderSecondaryRays() { return this->reorderSecondaryRays_; }
+
+  // Set
+  // Number of pixels whose primary rays form one wave
+  void setBatchSize(int size) { this->batchSize_ = size; }
+  void setReorderSecondaryRays(bool reorder) { this->reorderSecondaryRays_ = reorder; }
+
+  // Render functions
+  virtual Texture renderImage(Scene const& scene,
+                              Camera const& camera,
+                              int width, int height);
+
+protected:
+  // A ray of a wave, which adds weight times its color to a pixel
+  struct WaveRay {
+    Ray ray;
+    Color weight;
+    int pixel;
+  };
+  typedef std::vector<WaveRay, AlignedAllocator<WaveRay> > Wave;
+  typedef std::vector<Color, AlignedAllocator<Color> > ColorBuffer;
+
+  // Time spent on the waves of one bounce depth
+  struct DepthStatistics {
+    long rays;
+    float reorderTime, intersectTime, shadeTime; // milliseconds
+  };
+
+  // Stages of a wave
+  void reorder(Wave * wave) const;
+  void intersect(Scene const& scene, Wave * wave, std::vector<unsigned char> * hits) const;
+  Wave shade(Scene const& scene, Wave * wave, std::vector<unsigned char> const& hits,
+             ColorBuffer * pixels) const;
+
+private:
+  int batchSize_;
+  bool reorderSecondaryRays_;
+
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include "scene/animation.h"
+#include "camera/perspectivecamera.h"
+#include "common/benchmark.h"
+#include "common/imagewriter.h"
+#include "primitive/instance.h"
+#include "renderer/renderer.h"
+#include "scene/scene.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+void Animation::animate(Track<float> const& track, std::function<void(float)> const& setter) {
+  this->duration_ = std::max(this->duration_, track.duration());
+  this->updates_.push_back([track, setter](float time) { setter(track.value(time)); });
+}
+
+void Animation::animate(Track<Vector3d> const& track,
+                        std::function<void(Vector3d const&)> const& setter) {
+  this->duration_ = std::max(this->duration_, track.duration());
+  this->updates_.push_back([track, setter](float time) { setter(track.value(time)); });
+}
+
+void Animation::animateCamera(PerspectiveCamera * camera,
+                              Track<Vector3d> const& position, Track<Vector3d> const& target) {
+  this->duration_ = std::max(this->duration_, std::max(position.duration(), target.duration()));
+  this->updates_.push_back([camera, position, target](float time) {
+    Vector3d const eye = position.value(time);
+    camera->setPosition(eye);
+    camera->setForwardDirection(target.value(time) - eye);
+  });
+}
+
+void Animation::animateInstance(Instance * instance, Track<Vector3d> const& translation,
+                                Track<Vector3d> const& rotation, Track<float> const& scale) {
+  this->duration_ = std::max(this->duration_, std::max(translation.duration(),
+                                                       std::max(rotation.duration(), scale.duration())));
+  Transform const initial = instance->transform();
+  this->updates_.push_back([instance, initial, translation, rotation, scale](float time) {
+    instance->setTransform(Transform(
+        translation.isEmpty() ? initial.translation() : translation.value(time),
+        rotation.isEmpty() ? initial.rotation() : rotation.value(time),
+        scale.isEmpty() ? initial.scale() : scale.value(time)));
+  });
+}
+
+void Animation::apply(float time) const {
+  for (unsigned int i = 0; i < this->updates_.size(); ++i)
+    this->updates_[i](time);
+}
+
+bool Animation::render(Renderer * renderer, Scene & scene, Camera const& camera,
+                       int width, int height, char const* fileNamePattern,
+                       int firstFrame, int lastFrame) const {
+  if (lastFrame < 0)
+    lastFrame = this->frameCount()-1;
+
+  // The writer keeps a few frames, so saving a frame overlaps with
+  // rendering the next one
+  ImageWriter writer;
+  for (int frame = firstFrame; frame <= lastFrame; ++frame) {
+    std::cout << "(Animation): Frame " << frame << " of " << firstFrame << "-" << lastFrame << std::endl;
+    Timer timer;
+    timer.start();
+    this->apply(frame/this->frameRate_);
+    scene.update();
+    timer.end();
+    std::cout << "(Animation): Scene update time: " << timer.getMicroseconds().count()/1000.0f << " milliseconds." << std::endl;
+
+    std::string fileName(std::snprintf(nullptr, 0, fileNamePattern, frame)+1, '\0');
+    std::snprintf(&fileName[0], fileName.size(), fileNamePattern, frame);
+    fileName.resize(fileName.size()-1);
+    writer.save(renderer->renderImage(scene, camera, width, height), fileName);
+  }
+  return writer.wait();
+}
@@ -0,0 +1,102 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "common/vector3d.h"
+
+// Forward declarations
+class Camera;
+class Instance;
+class PerspectiveCamera;
+class Renderer;
+class Scene;
+
+// Keyframed changes of a scene, which render a sequence of frames from one
+// loaded scene. Objects are moved through their setters, so nothing is
+// loaded again, and moving objects should be Instances, which keep the
+// acceleration structures of their primitives.
+// Note: The animated objects must outlive the animation.
+class Animation {
+
+public:
+  // Keyframed value, interpolated linearly between the keys and held before
+  // the first and after the last one
+  template <typename T>
+  class Track {
+
+  public:
+    void add(float time, T const& value) {
+      auto const position = std::upper_bound(this->keys_.begin(), this->keys_.end(), time,
+          [](float time, std::pair<float, T> const& key) { return time < key.first; });
+      this->keys_.insert(position, std::make_pair(time, value));
+    }
+    bool isEmpty() const { return this->keys_.empty(); }
+    float duration() const { return this->keys_.empty() ? 0.0f : this->keys_.back().first; }
+    T value(float time) const {
+      if (this->keys_.empty())
+        return T();
+      if (time <= this->keys_.front().first)
+        return this->keys_.front().second;
+      if (time >= this->keys_.back().first)
+        return this->keys_.back().second;
+      auto const next = std::upper_bound(this->keys_.begin(), this->keys_.end(), time,
+          [](float time, std::pair<float, T> const& key) { return time < key.first; });
+      auto const previous = next-1;
+      float const ratio = (time - previous->first)/(next->first - previous->first);
+      return previous->second + (next->second - previous->second)*ratio;
+    }
+
+  private:
+    std::vector<std::pair<float, T> > keys_;
+
+  };
+
+  // Constructor
+  Animation(float frameRate = 25.0f) : frameRate_(frameRate), duration_(0.0f) {}
+
+  // Get
+  float frameRate() const { return this->frameRate_; }
+  float duration() const { return this->duration_; }
+  int frameCount() const { return static_cast<int>(std::floor(this->duration_*this->frameRate_)) + 1; }
+
+  // Set
+  void setFrameRate(float frameRate) { this->frameRate_ = frameRate; }
+
+  // Setup functions
+  // Generic tracks, e.g. for lights:
+  //   animation.animate(track, [light](Vector3d const& p) { light->setPosition(p); });
+  void animate(Track<float> const& track, std::function<void(float)> const& setter);
+  void animate(Track<Vector3d> const& track, std::function<void(Vector3d const&)> const& setter);
+  // Camera looking from a position at a target
+  void animateCamera(PerspectiveCamera * camera,
+                     Track<Vector3d> const& position, Track<Vector3d> const& target);
+  // Transformation of an instance (see Transform), empty tracks keep the
+  // current translation, rotation or scale
+  void animateInstance(Instance * instance, Track<Vector3d> const& translation,
+                       Track<Vector3d> const& rotation = Track<Vector3d>(),
+                       Track<float> const& scale = Track<float>());
+
+  // Move all animated objects to the given time (in seconds)
+  void apply(float time) const;
+
+  // Render the frames [firstFrame, lastFrame] (all frames by default) into
+  // files named by a printf pattern with the frame number, e.g.
+  // "frame%04d.png". The scene is updated (see Scene::update) after the
+  // objects moved, and each frame is written by an ImageWriter while the
+  // next one is rendered. Returns whether all frames were written.
+  bool render(Renderer * renderer, Scene & scene, Camera const& camera,
+              int width, int height, char const* fileNamePattern,
+              int firstFrame = 0, int lastFrame = -1) const;
+
+private:
+  float frameRate_;
+  float duration_;
+  std::vector<std::function<void(float)> > updates_;
+
+};
+
+#endif
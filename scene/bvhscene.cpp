@@ -0,0 +1,38 @@
+#include "scene/bvhscene.h"
+#include "common/bvh.h"
+#include "primitive/primitive.h"
+#include "shader/shader.h"
+
+#include <cassert>
+
+BvhScene::BvhScene()
+  : bvh_(nullptr), primitiveCount_(0) {}
+
+BvhScene::~BvhScene() {
+  delete this->bvh_;
+}
+
+void BvhScene::update() {
+  if (!this->bvh_ || this->primitiveCount_ != this->primitives_.size()) {
+    delete this->bvh_;
+    this->bvh_ = new Bvh(this->primitives_);
+    this->primitiveCount_ = this->primitives_.size();
+  } else {
+    this->bvh_->refit();
+  }
+}
+
+bool BvhScene::findIntersection(Ray * ray) const {
+  assert(this->bvh_ && "BvhScene::update() has to be called before rendering");
+  return this->bvh_->intersect(ray);
+}
+
+bool BvhScene::findOcclusion(Ray * ray) const {
+  assert(this->bvh_ && "BvhScene::update() has to be called before rendering");
+  return this->bvh_->intersectOpaque(ray);
+}
+
+RayPacket::Mask BvhScene::findIntersections(RayPacket * packet) const {
+  assert(this->bvh_ && "BvhScene::update() has to be called before rendering");
+  return this->bvh_->intersectPacket(packet, packet->activeMask());
+}
@@ -0,0 +1,33 @@
+#ifndef BVHSCENE_H
+#define BVHSCENE_H
+
+#include "scene/scene.h"
+
+// Forward declarations
+class Bvh;
+
+// Scene with a Bvh over its primitives, for animations where instances and
+// dynamic meshes move every frame. update() builds the tree after
+// primitives were added and refits it after they moved.
+class BvhScene : public Scene {
+
+public:
+  // Constructor / Destructor
+  BvhScene();
+  virtual ~BvhScene();
+
+  // Setup functions
+  virtual void update();
+
+  // Raytracing functions
+  virtual bool findIntersection(Ray * ray) const;
+  virtual bool findOcclusion(Ray * ray) const;
+  virtual RayPacket::Mask findIntersections(RayPacket * packet) const;
+
+private:
+  Bvh * bvh_;
+  unsigned int primitiveCount_; // when the tree was built
+
+};
+
+#endif
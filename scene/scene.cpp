@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -36,18 +37,60 @@ Color Scene::traceRay(Ray * ray) const {
     // If the ray has hit an object, call the shader ...
     return ray->primitive->shader()->shade(ray);
 
-  } else if (!this->environmentMap_.isNull()) {
+  } else {
 
-    // ... otherwise look up the environment map ...
-    float const phi = std::acos(ray->direction.y);
-    float const rho = std::atan2(ray->direction.z, ray->direction.x) + PI;
-    return this->environmentMap_.color(rho/(2*PI), 1.0-phi/PI);
+    // ... otherwise look up the environment
+    return this->environmentColor(ray->direction);
 
-  } else {
+  }
+}
 
-    // ... if all else fails, just return the background color
-    return this->backgroundColor_;
+void Scene::tracePacket(RayPacket * packet, Color * colors) const {
+  this->shadePacket(packet, this->findIntersections(packet), colors);
+}
+
+void Scene::shadePacket(RayPacket * packet, RayPacket::Mask hits, Color * colors) const {
+  // Shade the rays that have hit an object, and collect the others ...
+  int missCount = 0;
+  int missIndices[RayPacket::size];
+  Vector3d missDirections[RayPacket::size];
+  for (int i = 0; i < packet->count; ++i) {
+    Ray & ray = packet->rays[i];
+    if ((hits >> i & 1) && ray.remainingBounces-- > 0) {
+      colors[i] = ray.primitive->shader()->shade(&ray);
+    } else {
+      missIndices[missCount] = i;
+      missDirections[missCount++] = ray.direction;
+    }
+  }
 
+  // ... to look up the environment for all of them at once
+  if (missCount > 0) {
+    Color missColors[RayPacket::size];
+    this->environmentColors(missCount, missDirections, missColors);
+    for (int i = 0; i < missCount; ++i)
+      colors[missIndices[i]] = missColors[i];
   }
 }
 
+RayPacket::Mask Scene::findIntersections(RayPacket * packet) const {
+  RayPacket::Mask hits = 0;
+  for (int i = 0; i < packet->count; ++i)
+    if (this->findIntersection(&packet->rays[i]))
+      hits |= RayPacket::Mask(1) << i;
+  return hits;
+}
+
+Color Scene::environmentColor(Vector3d const& direction) const {
+  // If there is no environment map, just return the background color
+  if (this->environmentMap_.isNull())
+    return this->backgroundColor_;
+  return this->environmentMap_.color(direction);
+}
+
+void Scene::environmentColors(int count, Vector3d const* directions, Color * colors) const {
+  if (this->environmentMap_.isNull())
+    std::fill(colors, colors+count, this->backgroundColor_);
+  else
+    this->environmentMap_.colors(count, directions, colors);
+}
@@ -3,8 +3,9 @@
 
 #include <vector>
 #include "common/color.h"
+#include "common/environmentmap.h"
 #include "common/ray.h"
-#include "common/texture.h"
+#include "common/raypacket.h"
 #include "common/vector3d.h"
 
 // Forward declarations
@@ -20,27 +21,42 @@ public:
   virtual ~Scene();
 
   // Get
-  std::vector<Light*> const& lights() { return this->lights_; }
-  std::vector<Primitive*> const& primitives() { return this->primitives_; }
-  std::vector<Shader*> const& shaders() { return this->shaders_; }
+  std::vector<Light*> const& lights() const { return this->lights_; }
+  std::vector<Primitive*> const& primitives() const { return this->primitives_; }
+  std::vector<Shader*> const& shaders() const { return this->shaders_; }
 
   // Set
   void setBackgroundColor(Color const& color) { this->backgroundColor_ = color; }
-  void setEnvironmentMap(Texture const& map) { this->environmentMap_ = map; }
+  void setEnvironmentMap(Texture const& map) { this->environmentMap_ = EnvironmentMap(map); }
+  void setEnvironmentMap(EnvironmentMap const& map) { this->environmentMap_ = map; }
 
   // Setup functions
   void add(Light * light);
   void add(Primitive * primitive);
   void add(Shader * shader);
+  // Called after primitives were added or moved, so scenes with an
+  // acceleration structure can bring it up to date
+  virtual void update() {}
 
   // Raytracing functions
   Color traceRay(Ray * ray) const;
+  // Trace all rays of a packet, with the intersections found together
+  void tracePacket(RayPacket * packet, Color * colors) const;
+  // Second half of tracePacket, for renderers that look at the hits first
+  void shadePacket(RayPacket * packet, RayPacket::Mask hits, Color * colors) const;
+  // Color of rays leaving the scene, the batched version lets a renderer
+  // collect its misses and look them up together
+  Color environmentColor(Vector3d const& direction) const;
+  void environmentColors(int count, Vector3d const* directions, Color * colors) const;
   virtual bool findIntersection(Ray * ray) const = 0;
   virtual bool findOcclusion(Ray * ray) const = 0;
+  // Returns the rays of the packet that hit something, the default
+  // implementation finds the intersections one by one
+  virtual RayPacket::Mask findIntersections(RayPacket * packet) const;
 
 protected:
   Color backgroundColor_;
-  Texture environmentMap_;
+  EnvironmentMap environmentMap_;
   std::vector<Light*> lights_;
   std::vector<Primitive*> primitives_;
   std::vector<Shader*> shaders_;
@@ -9,6 +9,13 @@ bool SimpleScene::findIntersection(Ray * ray) const {
   return hit;
 }
 
+RayPacket::Mask SimpleScene::findIntersections(RayPacket * packet) const {
+  RayPacket::Mask hits = 0;
+  for (unsigned int i = 0; i < this->primitives_.size(); ++i)
+    hits |= this->primitives_[i]->intersectPacket(packet, packet->activeMask());
+  return hits;
+}
+
 bool SimpleScene::findOcclusion(Ray * ray) const {
   for (unsigned int i = 0; i < this->primitives_.size(); ++i)
     if (this->primitives_[i]->intersect(ray)
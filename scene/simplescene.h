@@ -9,6 +9,7 @@ public:
   // Raytracing functions
   virtual bool findIntersection(Ray * ray) const;
   virtual bool findOcclusion(Ray * ray) const;
+  virtual RayPacket::Mask findIntersections(RayPacket * packet) const;
 
 };
 
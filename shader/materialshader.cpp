@@ -1,5 +1,12 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
 #include "shader/materialshader.h"
+#include "common/texturecache.h"
+#include "common/raydifferentials.h"
 #include "light/light.h"
 #include "primitive/primitive.h"
 #include "scene/scene.h"
@@ -38,16 +45,203 @@ MaterialShader::MaterialShader(Color const& objectColor)
     opacity(1.0f),
     normalCoefficient(1.0f),
     diffuseCoefficient(0.5f),
-    specularCoefficient(0.0f), shininessExponent(10) {}
+    reflectance(0.0f),
+    specularCoefficient(0.0f), shininessExponent(10),
+    compiled(false) {}
+
+// Resample four channels of up to four maps into one texture at the largest
+// of their resolutions, missing maps give default values
+static Texture packMaps(Texture const* maps[4], int const channels[4], float const defaults[4]) {
+  int width = 0, height = 0;
+  for (int i = 0; i < 4; ++i) {
+    width = std::max(width, maps[i]->width());
+    height = std::max(height, maps[i]->height());
+  }
+
+  Texture packed(width, height);
+  #pragma omp parallel for
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float values[4];
+      for (int i = 0; i < 4; ++i) {
+        if (maps[i]->isNull()) {
+          values[i] = defaults[i];
+        } else {
+          Color const color = maps[i]->color((x+0.5f)/width, (y+0.5f)/height);
+          values[i] = channels[i] == 0 ? color.r : channels[i] == 1 ? color.g : color.b;
+        }
+      }
+      packed.setPixelAt(x, y, Color(values[0], values[1], values[2]), values[3]);
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (!maps[i]->isNull()) {
+      packed.setWrapMode(maps[i]->wrapMode());
+      break;
+    }
+  }
+  packed.setLayout(Texture::TILED);
+  packed.generateMipmaps();
+  return packed;
+}
+
+// Same for lazily loaded maps, but the packed texels are written once into
+// a tiled file of the TextureCache, next to the one of the first map, from
+// the mipmaps of the maps. The packed texture is lazily loaded as well.
+static Texture packCachedMaps(Texture const* maps[4], int const channels[4], float const defaults[4]) {
+  int width = 0, height = 0;
+  std::vector<int> sources;
+  std::string key;
+  for (int i = 0; i < 4; ++i) {
+    width = std::max(width, maps[i]->width());
+    height = std::max(height, maps[i]->height());
+    if (!maps[i]->isNull()) {
+      sources.push_back(maps[i]->cacheFile());
+      key += TextureCache::instance().fileName(maps[i]->cacheFile());
+    }
+    key += "|" + std::to_string(channels[i]) + "|" + std::to_string(defaults[i]);
+  }
+
+  // The name tells different combinations of the same maps apart
+  std::string const& first = TextureCache::instance().fileName(sources.front());
+  char hash[17];
+  std::snprintf(hash, sizeof(hash), "%016llx",
+                static_cast<unsigned long long>(std::hash<std::string>()(key)));
+  std::string const tiledFileName = first.substr(0, first.size() - 6) + "." + hash + ".tiles";
+
+  auto const texelAt = [&](int level, int x, int y) {
+    float const u = (x+0.5f)/std::max(width >> level, 1);
+    float const v = (y+0.5f)/std::max(height >> level, 1);
+    float values[4];
+    for (int i = 0; i < 4; ++i) {
+      if (maps[i]->isNull()) {
+        values[i] = defaults[i];
+      } else {
+        // The same footprint in the pyramid of a smaller map
+        float const mapLevel = level + std::log2(static_cast<float>(maps[i]->width())/width);
+        Color const color = maps[i]->color(u, v, mapLevel);
+        values[i] = channels[i] == 0 ? color.r : channels[i] == 1 ? color.g : color.b;
+      }
+    }
+    return Texture::packTexel(_mm_set_ps(values[3], values[2], values[1], values[0]));
+  };
+
+  Texture packed;
+  packed.loadCached(TextureCache::instance().openDerived(tiledFileName, sources, width, height, texelAt));
+  for (int i = 0; i < 4; ++i) {
+    if (!maps[i]->isNull()) {
+      packed.setWrapMode(maps[i]->wrapMode());
+      break;
+    }
+  }
+  return packed;
+}
+
+void MaterialShader::compile() {
+  this->compiled = false;
+  this->surfaceMap = Texture();
+  this->detailMap = Texture();
+
+  Texture const* maps[5] = { &this->diffuseMap, &this->alphaMap, &this->normalMap,
+                             &this->specularMap, &this->reflectionMap };
+  // Lazily loaded maps are packed into a lazily loaded texture
+  int lazyCount = 0, mapCount = 0;
+  for (int i = 0; i < 5; ++i) {
+    lazyCount += maps[i]->isLazy();
+    mapCount += !maps[i]->isNull();
+  }
+  if (lazyCount > 0 && lazyCount < mapCount) {
+    printf("(MaterialShader): Lazily loaded and resident maps are not packed together\n");
+    return;
+  }
+  auto const pack = lazyCount > 0 ? packCachedMaps : packMaps;
+
+  if (!this->diffuseMap.isNull() || !this->alphaMap.isNull()) {
+    Texture const* surface[4] = { &this->diffuseMap, &this->diffuseMap, &this->diffuseMap, &this->alphaMap };
+    int const channels[4] = { 0, 1, 2, 0 };
+    float const defaults[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    this->surfaceMap = pack(surface, channels, defaults);
+  }
+  if (!this->normalMap.isNull() || !this->specularMap.isNull() || !this->reflectionMap.isNull()) {
+    Texture const* detail[4] = { &this->normalMap, &this->normalMap, &this->specularMap, &this->reflectionMap };
+    int const channels[4] = { 0, 1, 0, 0 };
+    float const defaults[4] = { 0.5f, 0.5f, 1.0f, 1.0f };
+    this->detailMap = pack(detail, channels, defaults);
+  }
+
+  // Keep the separate maps if a packed texture could not be written
+  if ((this->surfaceMap.isNull() && (!this->diffuseMap.isNull() || !this->alphaMap.isNull()))
+      || (this->detailMap.isNull() && (!this->normalMap.isNull() || !this->specularMap.isNull()
+                                       || !this->reflectionMap.isNull()))) {
+    printf("(MaterialShader): Maps could not be packed\n");
+    this->surfaceMap = Texture();
+    this->detailMap = Texture();
+    return;
+  }
+  this->compiled = true;
+}
 
 Color MaterialShader::shade(Ray * ray) const {
+  SecondaryRay secondaryRays[maximumSecondaryRays];
+  int secondaryCount;
+  Color fragmentColor = this->shadeDeferred(ray, secondaryRays, &secondaryCount);
+
+  // Trace the alpha and reflection rays right away
+  for (int i = 0; i < secondaryCount; ++i)
+    fragmentColor += secondaryRays[i].weight*this->parentScene_->traceRay(&secondaryRays[i].ray);
+  return fragmentColor;
+}
+
+Color MaterialShader::shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const {
   // Texture coordinates
   Vector2d surfacePosition = ray->primitive->uvFromRay(*ray);
 
   // Normal vector
   Vector3d normal = ray->primitive->normalFromRay(*ray);
+
+  // Footprint of the pixel on the surface and in texture space, the mipmap
+  // level is then chosen by each lookup for the resolution of its map
+  Vector3d positionDx, positionDy;
+  Vector2d uvDx, uvDy;
+  transferDifferentials(*ray, normal, &positionDx, &positionDy);
+  ray->primitive->uvDerivatives(*ray, positionDx, positionDy, &uvDx, &uvDy);
+
+  // Material parameters at the surface position, neutral where there is no map
+  Color diffuseTerm(1,1,1), specularTerm(1,1,1), normalColor;
+  float alphaTerm = this->opacity;
+  float reflectanceTerm = this->reflectance;
+  if (this->compiled) {
+    // One lookup per packed map
+    if (!this->surfaceMap.isNull()) {
+      __m128 const surface = this->surfaceMap.rgba(surfacePosition, uvDx, uvDy);
+      diffuseTerm = Color(_mm_and_ps(surface, Texture::colorMask()));
+      alphaTerm *= _mm_cvtss_f32(_mm_shuffle_ps(surface, surface, _MM_SHUFFLE(3,3,3,3)));
+    }
+    if (!this->detailMap.isNull()) {
+      float detail[4];
+      _mm_storeu_ps(detail, this->detailMap.rgba(surfacePosition, uvDx, uvDy));
+      // The z component of the normal is reconstructed from x and y
+      float const nx = 2.0f*detail[0] - 1.0f;
+      float const ny = 2.0f*detail[1] - 1.0f;
+      normalColor = Color(detail[0], detail[1],
+                          0.5f*(std::sqrt(std::max(1.0f - nx*nx - ny*ny, 0.0f)) + 1.0f));
+      specularTerm = Color(detail[2], detail[2], detail[2]);
+      reflectanceTerm *= detail[3];
+    }
+  } else {
+    if (!this->diffuseMap.isNull())
+      diffuseTerm = this->diffuseMap.color(surfacePosition, uvDx, uvDy);
+    if (!this->alphaMap.isNull())
+      alphaTerm *= this->alphaMap.color(surfacePosition, uvDx, uvDy).r;
+    if (!this->normalMap.isNull())
+      normalColor = this->normalMap.color(surfacePosition, uvDx, uvDy);
+    if (!this->specularMap.isNull())
+      specularTerm = this->specularMap.color(surfacePosition, uvDx, uvDy);
+    if (!this->reflectionMap.isNull())
+      reflectanceTerm *= this->reflectionMap.color(surfacePosition, uvDx, uvDy).r;
+  }
+
   if (!this->normalMap.isNull()) {
-    Color const normalColor = this->normalMap.color(surfacePosition);
     Vector3d const textureNormal = Vector3d(-normalColor.r*2.0f,-normalColor.g*2.0f,normalColor.b) + Vector3d(1,1,0);
     normal = normalInTangentSpace(normal, normalized(textureNormal))
         * this->normalCoefficient + (1.0f-this->normalCoefficient)*normal;
@@ -67,57 +261,63 @@ Color MaterialShader::shade(Ray * ray) const {
     // Diffuse term (lambert)
     Color const diffuseColor = std::max(dotProduct((-1)*illum.direction,normal), 0.0f)
         * this->diffuseCoefficient*illum.color;
-    if (!this->diffuseMap.isNull())
-      fragmentColor += diffuseColor*this->diffuseMap.color(surfacePosition)*this->objectColor;
-    else
-      fragmentColor += diffuseColor*this->objectColor;
+    fragmentColor += diffuseColor*diffuseTerm*this->objectColor;
 
     // Specular term
     float const cosine = dotProduct((-1)*illum.direction,reflection);
     if (cosine > 0) {
       Color const specularColor = std::pow(cosine,shininessExponent)
           * this->specularCoefficient*illum.color;
-      if (!this->specularMap.isNull())
-        fragmentColor += specularColor*this->specularMap.color(surfacePosition);
-      else
-        fragmentColor += specularColor;
+      fragmentColor += specularColor*specularTerm;
     }
 
   }
 
-  // Alpha term (opacity)
-  float alphaTerm = this->opacity;
-  if (!this->alphaMap.isNull())
-    alphaTerm *= this->alphaMap.color(surfacePosition).r;
+  // Alpha term (opacity), the background shows through the surface ...
+  *secondaryCount = 0;
+  float const surfaceWeight = 1.0f - std::max(reflectanceTerm, 0.0f);
   if (alphaTerm < 1) {
-    Ray alphaRay = *ray;
-    alphaRay.origin = ray->origin + (ray->length+EPSILON)*ray->direction;
-    //alphaRay.direction = ... // The direction stays the same
-    alphaRay.length = INFINITY;
-    alphaRay.primitive = nullptr;
-
-    // Mix the foreground and background colors
-    Color const backgroundColor = this->parentScene_->traceRay(&alphaRay);
-    fragmentColor = alphaTerm*fragmentColor + (1-alphaTerm)*backgroundColor;
+    SecondaryRay & alphaRay = secondaryRays[(*secondaryCount)++];
+    alphaRay.ray = *ray;
+    alphaRay.ray.origin = ray->origin + (ray->length+EPSILON)*ray->direction;
+    //alphaRay.ray.direction = ... // The direction stays the same
+    alphaRay.ray.length = INFINITY;
+    alphaRay.ray.primitive = nullptr;
+    alphaRay.ray.originDx = positionDx;
+    alphaRay.ray.originDy = positionDy;
+    alphaRay.weight = Color(1,1,1)*(surfaceWeight*(1-alphaTerm));
+    fragmentColor = alphaTerm*fragmentColor;
   }
 
-  // Reflection
-  float reflectanceTerm = this->reflectance;
-  if (!this->reflectionMap.isNull())
-    reflectanceTerm *= this->reflectionMap.color(surfacePosition).r;
+  // ... and the object color is mixed with the reflection
   if (reflectanceTerm > 0.0f) {
-    Ray reflectionRay = *ray;
-    reflectionRay.origin = ray->origin + (ray->length-EPSILON)*ray->direction;
-    reflectionRay.direction = reflection;
-    reflectionRay.length = INFINITY;
-    reflectionRay.primitive = nullptr;
-
-    // Mix the object and reflection colors
-    Color const reflectionColor = this->parentScene_->traceRay(&reflectionRay);
-    fragmentColor = (1-reflectanceTerm)*fragmentColor + reflectanceTerm*reflectionColor;
+    SecondaryRay & reflectionRay = secondaryRays[(*secondaryCount)++];
+    reflectionRay.ray = *ray;
+    reflectionRay.ray.origin = ray->origin + (ray->length-EPSILON)*ray->direction;
+    reflectionRay.ray.direction = reflection;
+    reflectionRay.ray.length = INFINITY;
+    reflectionRay.ray.primitive = nullptr;
+    reflectDifferentials(&reflectionRay.ray, normal, positionDx, positionDy);
+    reflectionRay.weight = Color(1,1,1)*reflectanceTerm;
   }
 
-  return fragmentColor;
+  return surfaceWeight*fragmentColor;
+}
+
+Color MaterialShader::albedo(Ray const& ray) const {
+  if (this->diffuseMap.isNull())
+    return this->objectColor;
+
+  // Filtered diffuse map at the pixel footprint, like in shadeDeferred()
+  Vector2d const surfacePosition = ray.primitive->uvFromRay(ray);
+  Vector3d positionDx, positionDy;
+  Vector2d uvDx, uvDy;
+  transferDifferentials(ray, ray.primitive->normalFromRay(ray), &positionDx, &positionDy);
+  ray.primitive->uvDerivatives(ray, positionDx, positionDy, &uvDx, &uvDy);
+  Color const diffuseTerm = (this->compiled && !this->surfaceMap.isNull())
+      ? Color(_mm_and_ps(this->surfaceMap.rgba(surfacePosition, uvDx, uvDy), Texture::colorMask()))
+      : this->diffuseMap.color(surfacePosition, uvDx, uvDy);
+  return diffuseTerm*this->objectColor;
 }
 
 bool MaterialShader::isTransparent() const {
@@ -13,24 +13,28 @@ public:
   // Set
   void setAlphaMap(Texture const& alphaMap) {
     this->alphaMap = alphaMap;
+    this->compiled = false;
   }
   void setOpacity(float opacity) {
     this->opacity = opacity;
   }
   void setNormalMap(Texture const& normalMap) {
     this->normalMap = normalMap;
+    this->compiled = false;
   }
   void setNormalCoefficient(float normalCoefficient) {
     this->normalCoefficient = normalCoefficient;
   }
   void setDiffuseMap(Texture const& diffuseMap) {
     this->diffuseMap = diffuseMap;
+    this->compiled = false;
   }
   void setDiffuseCoefficient(float diffuseCoefficient) {
     this->diffuseCoefficient = diffuseCoefficient;
   }
   void setSpecularMap(Texture const& specularMap) {
     this->specularMap = specularMap;
+    this->compiled = false;
   }
   void setSpecularCoefficient(float specularCoefficient) {
     this->specularCoefficient = specularCoefficient;
@@ -40,13 +44,24 @@ public:
   }
   void setReflectionMap(Texture const& reflectionMap) {
     this->reflectionMap = reflectionMap;
+    this->compiled = false;
   }
   void setReflectance(float reflectance) {
     this->reflectance = reflectance;
   }
 
+  // Packs the maps into two textures, diffuse RGB + alpha and normal XY +
+  // specular + reflectance, so that shading needs only two filtered lookups.
+  // Setting a map afterwards falls back to the separate maps.
+  // Note: Specular and reflection maps are packed as gray values. Lazily
+  // loaded maps are packed into a tiled file of the TextureCache, so the
+  // packed maps stay lazy (all maps must be lazily loaded then).
+  void compile();
+
   // Shader functions
   virtual Color shade(Ray * ray) const;
+  virtual Color shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const;
+  virtual Color albedo(Ray const& ray) const;
   virtual bool isTransparent() const;
 
 private:
@@ -68,6 +83,10 @@ private:
   float specularCoefficient;
   float shininessExponent;
 
+  bool compiled;
+  Texture surfaceMap; // diffuse RGB, alpha
+  Texture detailMap;  // normal XY, specular, reflectance
+
 };
 
 #endif
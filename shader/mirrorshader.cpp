@@ -1,24 +1,44 @@
 #include "shader/mirrorshader.h"
+#include "common/raydifferentials.h"
 #include "primitive/primitive.h"
 #include "scene/scene.h"
 
 MirrorShader::MirrorShader() {}
 
 Color MirrorShader::shade(Ray * ray) const {
+  SecondaryRay secondaryRays[maximumSecondaryRays];
+  int secondaryCount;
+  this->shadeDeferred(ray, secondaryRays, &secondaryCount);
+
+  // Send out a new mirrored ray into the scene
+  *ray = secondaryRays[0].ray;
+  return this->parentScene_->traceRay(ray);
+}
+
+Color MirrorShader::shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const {
   // Get the normal of the primitive, which was hit
   Vector3d const normalVector = ray->primitive->normalFromRay(*ray);
 
   // Get the reflection vector
   Vector3d const reflectionVector = ray->direction - 2*dotProduct(normalVector,ray->direction)*normalVector;
 
+  // Carry the pixel footprint along the mirrored ray
+  Ray & mirroredRay = secondaryRays[0].ray;
+  mirroredRay = *ray;
+  Vector3d positionDx, positionDy;
+  transferDifferentials(*ray, normalVector, &positionDx, &positionDy);
+  reflectDifferentials(&mirroredRay, normalVector, positionDx, positionDy);
+
   // Change the ray direction and origin
-  ray->origin = ray->origin + (ray->length-EPSILON)*ray->direction;
-  ray->direction = normalized(reflectionVector);
+  mirroredRay.origin = ray->origin + (ray->length-EPSILON)*ray->direction;
+  mirroredRay.direction = normalized(reflectionVector);
 
   // Reset the ray
-  ray->length = INFINITY;
-  ray->primitive = 0;
+  mirroredRay.length = INFINITY;
+  mirroredRay.primitive = 0;
 
-  // Send out a new mirrored ray into the scene
-  return this->parentScene_->traceRay(ray);
+  // The mirror itself has no color, all of it comes from the mirrored ray
+  secondaryRays[0].weight = Color(1,1,1);
+  *secondaryCount = 1;
+  return Color();
 }
@@ -14,6 +14,7 @@ public:
 
   // Shader functions
   virtual Color shade(Ray * ray) const;
+  virtual Color albedo(Ray const& ray) const { (void)ray; return this->objectColor; }
 
 private:
   Color objectColor;
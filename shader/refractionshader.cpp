@@ -7,6 +7,16 @@ RefractionShader::RefractionShader(double reflectionAttenuation, double indexIns
   :reflectionAttenuation(reflectionAttenuation),indexInside(indexInside),indexOutside(indexOutside){}
 
 Color RefractionShader::shade(Ray * ray) const {
+  SecondaryRay secondaryRays[maximumSecondaryRays];
+  int secondaryCount;
+  this->shadeDeferred(ray, secondaryRays, &secondaryCount);
+
+  // Send out a new refracted ray into the scene
+  *ray = secondaryRays[0].ray;
+  return this->parentScene_->traceRay(ray);
+}
+
+Color RefractionShader::shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const {
   // Get the normal of the primitive which was hit
   Vector3d normalVector = ray->primitive->normalFromRay(*ray);
 
@@ -24,10 +34,12 @@ Color RefractionShader::shade(Ray * ray) const {
   // Calculate t, the new ray direction
   Vector3d t = refractiveIndex * ray->direction + (refractiveIndex * cosineTheta - cosinePhi) * normalVector;
 
-  ray->origin = ray->origin + (ray->length+EPSILON)*ray->direction;
+  Ray & refractedRay = secondaryRays[0].ray;
+  refractedRay = *ray;
+  refractedRay.origin = ray->origin + (ray->length+EPSILON)*ray->direction;
   // Check whether it is a refraction.
   if (dotProduct(t, normalVector) <= 0.0){
-    ray->direction = normalized(t);
+    refractedRay.direction = normalized(t);
   }
   // Otherwise, it is a total reflection.
   else {
@@ -35,15 +47,19 @@ Color RefractionShader::shade(Ray * ray) const {
     Vector3d const reflectionVector = ray->direction - 2*dotProduct(normalVector,ray->direction)*normalVector;
 
     // Change the ray direction and origin
-    ray->direction = normalized(reflectionVector);
+    refractedRay.direction = normalized(reflectionVector);
   }
 
   // Reset the ray
-  ray->length = INFINITY;
-  ray->primitive = 0;
+  // Note: Differentials are only propagated through reflections
+  refractedRay.length = INFINITY;
+  refractedRay.primitive = 0;
+  refractedRay.hasDifferentials = false;
 
-  // Send out a new refracted ray into the scene
-  return this->parentScene_->traceRay(ray);
+  // All of the color comes from the refracted ray
+  secondaryRays[0].weight = Color(1,1,1);
+  *secondaryCount = 1;
+  return Color();
 }
 
 bool RefractionShader::isTransparent() const {
@@ -13,6 +13,7 @@ public:
 
   // Shader functions
   virtual Color shade(Ray * ray) const;
+  virtual Color shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const;
   virtual bool isTransparent() const;
 
 private:
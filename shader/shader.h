@@ -7,6 +7,12 @@
 // Forward declarations
 class Scene;
 
+// A ray spawned by a shader, whose color adds to the pixel with the given weight
+struct SecondaryRay {
+  Ray ray;
+  Color weight;
+};
+
 class Shader {
   friend class Scene;
 
@@ -20,6 +26,23 @@ public:
 
   // Shader functions
   virtual Color shade(Ray * ray) const = 0;
+  // Color of the surface without any lighting, e.g. for the albedo channel
+  // of a FrameBuffer. Shaders without a surface color report white.
+  virtual Color albedo(Ray const& ray) const {
+    (void)ray; // unused in the default implementation
+    return Color(1,1,1);
+  }
+
+  // Deferred shading (see WavefrontRenderer): instead of tracing its secondary
+  // rays, a shader returns the color of the hit itself and stores the rays
+  // that still have to be traced, at most maximumSecondaryRays of them. The
+  // default implementation shades the whole path right away.
+  static int const maximumSecondaryRays = 2;
+  virtual Color shadeDeferred(Ray * ray, SecondaryRay * secondaryRays, int * secondaryCount) const {
+    (void)secondaryRays; // unused in the default implementation
+    *secondaryCount = 0;
+    return this->shade(ray);
+  }
 
 protected:
   Scene * parentScene_;
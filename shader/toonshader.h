@@ -16,6 +16,7 @@ public:
 
     // Shader functions
     virtual Color shade(Ray * ray) const;
+    virtual Color albedo(Ray const& ray) const { (void)ray; return this->objectColor; }
 
 protected:
   Color objectColor;
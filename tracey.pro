@@ -8,6 +8,7 @@ QMAKE_CXXFLAGS += -march=native -O3
 QMAKE_CXXFLAGS += -fopenmp
 
 QMAKE_LFLAGS += /usr/local/opt/llvm/lib/libiomp5.dylib
+LIBS += -lz
 
 TEMPLATE = app
 SOURCES += main.cpp \
@@ -17,21 +18,45 @@ SOURCES += main.cpp \
 
 HEADERS +=\
 common/common.h \
+common/alignedallocator.h \
 common/boundingbox.h \
+common/bvh.h \
 common/brdfread.h \
 common/color.h \
+common/environmentmap.h \
+common/fastmath.h \
+common/imagestream.h \
+common/imagewriter.h \
+common/framebuffer.h \
 common/kdtree.h \
+common/postprocessing.h \
+common/pixelestimate.h \
 common/progressbar.h \
 common/ray.h \
+common/raydifferentials.h \
+common/raypacket.h \
+common/sampler.h \
 common/texture.h \
+common/tilescheduler.h \
+common/transform.h \
+common/texturecache.h \
 common/vector2d.h \
 common/vector3d.h \
 
 SOURCES +=\
 common/boundingbox.cpp \
+common/bvh.cpp \
+common/environmentmap.cpp \
+common/framebuffer.cpp \
+common/imagestream.cpp \
+common/imagewriter.cpp \
 common/kdtree.cpp \
+common/postprocessing.cpp \
 common/progressbar.cpp \
+common/sampler.cpp \
 common/texture.cpp \
+common/texturecache.cpp \
+common/tilescheduler.cpp \
 
 
 
@@ -68,7 +93,9 @@ light/ambientlight.cpp \
 
 HEADERS +=\
 primitive/primitive.h \
+primitive/dynamicmesh.h \
 primitive/infiniteplane.h \
+primitive/instance.h \
 primitive/objmodel.h \
 primitive/sphere.h \
 primitive/smoothtriangle.h \
@@ -76,7 +103,9 @@ primitive/triangle.h \
 primitive/texturedtriangle.h \
 
 SOURCES +=\
+primitive/dynamicmesh.cpp \
 primitive/infiniteplane.cpp \
+primitive/instance.cpp \
 primitive/objmodel.cpp \
 primitive/sphere.cpp \
 primitive/smoothtriangle.cpp \
@@ -93,28 +122,40 @@ renderer/depthrenderer.h \
 renderer/desaturationrenderer.h \
 renderer/renderer.h \
 renderer/hazerenderer.h \
+renderer/denoisingrenderer.h \
 renderer/simplerenderer.h \
 renderer/superrenderer.h \
+renderer/progressiverenderer.h \
+renderer/wavefrontrenderer.h \
 renderer/depthoffieldrenderer.h \
+renderer/secondaryupsamplingrenderer.h \
 
 SOURCES +=\
 renderer/backgroundrenderer.cpp \
 renderer/depthrenderer.cpp \
 renderer/desaturationrenderer.cpp \
 renderer/hazerenderer.cpp \
+renderer/denoisingrenderer.cpp \
 renderer/simplerenderer.cpp \
 renderer/superrenderer.cpp \
+renderer/progressiverenderer.cpp \
+renderer/wavefrontrenderer.cpp \
 renderer/depthoffieldrenderer.cpp \
+renderer/secondaryupsamplingrenderer.cpp \
 
 
 
 ###  SCENE  ####################################################################
 
 HEADERS +=\
+scene/animation.h \
+scene/bvhscene.h \
 scene/scene.h \
 scene/simplescene.h \
 
 SOURCES +=\
+scene/animation.cpp \
+scene/bvhscene.cpp \
 scene/scene.cpp \
 scene/simplescene.cpp \
 